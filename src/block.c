@@ -1,51 +1,224 @@
 #include "block.h"
+#include "dedup.h"
+#include "journal.h"
+#include "pool.h"
 #include <stdlib.h>
 #include <syslog.h>
 
+// Amount of FAT bytes read at once while scanning
+#define BLOCK_SCAN_SIZE (1 << 20)
+
+// Allocate a list of count blocks before next while FAT is locked
+// Every block is marked BLOCK_EXTENT instead of being linked when next is BLOCK_EXTENT
+// Allocated is set to allocated blocks in ascending order
+// Returns head of allocated list or BLOCK_INVALID on failure
+block alloc_list(disk disk, block next, uint32_t count, int flags, block *allocated);
+
+// Compare blocks for sorting in ascending order
+int compare_blocks(const void *a, const void *b);
+
+// Free first count blocks of list starting at head while FAT is locked
+// Returns block after last freed block or BLOCK_INVALID on failure
+block free_list(disk disk, block head, uint32_t count);
+
+// Mark sorted blocks free in FAT while FAT is locked
+// Returns non-zero on failure
+int release_list(disk disk, const block *blocks, uint32_t count);
+
 block block_alloc(disk disk, block next)
 {
-	syslog(LOG_DEBUG, "allocating block before %u", next);
+	return block_alloc_many(disk, next, 1, 0);
+}
+
+block block_alloc_many(disk disk, block next, uint32_t count, int flags)
+{
+	block *allocated = malloc((size_t) count * sizeof(block));
+
+	disk_fat_lock(disk);
+	const block head = alloc_list(disk, next, count, flags, allocated);
+	disk_fat_unlock(disk);
+
+	free(allocated);
+	return head;
+}
 
-	// Next must be valid or BLOCK_LAST
-	if(next != BLOCK_LAST && !BLOCK_VALID(next)) {
+int block_alloc_extent(disk disk, uint32_t count, int flags, block *blocks)
+{
+	// Blocks cannot gain references before they are zeroed
+	dedup_write_begin(disk);
+	disk_fat_lock(disk);
+	const block head = alloc_list(disk, BLOCK_EXTENT, count, flags, blocks);
+	disk_fat_unlock(disk);
+	dedup_write_end(disk);
+	return head == BLOCK_INVALID ? -1 : 0;
+}
+
+block alloc_list(disk disk, block next, uint32_t count, int flags, block *allocated)
+{
+	syslog(LOG_DEBUG, "allocating %u blocks before %u", count, next);
+
+	// Next must be valid, BLOCK_LAST, BLOCK_SMALL, or BLOCK_EXTENT
+	if(next != BLOCK_LAST && next != (block) BLOCK_SMALL && next != (block) BLOCK_EXTENT && !BLOCK_VALID(next)) {
 		syslog(LOG_ERR, "invalid block %u", next);
 		return BLOCK_INVALID;
 	}
 
+	// Nothing to allocate
+	if(count == 0) {
+		return next;
+	}
+
     const struct superblock *sb = disk_superblock(disk);
-	block *fat_buffer = malloc(sb->block_size);
-
-	// Find a free block using FAT
-	for(uint32_t i = 0; i < sb->fat_block_count; ++i) {
-		// Read FAT
-		const block fat = BLOCK_FAT + i;
-		if(block_read(disk, fat, fat_buffer) != 0) {
-			free(fat_buffer);
+	const uint32_t entry_count = BLOCK_FAT_ENTRY_COUNT(sb);
+	const uint32_t chunk_block_count = sb->block_size < BLOCK_SCAN_SIZE ? BLOCK_SCAN_SIZE / sb->block_size : 1;
+	const size_t chunk_size = (size_t) chunk_block_count * sb->block_size;
+	block *fat_buffer = pool_get(chunk_size);
+	uint32_t found = 0;
+
+	// Consecutive run of free blocks
+	block run_start = BLOCK_INVALID;
+	uint32_t run_count = 0;
+
+	// Find free blocks in a single pass over the FAT preferring a contiguous run
+	for(uint32_t i = 0; i < sb->fat_block_count && run_count < count;) {
+		const uint32_t chunk_count = sb->fat_block_count - i < chunk_block_count ? sb->fat_block_count - i : chunk_block_count;
+		if(block_read_many(disk, BLOCK_FAT + i, chunk_count, fat_buffer) != 0) {
+			pool_put(fat_buffer, chunk_size);
 			return BLOCK_INVALID;
 		}
 
-		for(uint32_t j = 0; j < BLOCK_FAT_ENTRY_COUNT(sb); ++j) {
-			// Found free block
-			if(fat_buffer[j] == BLOCK_FREE) {
-				const block allocated = j + i * BLOCK_FAT_ENTRY_COUNT(sb);
-				fat_buffer[j] = next;
+		for(uint32_t j = 0; j < chunk_count * entry_count && run_count < count; ++j) {
+			const uint64_t b = (uint64_t) i * entry_count + j;
+			if(b >= sb->block_count || fat_buffer[j] != BLOCK_FREE) {
+				continue;
+			}
+
+			// Remember first free blocks in case there is no contiguous run
+			if(found < count) {
+				allocated[found++] = b;
+			}
+
+			if(run_count > 0 && b == run_start + run_count) {
+				++run_count;
+			} else {
+				run_start = b;
+				run_count = 1;
+			}
+		}
+
+		i += chunk_count;
+	}
 
-				// Write updated FAT
-				if(block_write(disk, fat, fat_buffer) != 0) {
-					free(fat_buffer);
-					return BLOCK_INVALID;
-				}
+	if(run_count == count) {
+		for(uint32_t k = 0; k < count; ++k) {
+			allocated[k] = run_start + k;
+		}
+	} else if(found < count || flags & BLOCK_ALLOC_CONTIGUOUS) {
+		pool_put(fat_buffer, chunk_size);
+		syslog(LOG_ERR, "failed to allocate %u blocks", count);
+		return BLOCK_INVALID;
+	}
 
-				free(fat_buffer);
-				syslog(LOG_DEBUG, "allocated block before %u", next);
-				return allocated;
+	// Prepare host storage run by run before blocks are linked so failures leave FAT untouched
+	// Blocks stay free meanwhile but nothing else allocates them while FAT is locked
+	run_count = 0;
+	for(uint32_t k = 0; k <= count; ++k) {
+		if(k < count && run_count > 0 && allocated[k] == run_start + run_count) {
+			++run_count;
+			continue;
+		}
+
+		int err = 0;
+		if(run_count > 0) {
+			if(flags & BLOCK_ALLOC_ZERO) {
+				err = block_zero(disk, run_start, run_count);
+			} else if(flags & BLOCK_ALLOC_RESERVE) {
+				err = block_reserve(disk, run_start, run_count);
 			}
 		}
+
+		if(err != 0) {
+			pool_put(fat_buffer, chunk_size);
+			syslog(LOG_ERR, "failed to prepare %u blocks at %u", run_count, run_start);
+			return BLOCK_INVALID;
+		}
+
+		if(k < count) {
+			run_start = allocated[k];
+			run_count = 1;
+		}
 	}
 
-	free(fat_buffer);
-	syslog(LOG_ERR, "failed to allocate block");
-	return BLOCK_INVALID;
+	// Link blocks in ascending order so first allocated block is before next
+	// Each FAT block is read and written once since blocks are ascending
+	// Blocks of FAT blocks already written are freed again when a later one fails
+	block fat = BLOCK_INVALID;
+	uint32_t linked = 0;
+	int err = 0;
+	for(uint32_t k = 0; k < count && err == 0; ++k) {
+		const block b = allocated[k];
+
+		if(BLOCK_FAT_BLOCK(sb, b) != fat) {
+			if(BLOCK_VALID(fat) && block_write(disk, fat, fat_buffer) != 0) {
+				err = -1;
+				break;
+			}
+
+			linked = k;
+			fat = BLOCK_FAT_BLOCK(sb, b);
+			err = block_read(disk, fat, fat_buffer);
+		}
+
+		fat_buffer[BLOCK_FAT_ENTRY(sb, b)] = k == 0 || next == (block) BLOCK_EXTENT ? next : allocated[k - 1];
+	}
+
+	if(err == 0 && block_write(disk, fat, fat_buffer) != 0) {
+		err = -1;
+	}
+
+	if(err != 0) {
+		pool_put(fat_buffer, chunk_size);
+		release_list(disk, allocated, linked);
+		syslog(LOG_ERR, "failed to link %u blocks", count);
+		return BLOCK_INVALID;
+	}
+
+	const block head = allocated[count - 1];
+	pool_put(fat_buffer, chunk_size);
+	syslog(LOG_DEBUG, "allocated %u blocks before %u", count, next);
+	return head;
+}
+
+uint32_t block_count_free(disk disk)
+{
+	syslog(LOG_DEBUG, "counting free blocks");
+
+    const struct superblock *sb = disk_superblock(disk);
+	const uint32_t entry_count = BLOCK_FAT_ENTRY_COUNT(sb);
+	const uint32_t chunk_block_count = sb->block_size < BLOCK_SCAN_SIZE ? BLOCK_SCAN_SIZE / sb->block_size : 1;
+	const size_t chunk_size = (size_t) chunk_block_count * sb->block_size;
+	block *fat_buffer = pool_get(chunk_size);
+	uint32_t free_count = 0;
+
+	// Count free entries chunk by chunk
+	for(uint32_t i = 0; i < sb->fat_block_count;) {
+		const uint32_t chunk_count = sb->fat_block_count - i < chunk_block_count ? sb->fat_block_count - i : chunk_block_count;
+		if(block_read_many(disk, BLOCK_FAT + i, chunk_count, fat_buffer) != 0) {
+			break;
+		}
+
+		for(uint32_t j = 0; j < chunk_count * entry_count; ++j) {
+			if((uint64_t) i * entry_count + j < sb->block_count && fat_buffer[j] == BLOCK_FREE) {
+				++free_count;
+			}
+		}
+
+		i += chunk_count;
+	}
+
+	pool_put(fat_buffer, chunk_size);
+	syslog(LOG_DEBUG, "counted %u free blocks", free_count);
+	return free_count;
 }
 
 int block_free(disk disk, block head)
@@ -58,29 +231,86 @@ int block_free(disk disk, block head)
 		return -1;
 	}
 
-    const struct superblock *sb = disk_superblock(disk);
-	const block fat = BLOCK_FAT_BLOCK(sb, head);
-	block *fat_buffer = malloc(sb->block_size);
+	// Block is freed once the operation freeing it commits
+	if(journal_free(disk, &head, 1) == 0) {
+		syslog(LOG_DEBUG, "freed block %u", head);
+		return 0;
+	}
+
+	disk_fat_lock(disk);
+	const int err = release_list(disk, &head, 1);
+	disk_fat_unlock(disk);
 
-	// Read FAT
-	if(block_read(disk, fat, fat_buffer) != 0) {
-		free(fat_buffer);
+	if(err != 0) {
 		return -1;
 	}
 
-	fat_buffer[BLOCK_FAT_ENTRY(sb, head)] = BLOCK_FREE;
+	syslog(LOG_DEBUG, "freed block %u", head);
+	return 0;
+}
+
+int block_free_extent(disk disk, block offset, uint32_t count)
+{
+	syslog(LOG_DEBUG, "freeing %u extent blocks at %u", count, offset);
+
+	// Nothing to free
+	if(count == 0) {
+		return 0;
+	}
+
+	// Blocks other file blocks still map only lose a reference
+	// Blocks cannot gain references until they are queued to be freed
+	block *freed = malloc((size_t) count * sizeof(block));
+	uint32_t freed_count = 0;
+	dedup_write_begin(disk);
+	for(uint32_t k = 0; k < count; ++k) {
+		bool shared;
+		if(dedup_release(disk, offset + k, &shared) != 0) {
+			dedup_write_end(disk);
+			free(freed);
+			return -1;
+		}
+
+		if(!shared) {
+			freed[freed_count++] = offset + k;
+		}
+	}
+
+	// Blocks are freed once the operation freeing them commits
+	int err = 0;
+	if(freed_count > 0 && journal_free(disk, freed, freed_count) != 0) {
+		disk_fat_lock(disk);
+		err = release_list(disk, freed, freed_count);
+		disk_fat_unlock(disk);
 
-	// Write updated FAT
-	if(block_write(disk, fat, fat_buffer) != 0) {
-		free(fat_buffer);
+		if(err == 0) {
+			block_discard_list(disk, freed, freed_count);
+		}
+	}
+
+	dedup_write_end(disk);
+	free(freed);
+	if(err != 0) {
 		return -1;
 	}
 
-	free(fat_buffer);
-	syslog(LOG_DEBUG, "freed block %u", head);
+	syslog(LOG_DEBUG, "freed %u extent blocks at %u", count, offset);
 	return 0;
 }
 
+block block_free_many(disk disk, block head, uint32_t count)
+{
+	// Nothing to free
+	if(count == 0) {
+		return head;
+	}
+
+	disk_fat_lock(disk);
+	const block next = free_list(disk, head, count);
+	disk_fat_unlock(disk);
+	return next;
+}
+
 block block_next(disk disk, block previous)
 {
 	syslog(LOG_DEBUG, "retreiving block after %u", previous);
@@ -92,19 +322,193 @@ block block_next(disk disk, block previous)
 	}
 
     const struct superblock *sb = disk_superblock(disk);
-	const block fat = BLOCK_FAT_BLOCK(sb, previous);
-	block *fat_buffer = malloc(sb->block_size);
 
-	// Read FAT
-	if(block_read(disk, fat, fat_buffer) != 0) {
-		free(fat_buffer);
+	// Cached FAT is read without locking so concurrent readers do not contend
+	const block *entries = disk_fat_cache(disk, BLOCK_FAT_BLOCK(sb, previous) - BLOCK_FAT);
+	if(!entries) {
 		return BLOCK_INVALID;
 	}
 
-	// Get next block according to FAT
-	block next = fat_buffer[BLOCK_FAT_ENTRY(sb, previous)];
+	const block next = __atomic_load_n(&entries[BLOCK_FAT_ENTRY(sb, previous)], __ATOMIC_RELAXED);
 
-	free(fat_buffer);
 	syslog(LOG_DEBUG, "retreived block %u after %u", next, previous);
 	return next;
 }
+
+uint32_t block_next_run(disk disk, block head, uint32_t max, block *next)
+{
+	syslog(LOG_DEBUG, "retreiving run of at most %u blocks at %u", max, head);
+
+	// Head must be valid
+	if(!BLOCK_VALID(head) || max == 0) {
+		syslog(LOG_ERR, "invalid block %u", head);
+		return 0;
+	}
+
+	const struct superblock *sb = disk_superblock(disk);
+
+	// Follow list while it steps down to the block below using cached FAT without locking
+	uint32_t count = 0;
+	block current = head;
+	while(count < max) {
+		const block *entries = disk_fat_cache(disk, BLOCK_FAT_BLOCK(sb, current) - BLOCK_FAT);
+		if(!entries) {
+			return 0;
+		}
+
+		// Entries of a run below current are in the same FAT block until its first entry
+		uint32_t k = BLOCK_FAT_ENTRY(sb, current);
+		for(;;) {
+			*next = __atomic_load_n(&entries[k], __ATOMIC_RELAXED);
+			++count;
+			if(count == max || k == 0 || *next != current - 1) {
+				break;
+			}
+
+			current = *next;
+			--k;
+		}
+
+		if(count == max || *next != current - 1) {
+			break;
+		}
+
+		// Run continues into previous FAT block
+		current = *next;
+	}
+
+	syslog(LOG_DEBUG, "retreived run of %u blocks at %u", count, head);
+	return count;
+}
+
+int block_discard_list(disk disk, const block *blocks, uint32_t count)
+{
+	// Discard host storage run by run
+	int err = 0;
+	uint32_t run = 0;
+	for(uint32_t k = 1; k <= count; ++k) {
+		if(k == count || blocks[k] != blocks[k - 1] + 1) {
+			err |= block_discard(disk, blocks[run], k - run);
+			run = k;
+		}
+	}
+
+	return err ? -1 : 0;
+}
+
+int block_release(disk disk, block *blocks, uint32_t count)
+{
+	qsort(blocks, count, sizeof(block), compare_blocks);
+
+	disk_fat_lock(disk);
+	const int err = release_list(disk, blocks, count);
+	disk_fat_unlock(disk);
+	return err;
+}
+
+int compare_blocks(const void *a, const void *b)
+{
+	const block x = *(const block *) a;
+	const block y = *(const block *) b;
+	return (x > y) - (x < y);
+}
+
+block free_list(disk disk, block head, uint32_t count)
+{
+	syslog(LOG_DEBUG, "freeing %u blocks from %u", count, head);
+
+	// Head must be valid
+	if(!BLOCK_VALID(head)) {
+		syslog(LOG_ERR, "invalid block %u", head);
+		return BLOCK_INVALID;
+	}
+
+    const struct superblock *sb = disk_superblock(disk);
+	block *fat_buffer = pool_get(sb->block_size);
+	uint32_t capacity = 64;
+	block *freed = malloc(capacity * sizeof(block));
+	uint32_t found = 0;
+
+	// Walk list once reading each FAT block only when the walk enters it
+	block fat = BLOCK_INVALID;
+	block current = head;
+	while(found < count && BLOCK_VALID(current)) {
+		// Lists can never be longer than the disk
+		if(found == sb->block_count) {
+			syslog(LOG_ERR, "block list at %u loops", head);
+			free(freed);
+			pool_put(fat_buffer, sb->block_size);
+			return BLOCK_INVALID;
+		}
+
+		if(BLOCK_FAT_BLOCK(sb, current) != fat) {
+			fat = BLOCK_FAT_BLOCK(sb, current);
+			if(block_read(disk, fat, fat_buffer) != 0) {
+				free(freed);
+				pool_put(fat_buffer, sb->block_size);
+				return BLOCK_INVALID;
+			}
+		}
+
+		if(found == capacity) {
+			capacity *= 2;
+			freed = realloc(freed, capacity * sizeof(block));
+		}
+
+		freed[found++] = current;
+		current = fat_buffer[BLOCK_FAT_ENTRY(sb, current)];
+	}
+
+	// Blocks are freed once the operation freeing them commits
+	qsort(freed, found, sizeof(block), compare_blocks);
+	if(journal_free(disk, freed, found) != 0) {
+		if(release_list(disk, freed, found) != 0) {
+			free(freed);
+			pool_put(fat_buffer, sb->block_size);
+			return BLOCK_INVALID;
+		}
+
+		block_discard_list(disk, freed, found);
+	}
+
+	free(freed);
+	pool_put(fat_buffer, sb->block_size);
+	syslog(LOG_DEBUG, "freed %u blocks from %u", found, head);
+	return current;
+}
+
+int release_list(disk disk, const block *blocks, uint32_t count)
+{
+	syslog(LOG_DEBUG, "releasing %u blocks", count);
+
+    const struct superblock *sb = disk_superblock(disk);
+	block *fat_buffer = pool_get(sb->block_size);
+
+	// Group FAT updates by FAT block so each one is read and written once
+	block fat = BLOCK_INVALID;
+	for(uint32_t k = 0; k < count; ++k) {
+		if(BLOCK_FAT_BLOCK(sb, blocks[k]) != fat) {
+			if(BLOCK_VALID(fat) && block_write(disk, fat, fat_buffer) != 0) {
+				pool_put(fat_buffer, sb->block_size);
+				return -1;
+			}
+
+			fat = BLOCK_FAT_BLOCK(sb, blocks[k]);
+			if(block_read(disk, fat, fat_buffer) != 0) {
+				pool_put(fat_buffer, sb->block_size);
+				return -1;
+			}
+		}
+
+		fat_buffer[BLOCK_FAT_ENTRY(sb, blocks[k])] = BLOCK_FREE;
+	}
+
+	if(BLOCK_VALID(fat) && block_write(disk, fat, fat_buffer) != 0) {
+		pool_put(fat_buffer, sb->block_size);
+		return -1;
+	}
+
+	pool_put(fat_buffer, sb->block_size);
+	syslog(LOG_DEBUG, "released %u blocks", count);
+	return 0;
+}
@@ -7,47 +7,143 @@
 #define BLOCK_FREE			 0
 #define BLOCK_INVALID		-1
 #define BLOCK_LAST			-2
+#define BLOCK_SMALL			-3 // Block holds cells of small objects
+#define BLOCK_EXTENT		-4 // Block holds data of a file mapped by extents
 
 // Static block locations
 #define BLOCK_SUPERBLOCK	 0
 #define BLOCK_FAT			 (BLOCK_SUPERBLOCK + 1)
 
-#define BLOCK_VALID(block) 	 (block != BLOCK_INVALID && block != BLOCK_LAST)
+#define BLOCK_VALID(block) 	 (block != BLOCK_INVALID && block != BLOCK_LAST && block != BLOCK_SMALL && block != BLOCK_EXTENT)
+
+// Maximum amount of blocks addressable by a FAT entry
+#define BLOCK_COUNT_MAX		 ((uint64_t) (block) BLOCK_EXTENT)
 
 // FAT access helpers
 #define BLOCK_FAT_ENTRY_COUNT(sb)	(sb->block_size / sizeof(block))
 #define BLOCK_FAT_BLOCK(sb, block)	(BLOCK_FAT + block / BLOCK_FAT_ENTRY_COUNT(sb))
 #define BLOCK_FAT_ENTRY(sb, block)	(block % BLOCK_FAT_ENTRY_COUNT(sb))
 
+// Block allocation flags
+#define BLOCK_ALLOC_RESERVE	(1 << 0) // Reserve host storage of allocated blocks
+#define BLOCK_ALLOC_ZERO	(1 << 1) // Zero allocated blocks
+#define BLOCK_ALLOC_CONTIGUOUS	(1 << 2) // Fail unless blocks can be contiguous
+
 // A filesystem block pointer
 typedef uint32_t block;
 
 // Allocate a block before next
-// Next can be BLOCK_LAST
+// Next can be BLOCK_LAST or BLOCK_SMALL
 // Returns BLOCK_INVALID on failure
 block block_alloc(disk disk, block next);
 
+// Allocate a list of count blocks before next using block allocation flags
+// Blocks are contiguous when possible and nothing is allocated on failure
+// Next can be BLOCK_LAST or BLOCK_SMALL
+// Returns head of allocated list or BLOCK_INVALID on failure
+block block_alloc_many(disk disk, block next, uint32_t count, int flags);
+
+// Allocate count blocks of extent mapped file data marking each BLOCK_EXTENT
+// Blocks are contiguous when possible and nothing is allocated on failure
+// Blocks is set to allocated blocks in ascending order
+// Returns non-zero on failure
+int block_alloc_extent(disk disk, uint32_t count, int flags, block *blocks);
+
+// Count free blocks using FAT
+uint32_t block_count_free(disk disk);
+
 // Free head in block list
+// Block is freed once the current journaled operation commits
 // Head must be valid
 // Returns non-zero on failure
 int block_free(disk disk, block head);
 
+// Free count consecutive blocks of extent mapped file data starting at offset
+// Blocks other file blocks still map only lose a reference
+// Blocks are freed once the current journaled operation commits
+// Returns non-zero on failure
+int block_free_extent(disk disk, block offset, uint32_t count);
+
+// Free first count blocks of block list starting at head
+// FAT updates are grouped so each FAT block is written once
+// Freed blocks are discarded when disk was opened with DISK_DISCARD
+// Blocks are freed once the current journaled operation commits
+// Head must be valid unless count is zero
+// Returns block after last freed block or BLOCK_INVALID on failure
+block block_free_many(disk disk, block head, uint32_t count);
+
+// Release host storage of count consecutive blocks starting at offset
+// Does nothing unless disk was opened with DISK_DISCARD
+// Returns non-zero on failure
+int block_discard(disk disk, block offset, uint32_t count);
+
+// Release host storage of count sorted blocks
+// Does nothing unless disk was opened with DISK_DISCARD
+// Returns non-zero on failure
+int block_discard_list(disk disk, const block *blocks, uint32_t count);
+
 // Get next block in block list
 // Previous must be valid or BLOCK_LAST
+// Reads cached FAT without locking
 // Returns BLOCK_LAST when previous is last block
 // Returns BLOCK_INVALID on failure
 block block_next(disk disk, block previous);
 
+// Count the run of consecutive descending blocks starting at head in block list
+// Such runs hold data that is contiguous on disk in ascending block order
+// At most max blocks are counted without locking FAT
+// Next is set to block after run
+// Head must be valid
+// Returns zero on failure
+uint32_t block_next_run(disk disk, block head, uint32_t max, block *next);
+
 // Read entire contents of specified block to buffer
 // Offset must be valid
 // Buffer must be size of a block
 // Returns non-zero on failure
 int block_read(disk disk, block offset, void *buffer);
 
+// Read entire contents of count consecutive blocks starting at offset to buffer
+// Offset must be valid
+// Buffer must be size of count blocks
+// Returns non-zero on failure
+int block_read_many(disk disk, block offset, uint32_t count, void *buffer);
+
+// Read size bytes at position within block at offset
+// Avoids reading whole blocks when only a few bytes of a large block are needed
+// Offset must be valid
+// Returns non-zero on failure
+int block_read_range(disk disk, block offset, uint32_t position, uint32_t size, void *buffer);
+
+// Free entire block list starting at head
+// List is freed in the background when disk was opened with DISK_RECLAIM
+// Returns non-zero on failure
+int block_reclaim(disk disk, block head);
+
+// Mark count blocks free in FAT right away
+// Blocks are sorted in place
+// Returns non-zero on failure
+int block_release(disk disk, block *blocks, uint32_t count);
+
+// Reserve host storage of count consecutive blocks starting at offset
+// Reservation is a hint and may silently not happen
+// Returns non-zero on failure
+int block_reserve(disk disk, block offset, uint32_t count);
+
 // Write entire contents of specified block from buffer
 // Offset must be valid
 // Buffer must be size of a block
 // Returns zero on success; otherwise, returns non-zero
 int block_write(disk disk, block offset, const void *buffer);
 
+// Write entire contents of count consecutive blocks starting at offset from buffer
+// Offset must be valid
+// Buffer must be size of count blocks
+// Returns zero on success; otherwise, returns non-zero
+int block_write_many(disk disk, block offset, uint32_t count, const void *buffer);
+
+// Zero count consecutive blocks starting at offset
+// Returns non-zero on failure
+int block_zero(disk disk, block offset, uint32_t count);
+
 #endif
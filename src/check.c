@@ -0,0 +1,1074 @@
+#include "check.h"
+#include "dedup.h"
+#include "entry.h"
+#include "extent.h"
+#include "small.h"
+#include "snapshot.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+// Amount of FAT bytes read at once
+#define CHECK_BATCH_SIZE (8 << 20)
+
+// Maximum amount of threads walking directories
+#define CHECK_THREAD_MAX 32
+
+// Result of following a reference to blocks or cells
+enum reach_state {
+	REACH_OK,
+	REACH_BROKEN, // Reference runs into something that cannot be referenced
+	REACH_SHARED, // Reference runs into something already referenced
+	REACH_EXCESS, // Reference goes on past its expected end
+};
+
+// Blocks of a block list in list order
+struct check_chain {
+	block *blocks;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+// A directory waiting to be walked
+struct check_dir {
+	address addr; // Address of directory entry
+	struct entry ent;
+	block *blocks; // Blocks of directory in list order
+	uint32_t count;
+	struct check_dir *next;
+};
+
+// State shared by threads checking a disk
+struct check {
+	disk d;
+	const struct superblock *sb;
+	bool repair;
+	FILE *out;
+	struct check_report *report;
+	block *fat;
+	uint64_t *reached; // Bitmap of blocks reached through entries
+	uint8_t *fat_dirty; // Repaired FAT blocks
+	block *smalls; // Small blocks in ascending order
+	uint32_t small_count;
+	uint8_t *cells; // Bitmaps of small block cells reached through entries
+	struct dedup_count *shared; // Reference counts of shared extent blocks ordered by block
+	uint32_t *shared_reached; // Amount of file blocks reaching each shared extent block
+	uint32_t shared_count;
+
+	pthread_mutex_t lock; // Protects directory queue, output, and disk writes
+	pthread_cond_t cond;
+	struct check_dir *queue;
+	uint32_t busy; // Directories queued or being walked
+	bool failed; // Set atomically by any thread whose read or repair write failed
+};
+
+// Check directory entries of a directory and queue its subdirectories
+void check_directory(struct check *c, struct check_dir *dir, struct check_chain *chain);
+
+// Check extent map of a file entry and blocks it maps fixing entry in memory
+// Map is cut at its first invalid extent or where entry size ends
+// Changed is set when entry needs to be written
+void check_extents(struct check *c, struct check_chain *chain, address addr, struct entry *ent, bool *changed);
+
+// Check an entry and its block list fixing entry in memory
+// Changed is set when entry needs to be written
+// Returns non-zero when entry is a directory to walk
+bool check_entry(struct check *c, struct check_chain *chain, address addr, struct entry *ent, bool *changed);
+
+// Check for allocated blocks no entry reached
+void check_leaks(struct check *c);
+
+// Read FAT in large batches and find small blocks
+// Returns non-zero on failure
+int check_load(struct check *c);
+
+// Walk queued directories until every directory is walked
+void *check_loop(void *data);
+
+// Describe a problem and count it
+void check_problem(struct check *c, uint64_t *counter, const char *format, ...);
+
+// Queue a directory to walk
+void check_queue(struct check *c, address addr, const struct entry *ent, const struct check_chain *chain);
+
+// Read directory data of size bytes stored in blocks
+// Returns non-zero on failure
+int check_read(struct check *c, const block *blocks, uint32_t size, void *data);
+
+// Mark a small block cell reached
+enum reach_state check_reach_cell(struct check *c, block small, uint32_t cell);
+
+// Check reference counts of shared extent blocks against file blocks reaching them
+void check_refcounts(struct check *c);
+
+// Check root entry held alone by root block and queue its directory
+// Returns non-zero when root directory cannot be walked
+int check_root(struct check *c, block root_block);
+
+// Find reach counter of shared extent block
+// Returns NULL when block is not shared
+uint32_t *check_shared(struct check *c, block b);
+
+// Check small block cell bitmaps against cells reached through entries
+void check_smalls(struct check *c);
+
+// Walk snapshot table list and check root directory of each snapshot
+// Returns non-zero when a snapshot root directory cannot be walked
+int check_snapshots(struct check *c);
+
+// Walk reference count table list and load shared extent blocks
+void check_table(struct check *c);
+
+// End block list of entry after first keep blocks of chain
+// Blocks past the end are left for leak checking since another list may own them
+void check_truncate(struct check *c, struct entry *ent, struct check_chain *chain, uint32_t keep);
+
+// Follow at most limit blocks of block list starting at head marking them reached
+enum reach_state check_walk(struct check *c, block head, uint32_t limit, struct check_chain *chain);
+
+// Write repaired FAT blocks
+// Returns non-zero on failure
+int check_write_fat(struct check *c);
+
+// Write a repaired entry
+void check_write_entry(struct check *c, address addr, const struct entry *ent);
+
+int check_disk(disk d, bool repair, FILE *out, struct check_report *report)
+{
+	syslog(LOG_DEBUG, "checking disk");
+
+	const struct superblock *sb = disk_superblock(d);
+	memset(report, 0, sizeof(struct check_report));
+
+	// Superblock must describe a usable disk
+	if(sb->magic != DISK_MAGIC || sb->block_size < 2 * sizeof(struct entry) || sb->root_block >= sb->block_count
+			|| (uint64_t) sb->fat_block_count * BLOCK_FAT_ENTRY_COUNT(sb) < sb->block_count) {
+		syslog(LOG_ERR, "invalid superblock");
+		return -1;
+	}
+
+	struct check c = {
+		.d = d,
+		.sb = sb,
+		.repair = repair,
+		.out = out,
+		.report = report,
+		.shared = NULL,
+		.shared_reached = NULL,
+		.shared_count = 0,
+		.queue = NULL,
+		.busy = 0,
+		.failed = false,
+	};
+
+	pthread_mutex_init(&c.lock, NULL);
+	pthread_cond_init(&c.cond, NULL);
+	c.reached = calloc(sb->block_count / 64 + 1, sizeof(uint64_t));
+	c.fat_dirty = calloc(sb->fat_block_count, 1);
+
+	int err = check_load(&c);
+	if(err == 0 && (sb->features & DISK_FEATURE_DEDUP)) {
+		check_table(&c);
+	}
+
+	if(err == 0) {
+		err = check_root(&c, sb->root_block);
+	}
+
+	// Snapshot directories reach shared extent blocks too
+	if(err == 0 && (sb->features & DISK_FEATURE_SNAPSHOT)) {
+		err = check_snapshots(&c);
+	}
+
+	if(err == 0) {
+		// Walk directories in parallel
+		long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = thread_count < 1 ? 1 : thread_count > CHECK_THREAD_MAX ? CHECK_THREAD_MAX : thread_count;
+
+		pthread_t threads[CHECK_THREAD_MAX];
+		long started = 0;
+		while(started < thread_count && pthread_create(&threads[started], NULL, check_loop, &c) == 0) {
+			++started;
+		}
+
+		// Walk on calling thread when no thread could be started
+		if(started == 0) {
+			check_loop(&c);
+		}
+
+		for(long i = 0; i < started; ++i) {
+			pthread_join(threads[i], NULL);
+		}
+
+		check_smalls(&c);
+		check_refcounts(&c);
+		check_leaks(&c);
+
+		if(repair && (check_write_fat(&c) != 0 || __atomic_load_n(&c.failed, __ATOMIC_RELAXED))) {
+			err = -1;
+		}
+	}
+
+	if(err == 0 && repair) {
+		report->repaired = check_problems(report);
+	}
+
+	free(c.shared);
+	free(c.shared_reached);
+	free(c.cells);
+	free(c.smalls);
+	free(c.fat);
+	free(c.fat_dirty);
+	free(c.reached);
+	pthread_cond_destroy(&c.cond);
+	pthread_mutex_destroy(&c.lock);
+
+	if(err != 0) {
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "checked disk: %lu problems", (unsigned long) check_problems(report));
+	return 0;
+}
+
+uint64_t check_problems(const struct check_report *report)
+{
+	return report->leaked_blocks
+		+ report->cross_links
+		+ report->broken_chains
+		+ report->size_mismatches
+		+ report->bad_entries
+		+ report->bad_cells
+		+ report->bad_free_lists
+		+ report->bad_reserved
+		+ report->bad_refcounts;
+}
+
+void check_directory(struct check *c, struct check_dir *dir, struct check_chain *chain)
+{
+	const struct superblock *sb = c->sb;
+	struct entry *parent = &dir->ent;
+	const uint32_t count = parent->size / sizeof(struct entry);
+	if(count == 0) {
+		return;
+	}
+
+	struct entry *children = malloc(parent->size);
+	if(check_read(c, dir->blocks, parent->size, children) != 0) {
+		free(children);
+		__atomic_store_n(&c->failed, true, __ATOMIC_RELAXED);
+		return;
+	}
+
+	uint32_t tombstone_count = 0;
+	for(uint32_t i = 0; i < count; ++i) {
+		if(ENTRY_TOMBSTONE(children[i])) {
+			++tombstone_count;
+			continue;
+		}
+
+		const address addr = dir_locate(sb, dir->blocks, parent->size, (i + 1) * sizeof(struct entry));
+		bool changed = false;
+		const bool walk = check_entry(c, chain, addr, &children[i], &changed);
+
+		if(changed && c->repair) {
+			check_write_entry(c, addr, &children[i]);
+		}
+
+		if(walk) {
+			check_queue(c, addr, &children[i], chain);
+		}
+	}
+
+	// Free slot list must link every tombstone once with its remaining length
+	bool *listed = calloc(count, sizeof(bool));
+	uint32_t listed_count = 0;
+	bool valid = true;
+	for(uint32_t slot = parent->free_slot; slot != 0 && valid; slot = children[slot - 1].free_slot) {
+		valid = slot <= count
+			&& ENTRY_TOMBSTONE(children[slot - 1])
+			&& !listed[slot - 1]
+			&& children[slot - 1].size == tombstone_count - listed_count;
+
+		if(valid) {
+			listed[slot - 1] = true;
+			++listed_count;
+		}
+	}
+
+	free(listed);
+
+	if(!valid || listed_count != tombstone_count) {
+		check_problem(c, &c->report->bad_free_lists, "free slot list of directory %u:%u does not match its %u tombstones",
+				dir->addr.end_block, dir->addr.end_offset, tombstone_count);
+
+		if(c->repair) {
+			// Link tombstones again in slot order
+			uint32_t next = 0;
+			uint32_t remaining = 0;
+			for(uint32_t i = count; i-- > 0;) {
+				if(ENTRY_TOMBSTONE(children[i])) {
+					memset(&children[i], 0, sizeof(struct entry));
+					children[i].free_slot = next;
+					children[i].size = ++remaining;
+					check_write_entry(c, dir_locate(sb, dir->blocks, parent->size, (i + 1) * sizeof(struct entry)), &children[i]);
+					next = i + 1;
+				}
+			}
+
+			parent->free_slot = next;
+			check_write_entry(c, dir->addr, parent);
+		}
+	}
+
+	free(children);
+}
+
+bool check_entry(struct check *c, struct check_chain *chain, address addr, struct entry *ent, bool *changed)
+{
+	const struct superblock *sb = c->sb;
+	struct check_report *report = c->report;
+
+	// Name must be readable
+	enum reach_state name_state = REACH_OK;
+	if(ENTRY_LONG_NAME(*ent)) {
+		name_state = ent->long_name.length > ENTRY_NAME_MAX(sb) ? REACH_BROKEN : check_reach_cell(c, ent->long_name.small_block, ent->long_name.cell);
+	} else if(ent->name[0] == '\0' || ent->name[ENTRY_NAME_LENGTH] != '\0') {
+		name_state = REACH_BROKEN;
+	}
+
+	if(name_state != REACH_OK) {
+		check_problem(c, name_state == REACH_SHARED ? &report->cross_links : &report->bad_entries, "name of entry %u:%u is %s",
+				addr.end_block, addr.end_offset, name_state == REACH_SHARED ? "shared" : "invalid");
+
+		// Entry keeps a name that cannot collide with another entry
+		memset(ent->name, 0, sizeof(ent->name));
+		snprintf(ent->name, sizeof(ent->name), "lost%u.%u", addr.end_block, addr.end_offset);
+		*changed = true;
+	}
+
+	if(ENTRY_INLINE(*ent)) {
+		__atomic_add_fetch(&report->files, 1, __ATOMIC_RELAXED);
+
+		const enum reach_state state = ent->size == 0 || ent->size > sb->inline_size
+			? REACH_BROKEN
+			: check_reach_cell(c, ent->start_block, ent->inline_cell - 1);
+
+		if(state != REACH_OK) {
+			check_problem(c, state == REACH_SHARED ? &report->cross_links : &report->bad_entries, "inline data of entry %u:%u at %u:%u is %s",
+					addr.end_block, addr.end_offset, ent->start_block, ent->inline_cell - 1, state == REACH_SHARED ? "shared" : "invalid");
+
+			ent->size = 0;
+			ent->start_block = BLOCK_LAST;
+			ent->inline_cell = 0;
+			*changed = true;
+		}
+
+		return false;
+	}
+
+	if(ENTRY_EXTENTS(sb, *ent)) {
+		__atomic_add_fetch(&report->files, 1, __ATOMIC_RELAXED);
+		check_extents(c, chain, addr, ent, changed);
+		return false;
+	}
+
+	const bool directory = S_ISDIR(ent->mode);
+	__atomic_add_fetch(directory ? &report->directories : &report->files, 1, __ATOMIC_RELAXED);
+
+	// Walking stops where size ends so a list running into another list only loses its excess
+	uint32_t size = ent->size;
+	const uint32_t needed = size == 0 ? 0 : (size - 1) / sb->block_size + 1;
+	const enum reach_state state = check_walk(c, ent->start_block, needed, chain);
+	if(state == REACH_EXCESS) {
+		check_problem(c, &report->size_mismatches, "entry %u:%u has more than the %u blocks its size %u needs",
+				addr.end_block, addr.end_offset, needed, size);
+		check_truncate(c, ent, chain, chain->count);
+		*changed = true;
+	} else if(state != REACH_OK) {
+		check_problem(c, state == REACH_SHARED ? &report->cross_links : &report->broken_chains, "block list of entry %u:%u is %s after %u blocks",
+				addr.end_block, addr.end_offset, state == REACH_SHARED ? "cross-linked" : "broken", chain->count);
+		check_truncate(c, ent, chain, chain->count);
+		*changed = true;
+	} else if(chain->count < needed) {
+		check_problem(c, &report->size_mismatches, "entry %u:%u has %u blocks but its size %u needs %u",
+				addr.end_block, addr.end_offset, chain->count, size, needed);
+	}
+
+	// First block keeps end of data when list is too short
+	if(chain->count < needed) {
+		size = chain->count == 0 ? 0 : (chain->count - 1) * sb->block_size + (size - 1) % sb->block_size + 1;
+		*changed = true;
+	}
+
+	// Directories hold whole entries
+	const uint32_t partial = size % sizeof(struct entry);
+	if(directory && partial != 0) {
+		check_problem(c, &report->bad_entries, "size %u of directory %u:%u is not a multiple of entry size",
+				size, addr.end_block, addr.end_offset);
+
+		// Partial entry may be all that is in first block
+		if((size - 1) % sb->block_size + 1 == partial) {
+			ent->start_block = chain->count > 1 ? chain->blocks[1] : BLOCK_LAST;
+			memmove(chain->blocks, chain->blocks + 1, (chain->count - 1) * sizeof(block));
+			--chain->count;
+		}
+
+		size -= partial;
+		*changed = true;
+	}
+
+	ent->size = size;
+	__atomic_add_fetch(&report->used_blocks, chain->count, __ATOMIC_RELAXED);
+	return directory;
+}
+
+void check_extents(struct check *c, struct check_chain *chain, address addr, struct entry *ent, bool *changed)
+{
+	const struct superblock *sb = c->sb;
+	struct check_report *report = c->report;
+	const uint32_t per_block = EXTENT_BLOCK_COUNT(sb);
+
+	// Map blocks form an ordinary block list
+	const enum reach_state list_state = check_walk(c, ent->start_block, sb->block_count, chain);
+	if(list_state != REACH_OK) {
+		check_problem(c, list_state == REACH_SHARED ? &report->cross_links : &report->broken_chains, "extent map of entry %u:%u is %s after %u blocks",
+				addr.end_block, addr.end_offset, list_state == REACH_SHARED ? "cross-linked" : "broken", chain->count);
+		check_truncate(c, ent, chain, chain->count);
+		*changed = true;
+	}
+
+	// Extents are followed only as far as size needs so excess blocks are left for leak checking
+	const uint32_t needed = ent->size == 0 ? 0 : (ent->size - 1) / sb->block_size + 1;
+	uint8_t *buffer = malloc(sb->block_size);
+	uint32_t mapped = 0;
+	enum reach_state state = REACH_OK;
+	uint32_t i = 0;
+
+	for(; i < chain->count && state == REACH_OK; ++i) {
+		uint32_t count;
+		if(block_read(c->d, chain->blocks[i], buffer) != 0) {
+			__atomic_store_n(&c->failed, true, __ATOMIC_RELAXED);
+			break;
+		}
+
+		memcpy(&count, buffer, sizeof(uint32_t));
+		struct extent *extents = (struct extent *) (buffer + sizeof(uint32_t));
+		uint32_t k = 0;
+
+		if(count > per_block) {
+			state = REACH_BROKEN;
+		}
+
+		for(; k < count && state == REACH_OK; ++k) {
+			struct extent *e = &extents[k];
+
+			// Extents must follow each other and lie past metadata
+			if(e->logical != mapped || e->length == 0 || e->physical < sb->root_block || (uint64_t) e->physical + e->length > sb->block_count) {
+				state = REACH_BROKEN;
+				break;
+			}
+
+			if(mapped + e->length > needed) {
+				state = REACH_EXCESS;
+				e->length = needed - mapped;
+			}
+
+			// Mark blocks until one is not extent data or was reached before
+			uint32_t j = 0;
+			for(; j < e->length; ++j) {
+				const block b = e->physical + j;
+				if(__atomic_load_n(&c->fat[b], __ATOMIC_RELAXED) != (block) BLOCK_EXTENT) {
+					state = REACH_BROKEN;
+					break;
+				}
+
+				// Shared blocks may be reached once for each of their references
+				uint32_t *shared = c->shared_count > 0 ? check_shared(c, b) : NULL;
+				if(shared) {
+					__atomic_add_fetch(shared, 1, __ATOMIC_RELAXED);
+				}
+
+				const uint64_t bit = 1ull << (b % 64);
+				if((__atomic_fetch_or(&c->reached[b / 64], bit, __ATOMIC_RELAXED) & bit) && !shared) {
+					state = REACH_SHARED;
+					break;
+				}
+			}
+
+			e->length = j;
+			mapped += j;
+
+			// Extent keeps blocks marked before it ended
+			if(state != REACH_OK) {
+				k += j > 0;
+				break;
+			}
+		}
+
+		if(state != REACH_OK) {
+			if(state == REACH_EXCESS) {
+				check_problem(c, &report->size_mismatches, "entry %u:%u maps more than the %u blocks its size %u needs",
+						addr.end_block, addr.end_offset, needed, ent->size);
+			} else {
+				check_problem(c, state == REACH_SHARED ? &report->cross_links : &report->broken_chains, "extent map of entry %u:%u is %s after %u blocks",
+						addr.end_block, addr.end_offset, state == REACH_SHARED ? "cross-linked" : "broken", mapped);
+			}
+
+			// Map ends with extents checked so far
+			if(c->repair) {
+				memcpy(buffer, &k, sizeof(uint32_t));
+				pthread_mutex_lock(&c->lock);
+				if(block_write(c->d, chain->blocks[i], buffer) != 0) {
+					__atomic_store_n(&c->failed, true, __ATOMIC_RELAXED);
+				}
+				pthread_mutex_unlock(&c->lock);
+			}
+		}
+	}
+
+	free(buffer);
+
+	// Map blocks past the cut are left for leak checking
+	if(i < chain->count) {
+		for(uint32_t j = i; j < chain->count; ++j) {
+			const block b = chain->blocks[j];
+			__atomic_and_fetch(&c->reached[b / 64], ~(1ull << (b % 64)), __ATOMIC_RELAXED);
+		}
+
+		check_truncate(c, ent, chain, i);
+		*changed = true;
+	}
+
+	if(mapped < needed) {
+		if(state == REACH_OK) {
+			check_problem(c, &report->size_mismatches, "entry %u:%u maps %u blocks but its size %u needs %u",
+					addr.end_block, addr.end_offset, mapped, ent->size, needed);
+		}
+
+		ent->size = mapped * sb->block_size;
+		*changed = true;
+	}
+
+	__atomic_add_fetch(&report->used_blocks, chain->count + mapped, __ATOMIC_RELAXED);
+}
+
+void check_leaks(struct check *c)
+{
+	const struct superblock *sb = c->sb;
+
+	// Report runs of leaked blocks instead of every block
+	block run = BLOCK_INVALID;
+	for(uint64_t b = 0; b <= sb->block_count; ++b) {
+		bool leaked = false;
+
+		if(b < sb->block_count) {
+			const block next = c->fat[b];
+			const bool reached = c->reached[b / 64] & (1ull << (b % 64));
+
+			if(b < sb->root_block) {
+				// Metadata blocks must never be allocated
+				if(next != BLOCK_INVALID) {
+					check_problem(c, &c->report->bad_reserved, "reserved block %lu is not marked invalid", (unsigned long) b);
+					if(c->repair) {
+						c->fat[b] = BLOCK_INVALID;
+						c->fat_dirty[BLOCK_FAT_BLOCK(sb, b) - BLOCK_FAT] = 1;
+					}
+				}
+			} else if(next != BLOCK_FREE && next != (block) BLOCK_SMALL && !reached) {
+				leaked = true;
+				++c->report->leaked_blocks;
+				if(c->repair) {
+					c->fat[b] = BLOCK_FREE;
+					c->fat_dirty[BLOCK_FAT_BLOCK(sb, b) - BLOCK_FAT] = 1;
+				}
+			}
+		}
+
+		if(leaked && !BLOCK_VALID(run)) {
+			run = b;
+		} else if(!leaked && BLOCK_VALID(run)) {
+			fprintf(c->out, "blocks %u-%lu are allocated but unreachable\n", run, (unsigned long) b - 1);
+			run = BLOCK_INVALID;
+		}
+	}
+}
+
+int check_load(struct check *c)
+{
+	const struct superblock *sb = c->sb;
+	const uint32_t entry_count = BLOCK_FAT_ENTRY_COUNT(sb);
+	const uint32_t batch_block_count = sb->block_size < CHECK_BATCH_SIZE ? CHECK_BATCH_SIZE / sb->block_size : 1;
+
+	c->fat = malloc((size_t) sb->fat_block_count * sb->block_size);
+	c->smalls = NULL;
+	c->small_count = 0;
+	c->cells = NULL;
+
+	// Read entire FAT sequentially
+	for(uint32_t i = 0; i < sb->fat_block_count;) {
+		const uint32_t count = sb->fat_block_count - i < batch_block_count ? sb->fat_block_count - i : batch_block_count;
+		if(block_read_many(c->d, BLOCK_FAT + i, count, c->fat + (size_t) i * entry_count) != 0) {
+			return -1;
+		}
+
+		i += count;
+	}
+
+	// Small blocks are found in ascending order
+	uint32_t capacity = 0;
+	for(uint32_t b = 0; b < sb->block_count; ++b) {
+		if(c->fat[b] != (block) BLOCK_SMALL) {
+			continue;
+		}
+
+		if(c->small_count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			c->smalls = realloc(c->smalls, capacity * sizeof(block));
+		}
+
+		c->smalls[c->small_count++] = b;
+	}
+
+	if(c->small_count > 0) {
+		c->cells = calloc(c->small_count, SMALL_BITMAP_SIZE(sb));
+	}
+
+	syslog(LOG_DEBUG, "loaded %u FAT blocks with %u small blocks", sb->fat_block_count, c->small_count);
+	return 0;
+}
+
+void *check_loop(void *data)
+{
+	struct check *c = data;
+	struct check_chain chain = {NULL, 0, 0};
+
+	pthread_mutex_lock(&c->lock);
+	while(1) {
+		// Directories being walked may still queue subdirectories
+		while(!c->queue && c->busy > 0) {
+			pthread_cond_wait(&c->cond, &c->lock);
+		}
+
+		struct check_dir *dir = c->queue;
+		if(!dir) {
+			break;
+		}
+
+		c->queue = dir->next;
+		pthread_mutex_unlock(&c->lock);
+
+		check_directory(c, dir, &chain);
+		free(dir->blocks);
+		free(dir);
+
+		pthread_mutex_lock(&c->lock);
+		if(--c->busy == 0) {
+			pthread_cond_broadcast(&c->cond);
+		}
+	}
+
+	pthread_mutex_unlock(&c->lock);
+	free(chain.blocks);
+	return NULL;
+}
+
+void check_problem(struct check *c, uint64_t *counter, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+
+	pthread_mutex_lock(&c->lock);
+	vfprintf(c->out, format, args);
+	fputc('\n', c->out);
+	++*counter;
+	pthread_mutex_unlock(&c->lock);
+
+	va_end(args);
+}
+
+void check_queue(struct check *c, address addr, const struct entry *ent, const struct check_chain *chain)
+{
+	struct check_dir *dir = malloc(sizeof(struct check_dir));
+	dir->addr = addr;
+	dir->ent = *ent;
+	dir->count = chain->count;
+	dir->blocks = malloc((chain->count ? chain->count : 1) * sizeof(block));
+	memcpy(dir->blocks, chain->blocks, chain->count * sizeof(block));
+
+	pthread_mutex_lock(&c->lock);
+	dir->next = c->queue;
+	c->queue = dir;
+	++c->busy;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+int check_read(struct check *c, const block *blocks, uint32_t size, void *data)
+{
+	const struct superblock *sb = c->sb;
+	const uint32_t first_chunk_size = (size - 1) % sb->block_size + 1;
+	const uint32_t count = (size - 1) / sb->block_size + 1;
+	uint8_t *buffer = malloc(sb->block_size);
+
+	// First block holds end of data
+	if(block_read(c->d, blocks[0], buffer) != 0) {
+		free(buffer);
+		return -1;
+	}
+
+	memcpy((uint8_t *) data + size - first_chunk_size, buffer, first_chunk_size);
+	free(buffer);
+
+	// Read runs of blocks allocated in ascending order at once
+	for(uint32_t j = 1; j < count;) {
+		uint32_t length = 1;
+		while(j + length < count && blocks[j + length] == blocks[j + length - 1] - 1) {
+			++length;
+		}
+
+		const uint32_t last = j + length - 1;
+		if(block_read_many(c->d, blocks[last], length, (uint8_t *) data + size - first_chunk_size - (size_t) last * sb->block_size) != 0) {
+			return -1;
+		}
+
+		j += length;
+	}
+
+	return 0;
+}
+
+enum reach_state check_reach_cell(struct check *c, block small, uint32_t cell)
+{
+	const struct superblock *sb = c->sb;
+
+	// Find small block
+	uint32_t low = 0;
+	uint32_t high = c->small_count;
+	while(low < high) {
+		const uint32_t middle = low + (high - low) / 2;
+		if(c->smalls[middle] < small) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	if(low == c->small_count || c->smalls[low] != small || cell >= SMALL_CELL_COUNT(sb)) {
+		return REACH_BROKEN;
+	}
+
+	uint8_t *bitmap = c->cells + (size_t) low * SMALL_BITMAP_SIZE(sb);
+	const uint8_t bit = 1 << (cell % 8);
+	return __atomic_fetch_or(&bitmap[cell / 8], bit, __ATOMIC_RELAXED) & bit ? REACH_SHARED : REACH_OK;
+}
+
+void check_refcounts(struct check *c)
+{
+	for(uint32_t i = 0; i < c->shared_count; ++i) {
+		const struct dedup_count *count = &c->shared[i];
+		const uint32_t reached = c->shared_reached[i];
+		if(reached == count->refs) {
+			continue;
+		}
+
+		check_problem(c, &c->report->bad_refcounts, "block %u is mapped by %u file blocks but counts %u references", count->shared, reached, count->refs);
+
+		// Blocks no file block reaches are left for leak checking
+		if(c->repair && dedup_set(c->d, count->shared, reached) != 0) {
+			__atomic_store_n(&c->failed, true, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+int check_root(struct check *c, block root_block)
+{
+	const struct superblock *sb = c->sb;
+	struct check_report *report = c->report;
+
+	// Root entry is alone in root block which no list may reach
+	const uint64_t bit = 1ull << (root_block % 64);
+	if(root_block < sb->root_block || root_block >= sb->block_count || (c->reached[root_block / 64] & bit)) {
+		syslog(LOG_ERR, "invalid root block %u", root_block);
+		return -1;
+	}
+
+	c->reached[root_block / 64] |= bit;
+	if(c->fat[root_block] != BLOCK_LAST) {
+		check_problem(c, &report->broken_chains, "root block %u is not last in its list", root_block);
+		if(c->repair) {
+			c->fat[root_block] = BLOCK_LAST;
+			c->fat_dirty[BLOCK_FAT_BLOCK(sb, root_block) - BLOCK_FAT] = 1;
+		}
+	}
+
+	struct check_chain chain = {NULL, 0, 0};
+	address root = {root_block, sizeof(struct entry)};
+	struct entry ent;
+	bool changed = false;
+	int err = 0;
+	if(dir_read(c->d, root, &ent, sizeof(struct entry)) != sizeof(struct entry)
+			|| !check_entry(c, &chain, root, &ent, &changed)) {
+		syslog(LOG_ERR, "invalid root directory at %u", root_block);
+		err = -1;
+	} else {
+		if(changed && c->repair) {
+			check_write_entry(c, root, &ent);
+		}
+
+		check_queue(c, root, &ent, &chain);
+	}
+
+	free(chain.blocks);
+	return err;
+}
+
+uint32_t *check_shared(struct check *c, block b)
+{
+	uint32_t low = 0;
+	uint32_t high = c->shared_count;
+
+	while(low < high) {
+		const uint32_t middle = low + (high - low) / 2;
+		const block shared = c->shared[middle].shared;
+
+		if(b < shared) {
+			high = middle;
+		} else if(b > shared) {
+			low = middle + 1;
+		} else {
+			return &c->shared_reached[middle];
+		}
+	}
+
+	return NULL;
+}
+
+void check_smalls(struct check *c)
+{
+	const struct superblock *sb = c->sb;
+	const uint32_t cell_count = SMALL_CELL_COUNT(sb);
+	const uint32_t bitmap_size = SMALL_BITMAP_SIZE(sb);
+	uint8_t *buffer = malloc(sb->block_size);
+
+	for(uint32_t i = 0; i < c->small_count; ++i) {
+		const block small = c->smalls[i];
+		const uint8_t *reached = c->cells + (size_t) i * bitmap_size;
+
+		uint8_t used = 0;
+		for(uint32_t j = 0; j < bitmap_size; ++j) {
+			used |= reached[j];
+		}
+
+		// Small blocks without reached cells are leaked as a whole
+		if(!used) {
+			check_problem(c, &c->report->leaked_blocks, "small block %u has no reachable cells", small);
+			if(c->repair) {
+				c->fat[small] = BLOCK_FREE;
+				c->fat_dirty[BLOCK_FAT_BLOCK(sb, small) - BLOCK_FAT] = 1;
+			}
+
+			continue;
+		}
+
+		if(block_read(c->d, small, buffer) != 0) {
+			__atomic_store_n(&c->failed, true, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		bool mismatch = false;
+		for(uint32_t cell = 0; cell < cell_count; ++cell) {
+			const bool marked = buffer[cell / 8] & (1 << (cell % 8));
+			const bool reachable = reached[cell / 8] & (1 << (cell % 8));
+			if(marked != reachable) {
+				check_problem(c, &c->report->bad_cells, "cell %u:%u is %s", small, cell,
+						marked ? "marked used but unreachable" : "reachable but marked free");
+				mismatch = true;
+			}
+		}
+
+		if(mismatch && c->repair) {
+			memcpy(buffer, reached, bitmap_size);
+			if(block_write(c->d, small, buffer) != 0) {
+				__atomic_store_n(&c->failed, true, __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+	free(buffer);
+}
+
+int check_snapshots(struct check *c)
+{
+	const struct superblock *sb = c->sb;
+	struct check_report *report = c->report;
+
+	// Table is an ordinary block list
+	struct check_chain chain = {NULL, 0, 0};
+	const enum reach_state state = check_walk(c, sb->snapshot_block, sb->block_count, &chain);
+	const uint32_t block_count = chain.count;
+	free(chain.blocks);
+
+	// Snapshots of a broken table are left for leak checking
+	if(state != REACH_OK) {
+		check_problem(c, state == REACH_SHARED ? &report->cross_links : &report->broken_chains, "snapshot table is %s after %u blocks",
+				state == REACH_SHARED ? "cross-linked" : "broken", block_count);
+		return 0;
+	}
+
+	struct snapshot *snapshots;
+	uint32_t count;
+	if(snapshot_list(c->d, &snapshots, &count) != 0) {
+		check_problem(c, &report->broken_chains, "snapshot table is unreadable");
+		return 0;
+	}
+
+	report->used_blocks += block_count + count;
+
+	int err = 0;
+	for(uint32_t i = 0; i < count && err == 0; ++i) {
+		err = check_root(c, snapshots[i].root_block);
+	}
+
+	free(snapshots);
+	return err;
+}
+
+void check_table(struct check *c)
+{
+	const struct superblock *sb = c->sb;
+	struct check_report *report = c->report;
+
+	// Table is an ordinary block list
+	struct check_chain chain = {NULL, 0, 0};
+	const enum reach_state state = check_walk(c, sb->refcount_block, sb->block_count, &chain);
+	const uint32_t count = chain.count;
+	free(chain.blocks);
+
+	if(state != REACH_OK) {
+		check_problem(c, state == REACH_SHARED ? &report->cross_links : &report->broken_chains, "reference count table is %s after %u blocks",
+				state == REACH_SHARED ? "cross-linked" : "broken", count);
+		return;
+	}
+
+	report->used_blocks += count;
+
+	// Hash index is an ordinary block list whose hashes are only hints
+	if(DEDUP_INDEXED(sb)) {
+		struct check_chain index = {NULL, 0, 0};
+		const enum reach_state index_state = check_walk(c, sb->hash_block, sb->block_count, &index);
+		free(index.blocks);
+
+		if(index_state != REACH_OK) {
+			check_problem(c, index_state == REACH_SHARED ? &report->cross_links : &report->broken_chains, "hash index is %s after %u blocks",
+					index_state == REACH_SHARED ? "cross-linked" : "broken", index.count);
+			return;
+		}
+
+		report->used_blocks += index.count;
+	}
+
+	// Shared blocks reached more than once are only cross-links when their counts say so
+	if(dedup_shared(c->d, &c->shared, &c->shared_count) != 0) {
+		check_problem(c, &report->broken_chains, "reference count table is unreadable");
+		return;
+	}
+
+	c->shared_reached = calloc(c->shared_count ? c->shared_count : 1, sizeof(uint32_t));
+}
+
+void check_truncate(struct check *c, struct entry *ent, struct check_chain *chain, uint32_t keep)
+{
+	const struct superblock *sb = c->sb;
+
+	// Disk is only changed when repairing
+	if(keep > 0 && c->repair) {
+		const block b = chain->blocks[keep - 1];
+		__atomic_store_n(&c->fat[b], BLOCK_LAST, __ATOMIC_RELAXED);
+		__atomic_store_n(&c->fat_dirty[BLOCK_FAT_BLOCK(sb, b) - BLOCK_FAT], 1, __ATOMIC_RELAXED);
+	}
+
+	if(keep == 0) {
+		ent->start_block = BLOCK_LAST;
+	}
+
+	chain->count = keep;
+}
+
+enum reach_state check_walk(struct check *c, block head, uint32_t limit, struct check_chain *chain)
+{
+	const struct superblock *sb = c->sb;
+	chain->count = 0;
+
+	for(block current = head; current != BLOCK_LAST;) {
+		if(chain->count == limit) {
+			return REACH_EXCESS;
+		}
+
+		// Lists only hold allocated blocks past metadata
+		if(current < sb->root_block || current >= sb->block_count) {
+			return REACH_BROKEN;
+		}
+
+		const block next = __atomic_load_n(&c->fat[current], __ATOMIC_RELAXED);
+		if(next == BLOCK_FREE || next == BLOCK_INVALID || next == (block) BLOCK_SMALL || next == (block) BLOCK_EXTENT) {
+			return REACH_BROKEN;
+		}
+
+		// Blocks reached before belong to another list or to a loop
+		const uint64_t bit = 1ull << (current % 64);
+		if(__atomic_fetch_or(&c->reached[current / 64], bit, __ATOMIC_RELAXED) & bit) {
+			return REACH_SHARED;
+		}
+
+		if(chain->count == chain->capacity) {
+			chain->capacity = chain->capacity ? chain->capacity * 2 : 64;
+			chain->blocks = realloc(chain->blocks, chain->capacity * sizeof(block));
+		}
+
+		chain->blocks[chain->count++] = current;
+		current = next;
+	}
+
+	return REACH_OK;
+}
+
+void check_write_entry(struct check *c, address addr, const struct entry *ent)
+{
+	// Entries sharing a block must not be written concurrently
+	pthread_mutex_lock(&c->lock);
+	if(dir_write(c->d, addr, ent, sizeof(struct entry)) != sizeof(struct entry)) {
+		__atomic_store_n(&c->failed, true, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+int check_write_fat(struct check *c)
+{
+	const struct superblock *sb = c->sb;
+	const uint32_t entry_count = BLOCK_FAT_ENTRY_COUNT(sb);
+
+	// Write runs of repaired FAT blocks at once
+	for(uint32_t i = 0; i < sb->fat_block_count;) {
+		if(!c->fat_dirty[i]) {
+			++i;
+			continue;
+		}
+
+		uint32_t count = 1;
+		while(i + count < sb->fat_block_count && c->fat_dirty[i + count]) {
+			++count;
+		}
+
+		if(block_write_many(c->d, BLOCK_FAT + i, count, c->fat + (size_t) i * entry_count) != 0) {
+			return -1;
+		}
+
+		i += count;
+	}
+
+	return 0;
+}
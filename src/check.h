@@ -0,0 +1,33 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include "disk.h"
+#include <stdio.h>
+
+// Problems found while checking a disk
+struct check_report {
+	uint64_t directories;
+	uint64_t files;
+	uint64_t used_blocks;
+	uint64_t leaked_blocks; // Allocated blocks no entry can reach
+	uint64_t cross_links; // Blocks or cells reached by more than one entry
+	uint64_t broken_chains; // Block lists running into free, reserved, or invalid blocks
+	uint64_t size_mismatches; // Entries whose size disagrees with their block list length
+	uint64_t bad_entries; // Entries with invalid names, inline data, or sizes
+	uint64_t bad_cells; // Small block cells whose used bit disagrees with entries
+	uint64_t bad_free_lists; // Directories whose free slot list disagrees with their tombstones
+	uint64_t bad_reserved; // Metadata blocks that FAT does not mark invalid
+	uint64_t bad_refcounts; // Shared blocks whose reference count disagrees with file blocks mapping them
+	uint64_t repaired;
+};
+
+// Check a disk for leaked blocks, cross-linked block lists, and entries inconsistent with their block lists
+// FAT is read in large sequential batches and directories are walked by several threads
+// Each problem is described on out and repaired when repair is set
+// Returns non-zero on failure
+int check_disk(disk d, bool repair, FILE *out, struct check_report *report);
+
+// Count problems in report
+uint64_t check_problems(const struct check_report *report);
+
+#endif
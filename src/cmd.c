@@ -1,17 +1,149 @@
 #include "block.h"
+#include "check.h"
 #include "cmd.h"
+#include "dedup.h"
+#include "defrag.h"
 #include "disk.h"
+#include "journal.h"
 #include "op.h"
+#include "snapshot.h"
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <syslog.h>
+#include <time.h>
 
 #define FATFS_VERSION "1.0.0"
 
-#define FATFS_CEIL(a, b) (1 + ((a - 1) / b))
+#define FATFS_CEIL(a, b) (1 + (((a) - 1) / (b)))
+
+// Maximum size in bytes of a default journal so large blocks do not make it huge
+#define FATFS_JOURNAL_SIZE_DEFAULT_MAX	(64 << 20)
 
 // Print usage
 void usage(struct fatfs_params *params);
 
+int cmd_check(struct fatfs_params *params)
+{
+	// Parameters must contain disk path
+	if(!params->disk_path) {
+		usage(params);
+		return -1;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	disk d = disk_open(params->disk_path, 0);
+	if(!d) {
+		return -1;
+	}
+
+	struct check_report report;
+	if(check_disk(d, params->repair, stdout, &report) != 0) {
+		fprintf(stderr, "failed to check disk\n");
+		disk_close(d);
+		return -1;
+	}
+
+	if(disk_close(d) != 0) {
+		return -1;
+	}
+
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	const uint64_t problems = check_problems(&report);
+
+	printf("checked %" PRIu64 " directories, %" PRIu64 " files, %" PRIu64 " used blocks in %.3f s\n",
+			report.directories,
+			report.files,
+			report.used_blocks,
+			seconds);
+	printf("%" PRIu64 " leaked blocks, %" PRIu64 " cross-links, %" PRIu64 " broken lists, %" PRIu64 " size mismatches, "
+			"%" PRIu64 " bad entries, %" PRIu64 " bad cells, %" PRIu64 " bad free slot lists, %" PRIu64 " bad reserved blocks, "
+			"%" PRIu64 " bad reference counts\n",
+			report.leaked_blocks,
+			report.cross_links,
+			report.broken_chains,
+			report.size_mismatches,
+			report.bad_entries,
+			report.bad_cells,
+			report.bad_free_lists,
+			report.bad_reserved,
+			report.bad_refcounts);
+
+	if(params->repair) {
+		printf("repaired %" PRIu64 " of %" PRIu64 " problems\n", report.repaired, problems);
+	}
+
+	// Problems left on disk are a failure
+	return problems > report.repaired ? -1 : 0;
+}
+
+int cmd_dedup(struct fatfs_params *params)
+{
+	// Parameters must contain disk path
+	if(!params->disk_path) {
+		usage(params);
+		return -1;
+	}
+
+	disk d = disk_open(params->disk_path, 0);
+	if(!d) {
+		return -1;
+	}
+
+	struct dedup_report report;
+	if(dedup_disk(d, &report) != 0) {
+		fprintf(stderr, "failed to deduplicate disk\n");
+		disk_close(d);
+		return -1;
+	}
+
+	char description[256];
+	dedup_print(&report, description, sizeof(description));
+	printf("%s", description);
+
+	return disk_close(d);
+}
+
+int cmd_defrag(struct fatfs_params *params)
+{
+	// Parameters must contain disk path
+	if(!params->disk_path) {
+		usage(params);
+		return -1;
+	}
+
+	disk d = disk_open(params->disk_path, 0);
+	if(!d) {
+		return -1;
+	}
+
+	char description[256];
+	struct defrag_report report;
+	if(defrag_measure(d, &report) != 0) {
+		fprintf(stderr, "failed to measure fragmentation\n");
+		disk_close(d);
+		return -1;
+	}
+
+	defrag_print(&report, description, sizeof(description));
+	printf("before: %s", description);
+
+	if(defrag_disk(d, &report) != 0) {
+		fprintf(stderr, "failed to defragment disk\n");
+		disk_close(d);
+		return -1;
+	}
+
+	defrag_print(&report, description, sizeof(description));
+	printf("after:  %s", description);
+
+	return disk_close(d);
+}
+
 int cmd_format(struct fatfs_params *params)
 {
 	// Parameters must contain disk path, valid disk size, and valid block size
@@ -20,7 +152,10 @@ int cmd_format(struct fatfs_params *params)
 		return -1;
 	}
 
-	// TODO use different method to determine size to avoid overflow
+	if(!DISK_BLOCK_SIZE_VALID(params->block_size)) {
+		fprintf(stderr, "invalid block size: must be a power of two from %u to %u bytes\n", DISK_BLOCK_SIZE_MIN, DISK_BLOCK_SIZE_MAX);
+		return -1;
+	}
 
 	// Determine input size power
 	int power = 0;
@@ -37,6 +172,10 @@ int cmd_format(struct fatfs_params *params)
 		case 'g':
 			power = 3;
 			break;
+		case 'T':
+		case 't':
+			power = 4;
+			break;
 		case '\0':
 			break;
 		default:
@@ -44,38 +183,119 @@ int cmd_format(struct fatfs_params *params)
 			return -1;
 	}
 
+	// Size in bytes must be representable
+	if(params->size > (UINT64_MAX >> (10 * power))) {
+		fprintf(stderr, "filesystem too large: %" PRIu64 "%c\n", params->size, params->unit);
+		return -1;
+	}
+
 	// Actual size in bytes of entire filesystem
-	uintmax_t size = 1;
-	for(int i = 0; i < power; ++i) {
-		size *= 1024;
+	const uint64_t size = params->size << (10 * power);
+
+	// Every block must be addressable by a FAT entry
+	const uint64_t block_count = FATFS_CEIL(size, params->block_size);
+	if(block_count > BLOCK_COUNT_MAX) {
+		fprintf(stderr, "filesystem too large: need a block size of at least %" PRIu64 " bytes\n", FATFS_CEIL(size, BLOCK_COUNT_MAX));
+		return -1;
+	}
+
+	// Small blocks must fit an inline file along with their cell bitmap
+	if(params->inline_size > params->block_size / 2) {
+		fprintf(stderr, "inline size too large: must be at most %u bytes\n", params->block_size / 2);
+		return -1;
 	}
-	size *= params->size;
 
 	// Setup superblock
 	struct superblock sb;
-	sb.magic = 0x2345beef;
+	sb.magic = DISK_MAGIC;
 	sb.block_size = params->block_size;
-	sb.block_count = FATFS_CEIL(size, sb.block_size);
-	const uint32_t fat_size = sb.block_count * sizeof(block);
+	sb.block_count = block_count;
+	const uint64_t fat_size = block_count * sizeof(block);
 	sb.fat_block_count = FATFS_CEIL(fat_size, sb.block_size);
-	sb.root_block = sb.fat_block_count + 1;
+	sb.inline_size = params->inline_size;
+
+	// Journal holds a header followed by at most one full transaction by default
+	uint64_t journal_block_count = params->journal_blocks;
+	if(journal_block_count == UINT32_MAX) {
+		uint64_t full = 1 + (sb.block_size - sizeof(struct journal_header)) / sizeof(block);
+		full = full < FATFS_JOURNAL_SIZE_DEFAULT_MAX / sb.block_size ? full : FATFS_JOURNAL_SIZE_DEFAULT_MAX / sb.block_size;
+		journal_block_count = full < block_count / 16 ? full : block_count / 16;
+		journal_block_count = journal_block_count < 2 ? 0 : journal_block_count;
+	}
 
-	const uint32_t min_block_count = 2 + sb.fat_block_count;  // Min block count to support filesystem metadata
+	// Journal needs a header and at least one image
+	if(journal_block_count == 1) {
+		fprintf(stderr, "journal too small: need at least 2 blocks\n");
+		return -1;
+	}
+
+	if(journal_block_count > block_count) {
+		fprintf(stderr, "journal too large: must be at most %" PRIu64 " blocks\n", block_count);
+		return -1;
+	}
+
+	sb.journal_block = sb.fat_block_count + 1;
+	sb.journal_block_count = journal_block_count;
+	sb.root_block = sb.journal_block + sb.journal_block_count;
+	sb.version = DISK_VERSION;
+	sb.features = (sb.journal_block_count ? DISK_FEATURE_JOURNAL : 0)
+		| (sb.inline_size ? DISK_FEATURE_INLINE : 0)
+		| (params->extents || params->dedup ? DISK_FEATURE_EXTENTS : 0);
+	sb.refcount_block = BLOCK_LAST; // Table is created by the first deduplication pass sharing blocks
+	sb.hash_block = BLOCK_LAST; // Index is created when formatting for deduplication or by the first deduplication pass
+	sb.snapshot_block = BLOCK_LAST; // Table is created by the first snapshot
+
+	const uint64_t min_block_count = 2 + (uint64_t) sb.fat_block_count + sb.journal_block_count;  // Min block count to support filesystem metadata
 	if(sb.block_count < min_block_count) {
-		fprintf(stderr, "filesystem too small: need at least %u bytes\n", min_block_count * sb.block_size);
+		fprintf(stderr, "filesystem too small: need at least %" PRIu64 " bytes\n", min_block_count * sb.block_size);
 		return -1;
 	}
 
-	disk d = disk_open(params->disk_path, true);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	disk d = disk_open(params->disk_path, DISK_TRUNCATE);
 	if(!d) {
 		return -1;
 	}
 
 	if(disk_format(d, sb) != 0) {
+		disk_close(d);
 		return -1;
 	}
 
-	disk_close(d);
+	if(disk_close(d) != 0) {
+		return -1;
+	}
+
+	// Hash index is created on the formatted disk like a deduplication pass would
+	if(params->dedup) {
+		d = disk_open(params->disk_path, 0);
+		if(!d) {
+			return -1;
+		}
+
+		if(dedup_enable(d) != 0) {
+			fprintf(stderr, "failed to create hash index\n");
+			disk_close(d);
+			return -1;
+		}
+
+		if(disk_close(d) != 0) {
+			return -1;
+		}
+	}
+
+	// Report format throughput
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	const uint64_t formatted = (uint64_t) sb.block_count * sb.block_size;
+	printf("formatted %" PRIu64 " bytes in %.3f s (%.1f MiB/s)\n",
+			formatted,
+			seconds,
+			seconds > 0 ? formatted / seconds / (1 << 20) : 0.0);
+
 	return 0;
 }
 
@@ -93,37 +313,169 @@ int cmd_mount(struct fatfs_params *params)
 		return -1;
 	}
 
-	struct fuse_operations operations = {
-		.chmod = fatfs_chmod,
+	struct fuse_lowlevel_ops operations = {
+		.create = fatfs_create,
+		.fallocate = fatfs_fallocate,
+		.flush = fatfs_flush,
+		.forget = fatfs_forget,
+		.forget_multi = fatfs_forget_multi,
+		.fsync = fatfs_fsync,
 		.getattr = fatfs_getattr,
+		.init = fatfs_init,
+		.lookup = fatfs_lookup,
 		.mkdir = fatfs_mkdir,
 		.mknod = fatfs_mknod,
 		.open = fatfs_open,
 		.read = fatfs_read,
 		.readdir = fatfs_readdir,
+		.readdirplus = fatfs_readdirplus,
+		.release = fatfs_release,
 		.rename = fatfs_rename,
 		.rmdir = fatfs_rmdir,
-		.truncate = fatfs_truncate,
+		.setattr = fatfs_setattr,
+		.statfs = fatfs_statfs,
 		.unlink = fatfs_unlink,
-		.utimens = fatfs_utimens,
-		.write = fatfs_write,
+		.write_buf = fatfs_write_buf,
 	};
 
-	disk d = disk_open(params->disk_path, false);
+	// Snapshots are frozen so kernel must refuse writes to them
+	if(params->snapshot && fuse_opt_add_arg(&params->args, "-oro") != 0) {
+		return -1;
+	}
+
+	// Mount point and options for threads and daemonizing are taken out before session sees the rest
+	struct fuse_cmdline_opts options;
+	if(fuse_parse_cmdline(&params->args, &options) != 0) {
+		return -1;
+	}
+
+	// Connection options such as writeback_cache are applied once kernel connects
+	struct fatfs_mount mount = {NULL, params->cache_timeout, fuse_parse_conn_info_opts(&params->args)};
+	if(!mount.conn_options) {
+		free(options.mountpoint);
+		return -1;
+	}
+
+	const int flags = (params->discard ? DISK_DISCARD : 0)
+		| (params->async_reclaim ? DISK_RECLAIM : 0)
+		| (params->direct ? DISK_DIRECT : 0)
+		| (params->readonly || params->snapshot ? DISK_READONLY : 0);
+	mount.d = disk_open(params->disk_path, flags);
+	if(!mount.d) {
+		free(mount.conn_options);
+		free(options.mountpoint);
+		return -1;
+	}
+
+	if(params->snapshot) {
+		const block root = snapshot_root(mount.d, params->snapshot);
+		if(root == BLOCK_INVALID) {
+			fprintf(stderr, "no snapshot %u\n", params->snapshot);
+			disk_close(mount.d);
+			free(mount.conn_options);
+			free(options.mountpoint);
+			return -1;
+		}
+
+		disk_set_root(mount.d, root);
+	}
+
+	if(params->commit_interval >= 0) {
+		journal_set_interval(mount.d, params->commit_interval);
+	}
+
+	int err = -1;
+	struct fuse_session *session = fuse_session_new(&params->args, &operations, sizeof(operations), &mount);
+	if(session) {
+		if(fuse_set_signal_handlers(session) == 0) {
+			if(fuse_session_mount(session, options.mountpoint) == 0) {
+				fuse_daemonize(options.foreground);
+
+				if(options.singlethread) {
+					err = fuse_session_loop(session);
+				} else {
+					struct fuse_loop_config config = {
+						.clone_fd = options.clone_fd,
+						.max_idle_threads = options.max_idle_threads,
+					};
+
+					err = fuse_session_loop_mt(session, &config);
+				}
+
+				fuse_session_unmount(session);
+			}
+
+			fuse_remove_signal_handlers(session);
+		}
+
+		fuse_session_destroy(session);
+	}
+
+	if(disk_close(mount.d) != 0) {
+		err = -1;
+	}
+
+	free(mount.conn_options);
+	free(options.mountpoint);
+	return err;
+}
+
+int cmd_snapshot(struct fatfs_params *params)
+{
+	// Parameters must contain disk path
+	if(!params->disk_path) {
+		usage(params);
+		return -1;
+	}
+
+	// Disks mounted read-only can be listed while mounted
+	disk d = params->list ? disk_open(params->disk_path, DISK_READONLY) : NULL;
+	if(!d) {
+		d = disk_open(params->disk_path, 0);
+	}
+
 	if(!d) {
 		return -1;
 	}
 
-	int err = fuse_main(params->args.argc, params->args.argv, &operations, d);
-	disk_close(d);
+	int err = 0;
+	if(params->list) {
+		struct snapshot *snapshots;
+		uint32_t count;
+		err = snapshot_list(d, &snapshots, &count);
+		for(uint32_t i = 0; i < count; ++i) {
+			char created[32];
+			const time_t create_time = snapshots[i].create_time;
+			strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime(&create_time));
+			printf("%u\t%s\n", snapshots[i].id, created);
+		}
+
+		free(snapshots);
+	} else if(params->delete_id) {
+		err = snapshot_delete(d, params->delete_id);
+	} else {
+		uint32_t id;
+		err = snapshot_create(d, &id);
+		if(err == 0) {
+			printf("%u\n", id);
+		}
+	}
+
+	if(err != 0) {
+		fprintf(stderr, "failed to %s snapshot\n", params->list ? "list" : params->delete_id ? "delete" : "create");
+	}
+
+	if(disk_close(d) != 0) {
+		err = -1;
+	}
+
 	return err;
 }
 
 int cmd_version(struct fatfs_params *params)
 {
 	fprintf(stderr, "fatfs version %s\n", FATFS_VERSION);
-	fuse_opt_add_arg(&params->args, "--version");
-	fuse_main(params->args.argc, params->args.argv, NULL, NULL);
+	fuse_lowlevel_version();
 	return 0;
 }
 
@@ -132,15 +484,54 @@ void usage(struct fatfs_params *params)
 	const char *program = params->args.argv[0];
 
 	switch(params->base_cmd) {
+		case CMD_CHECK:
+			fprintf(stderr,
+					"usage: %s check [<options>] <file>\n"
+					"\n"
+					"    <file> the disk file path, must not be mounted\n"
+					"\n"
+					"    -r   --repair        repair problems found\n"
+					"    -h   --help          print help\n"
+					, program);
+			break;
+		case CMD_DEDUP:
+			fprintf(stderr,
+					"usage: %s dedup [<options>] <file>\n"
+					"\n"
+					"    <file> the disk file path, must not be mounted\n"
+					"\n"
+					"    -h   --help          print help\n"
+					"\n"
+					"identical blocks of files mapped by extents are shared and copied again\n"
+					"once written, disks deduplicated once are not readable by older versions\n"
+					"and share identical whole blocks as they are written from then on\n"
+					, program);
+			break;
+		case CMD_DEFRAG:
+			fprintf(stderr,
+					"usage: %s defrag [<options>] <file>\n"
+					"\n"
+					"    <file> the disk file path, must not be mounted\n"
+					"\n"
+					"    -h   --help          print help\n"
+					"\n"
+					"a mounted disk is defragmented by writing to /.fatfs-defrag in its root\n"
+					"and its fragmentation is reported by reading that file\n"
+					, program);
+			break;
 		case CMD_FORMAT:
 			fprintf(stderr,
 					"usage: %s format [<options>] <file> <size>\n"
 					"\n"
 					"    <file> the disk file path\n"
-					"    <size> size of disk in bytes, append (K,M,G) for (KiB,MiB,GiB) respectively\n"
+					"    <size> size of disk in bytes, append (K,M,G,T) for (KiB,MiB,GiB,TiB) respectively\n"
 					"\n"
-					"    -b   --block_size=N set block size in bytes (1024)\n"
-					"    -h   --help         print help\n"
+					"    -b   --block_size=N  set block size in bytes, a power of two from 512 to 1048576 (4096)\n"
+					"    -d   --dedup         share written blocks identical to blocks on disk, implies -e\n"
+					"    -e   --extents       map files by extents instead of block lists\n"
+					"    -i   --inline_size=N store files up to N bytes in shared blocks, 0 disables (256)\n"
+					"    -j   --journal_blocks=N use N blocks for the metadata journal, 0 disables (one transaction)\n"
+					"    -h   --help          print help\n"
 					, program);
 			break;
 		case CMD_MOUNT:
@@ -154,17 +545,50 @@ void usage(struct fatfs_params *params)
 					"    -o opt,[opt...]	mount options\n"
 					"    -h   --help		print help\n"
 					"\n"
+					"fatfs options:\n"
+					"    -o async_reclaim	free blocks of removed files in the background\n"
+					"    -o cache_timeout=N	let kernel cache entries, attributes, and file data for N seconds, 0 disables (3600)\n"
+					"    -o commit=N		commit metadata journal every N seconds, 0 commits every operation (5)\n"
+					"    -o direct		access disk file bypassing host page cache when host filesystem allows it\n"
+					"    -o discard		punch holes in disk file for freed blocks\n"
+					"    -o ro		mount read-only sharing disk with other read-only mounts\n"
+					"    -o snapshot=N	mount snapshot N read-only instead of the disk itself\n"
+					"\n"
+					"connection options:\n"
+					"    -o max_write=N	largest write request in bytes, at most 1048576 (1048576)\n"
+					"    -o splice_read	receive written data through a pipe\n"
+					"    -o writeback_cache	let kernel gather writes in its page cache\n"
+					"\n"
+					, program);
+			fuse_cmdline_help();
+			fuse_lowlevel_help();
+			break;
+		case CMD_SNAPSHOT:
+			fprintf(stderr,
+					"usage: %s snapshot [<options>] <file>\n"
+					"\n"
+					"    <file> the disk file path, must not be mounted\n"
+					"\n"
+					"    -l   --list          list snapshots by id and creation time\n"
+					"         --delete=N      delete snapshot N\n"
+					"    -h   --help          print help\n"
+					"\n"
+					"without options the root directory is snapshotted and its id printed,\n"
+					"snapshots need a disk formatted with -e and share file blocks with it\n"
+					"until either one writes them, they are mounted with -o snapshot=N\n"
 					, program);
-			fuse_opt_add_arg(&params->args, "-ho");
-			fuse_main(params->args.argc, params->args.argv, NULL, NULL);
 			break;
 		default:
 			fprintf(stderr,
 					"usage: %s [-V] [--version] [-h] [--help] <command> [<args>]\n"
 					"\n"
 					"commands:\n"
-					"    format initialize a disk with empty fatfs filesystem\n"
-					"    mount  mount a disk with a fatfs filesystem\n"
+					"    check    check a disk for leaked blocks and inconsistent entries\n"
+					"    dedup    share identical blocks of files mapped by extents\n"
+					"    defrag   move fragmented block lists into contiguous runs\n"
+					"    format   initialize a disk with empty fatfs filesystem\n"
+					"    mount    mount a disk with a fatfs filesystem\n"
+					"    snapshot freeze the root directory of a disk sharing its file blocks\n"
 					, program);
 			break;
 	}
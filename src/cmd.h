@@ -5,6 +5,18 @@
 
 struct fatfs_params;
 
+// Check a disk and repair it when requested
+// Returns non-zero on failure or when problems are left on disk
+int cmd_check(struct fatfs_params *params);
+
+// Share identical file blocks of a disk and report what was shared
+// Returns non-zero on failure
+int cmd_dedup(struct fatfs_params *params);
+
+// Defragment a disk and report fragmentation before and after
+// Returns non-zero on failure
+int cmd_defrag(struct fatfs_params *params);
+
 // Format a disk
 // Returns non-zero on failure
 int cmd_format(struct fatfs_params *params);
@@ -17,6 +29,10 @@ int cmd_help(struct fatfs_params *params);
 // Returns non-zero on failure
 int cmd_mount(struct fatfs_params *params);
 
+// Create, list, or delete snapshots of a disk
+// Returns non-zero on failure
+int cmd_snapshot(struct fatfs_params *params);
+
 // Print program version
 // Returns zero
 int cmd_version(struct fatfs_params *params);
@@ -0,0 +1,1140 @@
+#include "dedup.h"
+#include "entry.h"
+#include "extent.h"
+#include "journal.h"
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+// Amount of bytes read at once while hashing file blocks
+#define DEDUP_READ_SIZE (1 << 20)
+
+// Nesting of extent block writes on calling thread
+static __thread int write_depth;
+
+// Sharing was excluded when outermost extent block write started on calling thread
+static __thread bool write_held;
+
+// Add a reference to candidate when it is still an extent block holding data
+// Buffer must be size of a block
+// Claimed is set when candidate gained a reference
+// Returns non-zero on failure
+int dedup_claim(disk d, block candidate, const uint8_t *data, uint8_t *buffer, bool *claimed);
+
+// Rewrite table without counts of blocks that are no longer shared
+// Returns non-zero on failure
+int dedup_compact(disk d);
+
+// Compare blocks for sorting
+int dedup_compare(const void *a, const void *b);
+
+// Remap duplicate blocks of extent mapped file entry at addr and free them
+// Returns non-zero on failure
+int dedup_file(disk d, address addr, struct dedup_report *report);
+
+// Hash data of a block using FNV-1a
+uint64_t dedup_hash(const uint8_t *data, uint32_t size);
+
+// Add block holding data with hash to hash index
+// Returns non-zero on failure
+int dedup_insert(disk d, uint64_t hash, block b);
+
+// Read table and hash index blocks on first use
+// Table lock must be held
+// Returns non-zero on failure
+int dedup_load(disk d);
+
+// Find block with hash in hash index
+// Match is set to BLOCK_INVALID when there is none
+// Returns non-zero on failure
+int dedup_lookup(disk d, uint64_t hash, block *match);
+
+// Find count of block in table
+// Table lock must be held
+// Position is set to where block belongs in table order
+// Returns NULL when block has no count
+struct dedup_count *dedup_search(struct dedup_table *table, block shared, uint32_t *position);
+
+// Remap count whole file blocks starting at file block first to indexed blocks holding same data with hashes
+// Shared is set for each file block that was remapped
+// Returns non-zero on failure
+int dedup_share(disk d, block *head, struct extent_map *map, uint32_t first, uint32_t count, const uint8_t *data, const uint64_t *hashes, bool *shared);
+
+// Deduplicate children of entry at addr and then entry itself
+// Returns non-zero on failure
+int dedup_walk(disk d, address addr, struct dedup_report *report);
+
+// Write table block holding count at index
+// Table lock must be held
+// Returns non-zero on failure
+int dedup_write(disk d, uint32_t index);
+
+uint32_t dedup_access(disk d, block *head, struct extent_map *map, uint32_t offset, const void *data, uint32_t size)
+{
+	const struct superblock *sb = disk_superblock(d);
+	const uint8_t *bytes = data;
+	const uint64_t end = (uint64_t) offset + size;
+
+	// Whole file blocks written are looked up before anything is written
+	const uint32_t first = ((uint64_t) offset + sb->block_size - 1) / sb->block_size;
+	const uint32_t last = end / sb->block_size;
+	const uint32_t count = last > first ? last - first : 0;
+	uint64_t *hashes = malloc((count ? count : 1) * sizeof(uint64_t));
+	bool *shared = calloc(count ? count : 1, sizeof(bool));
+	for(uint32_t k = 0; k < count; ++k) {
+		hashes[k] = dedup_hash(bytes + ((uint64_t) (first + k) * sb->block_size - offset), sb->block_size);
+	}
+
+	if(dedup_share(d, head, map, first, count, bytes + ((uint64_t) first * sb->block_size - offset), hashes, shared) != 0) {
+		free(hashes);
+		free(shared);
+		return 0;
+	}
+
+	// Blocks that were not shared are written run by run
+	uint32_t accessed = 0;
+	dedup_write_begin(d);
+	for(uint64_t position = offset; position < end;) {
+		const uint32_t logical = position / sb->block_size;
+
+		// Shared blocks already hold their data
+		if(logical >= first && logical < last && shared[logical - first]) {
+			position += sb->block_size;
+			accessed += sb->block_size;
+			continue;
+		}
+
+		uint32_t next = logical + 1;
+		while(next < last && (next < first || !shared[next - first])) {
+			++next;
+		}
+
+		const uint64_t run_end = next < last ? (uint64_t) next * sb->block_size : end;
+		const uint32_t run = run_end - position;
+
+		// Shared blocks get blocks of their own before they are written
+		if(extent_unshare(d, head, map, position, run) != 0) {
+			break;
+		}
+
+		// File data bypasses journal
+		journal_data_begin();
+		const uint32_t written = extent_access(d, map, position, NULL, bytes + (position - offset), run);
+		journal_data_end();
+
+		accessed += written;
+		if(written != run) {
+			break;
+		}
+
+		position = run_end;
+	}
+
+	dedup_write_end(d);
+
+	// Later writes of same data find written blocks
+	for(uint32_t k = 0; k < count && (uint64_t) (first + k + 1) * sb->block_size <= offset + (uint64_t) accessed; ++k) {
+		const struct extent *e = extent_find(map, first + k);
+		if(!shared[k] && e && dedup_insert(d, hashes[k], e->physical + (first + k - e->logical)) != 0) {
+			break;
+		}
+	}
+
+	free(hashes);
+	free(shared);
+	return accessed;
+}
+
+int dedup_add(disk d, block *blocks, uint32_t count)
+{
+	syslog(LOG_DEBUG, "adding references to %u blocks", count);
+
+	const struct superblock *sb = disk_superblock(d);
+	const uint32_t per_block = DEDUP_BLOCK_COUNT(sb);
+	struct dedup_table *table = disk_dedup_table(d);
+	qsort(blocks, count, sizeof(block), dedup_compare);
+
+	// Blocks cannot be written in place or freed until they have their references
+	pthread_rwlock_wrlock(&table->sharing);
+	pthread_mutex_lock(&table->lock);
+
+	if(dedup_load(d) != 0) {
+		pthread_mutex_unlock(&table->lock);
+		pthread_rwlock_unlock(&table->sharing);
+		return -1;
+	}
+
+	// Blocks must still hold file data and their counts must have room to grow before any count changes
+	uint32_t added = 0;
+	for(uint32_t i = 0, next = 0; i < count; i = next) {
+		while(next < count && blocks[next] == blocks[i]) {
+			++next;
+		}
+
+		uint32_t position;
+		const struct dedup_count *c = dedup_search(table, blocks[i], &position);
+		if(block_next(d, blocks[i]) != (block) BLOCK_EXTENT || journal_freeing(d, blocks[i]) || (c ? c->refs : 1) > UINT32_MAX - (next - i)) {
+			pthread_mutex_unlock(&table->lock);
+			pthread_rwlock_unlock(&table->sharing);
+			syslog(LOG_ERR, "cannot add references to block %u", blocks[i]);
+			return -1;
+		}
+
+		added += !c;
+	}
+
+	// New counts go to newest table blocks which become head of table list
+	const uint32_t old_count = table->count;
+	const uint32_t old_block_count = table->block_count;
+	const uint32_t needed = (old_count + added + per_block - 1) / per_block;
+	if(needed > table->block_count) {
+		table->blocks = realloc(table->blocks, needed * sizeof(block));
+	}
+
+	while(table->block_count < needed) {
+		const block head = block_alloc(d, table->block_count > 0 ? table->blocks[table->block_count - 1] : BLOCK_LAST);
+		if(!BLOCK_VALID(head)) {
+			if(table->block_count > old_block_count) {
+				block_free_many(d, table->blocks[table->block_count - 1], table->block_count - old_block_count);
+			}
+
+			table->block_count = old_block_count;
+			pthread_mutex_unlock(&table->lock);
+			pthread_rwlock_unlock(&table->sharing);
+			return -1;
+		}
+
+		table->blocks[table->block_count++] = head;
+	}
+
+	if(old_count + added > table->capacity) {
+		while(old_count + added > table->capacity) {
+			table->capacity = table->capacity ? table->capacity * 2 : 64;
+		}
+
+		table->counts = realloc(table->counts, table->capacity * sizeof(struct dedup_count));
+		table->order = realloc(table->order, table->capacity * sizeof(uint32_t));
+	}
+
+	// Existing counts grow in place and new counts are appended in block order
+	bool *dirty = calloc(needed ? needed : 1, sizeof(bool));
+	uint32_t total = old_count;
+	for(uint32_t i = 0, next = 0; i < count; i = next) {
+		while(next < count && blocks[next] == blocks[i]) {
+			++next;
+		}
+
+		uint32_t position;
+		struct dedup_count *c = dedup_search(table, blocks[i], &position);
+		if(c) {
+			c->refs += next - i;
+			dirty[(c - table->counts) / per_block] = true;
+		} else {
+			table->counts[total] = (struct dedup_count) {blocks[i], 1 + (next - i)};
+			dirty[total++ / per_block] = true;
+		}
+	}
+
+	// Appended counts are merged into block order in one pass
+	uint32_t *order = malloc((total ? total : 1) * sizeof(uint32_t));
+	for(uint32_t i = 0, j = old_count, k = 0; k < total; ++k) {
+		if(j == total || (i < old_count && table->counts[table->order[i]].shared < table->counts[j].shared)) {
+			order[k] = table->order[i++];
+		} else {
+			order[k] = j++;
+		}
+	}
+
+	memcpy(table->order, order, total * sizeof(uint32_t));
+	free(order);
+	table->count = total;
+
+	int err = 0;
+	for(uint32_t i = 0; i < needed && err == 0; ++i) {
+		if(dirty[i]) {
+			err = dedup_write(d, i * per_block);
+		}
+	}
+
+	free(dirty);
+	if(err == 0 && table->block_count > old_block_count) {
+		err = disk_set_refcounts(d, table->blocks[table->block_count - 1]);
+	}
+
+	// Counts are read again rather than trusted after a failed write
+	if(err != 0) {
+		table->loaded = false;
+	}
+
+	pthread_mutex_unlock(&table->lock);
+	pthread_rwlock_unlock(&table->sharing);
+	if(err != 0) {
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "added references to %u blocks", count);
+	return 0;
+}
+
+void dedup_destroy(struct dedup_table *table)
+{
+	free(table->counts);
+	free(table->order);
+	free(table->blocks);
+	free(table->hash_blocks);
+	pthread_rwlock_destroy(&table->sharing);
+	pthread_mutex_destroy(&table->lock);
+}
+
+int dedup_disk(disk d, struct dedup_report *report)
+{
+	syslog(LOG_DEBUG, "deduplicating disk");
+
+	const struct superblock *sb = disk_superblock(d);
+	memset(report, 0, sizeof(struct dedup_report));
+
+	// Only extent maps can point several file blocks at one block
+	if(!(sb->features & DISK_FEATURE_EXTENTS)) {
+		syslog(LOG_ERR, "disk does not map files by extents");
+		return -1;
+	}
+
+	if(dedup_enable(d) != 0 || dedup_compact(d) != 0) {
+		return -1;
+	}
+
+	address root = {sb->root_block, sizeof(struct entry)};
+	if(dedup_walk(d, root, report) != 0) {
+		return -1;
+	}
+
+	syslog(LOG_INFO, "deduplicated disk: shared %lu of %lu file blocks", (unsigned long) report->shared, (unsigned long) report->blocks);
+	return 0;
+}
+
+int dedup_enable(disk d)
+{
+	const struct superblock *sb = disk_superblock(d);
+	if(DEDUP_INDEXED(sb)) {
+		return 0;
+	}
+
+	syslog(LOG_DEBUG, "creating hash index");
+
+	// Index has a slot for every block of disk
+	const uint32_t per_block = DEDUP_HASH_COUNT(sb);
+	const uint32_t count = ((uint64_t) sb->block_count + per_block - 1) / per_block;
+	struct dedup_table *table = disk_dedup_table(d);
+
+	// Index is allocated and linked to superblock in one operation
+	JOURNAL_SCOPE(d);
+	pthread_mutex_lock(&table->lock);
+
+	const block head = block_alloc_many(d, BLOCK_LAST, count, BLOCK_ALLOC_ZERO);
+	if(!BLOCK_VALID(head) || disk_set_hashes(d, head) != 0) {
+		pthread_mutex_unlock(&table->lock);
+		syslog(LOG_ERR, "failed to create hash index");
+		return -1;
+	}
+
+	// Index blocks are walked on next use
+	table->loaded = false;
+	pthread_mutex_unlock(&table->lock);
+
+	syslog(LOG_INFO, "created hash index of %u blocks", count);
+	return 0;
+}
+
+void dedup_init(struct dedup_table *table)
+{
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&table->sharing, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	pthread_mutex_init(&table->lock, NULL);
+	table->counts = NULL;
+	table->order = NULL;
+	table->count = 0;
+	table->capacity = 0;
+	table->blocks = NULL;
+	table->block_count = 0;
+	table->hash_blocks = NULL;
+	table->hash_block_count = 0;
+	table->loaded = false;
+}
+
+int dedup_print(const struct dedup_report *report, char *buffer, size_t size)
+{
+	return snprintf(buffer, size, "%lu files, %lu blocks, %lu shared (%.1f%%)\n",
+			(unsigned long) report->files,
+			(unsigned long) report->blocks,
+			(unsigned long) report->shared,
+			report->blocks ? 100.0 * report->shared / report->blocks : 0.0);
+}
+
+uint32_t dedup_refs(disk d, block shared)
+{
+	// Nothing is shared until a deduplication pass enables the table
+	if(!(disk_superblock(d)->features & DISK_FEATURE_DEDUP)) {
+		return 1;
+	}
+
+	struct dedup_table *table = disk_dedup_table(d);
+	pthread_mutex_lock(&table->lock);
+
+	uint32_t refs = 0;
+	if(dedup_load(d) == 0) {
+		uint32_t position;
+		const struct dedup_count *c = dedup_search(table, shared, &position);
+		refs = c ? c->refs : 1;
+	}
+
+	pthread_mutex_unlock(&table->lock);
+	return refs;
+}
+
+int dedup_release(disk d, block shared, bool *still_shared)
+{
+	*still_shared = false;
+
+	// Nothing is shared until a deduplication pass enables the table
+	if(!(disk_superblock(d)->features & DISK_FEATURE_DEDUP)) {
+		return 0;
+	}
+
+	struct dedup_table *table = disk_dedup_table(d);
+	pthread_mutex_lock(&table->lock);
+
+	if(dedup_load(d) != 0) {
+		pthread_mutex_unlock(&table->lock);
+		return -1;
+	}
+
+	// Last reference leaves a count of one so the count keeps its place
+	uint32_t position;
+	struct dedup_count *c = dedup_search(table, shared, &position);
+	int err = 0;
+	if(c && c->refs > 1) {
+		--c->refs;
+		*still_shared = true;
+		err = dedup_write(d, c - table->counts);
+	}
+
+	pthread_mutex_unlock(&table->lock);
+	return err;
+}
+
+int dedup_set(disk d, block shared, uint32_t refs)
+{
+	syslog(LOG_DEBUG, "setting references of block %u to %u", shared, refs);
+
+	const struct superblock *sb = disk_superblock(d);
+	const uint32_t per_block = DEDUP_BLOCK_COUNT(sb);
+	struct dedup_table *table = disk_dedup_table(d);
+	pthread_mutex_lock(&table->lock);
+
+	if(dedup_load(d) != 0) {
+		pthread_mutex_unlock(&table->lock);
+		return -1;
+	}
+
+	uint32_t position;
+	struct dedup_count *c = dedup_search(table, shared, &position);
+	int err = 0;
+
+	if(c) {
+		c->refs = refs < 1 ? 1 : refs;
+		err = dedup_write(d, c - table->counts);
+	} else if(refs > 1) {
+		// New counts go to the newest table block which becomes head of table list
+		if(table->count == table->block_count * per_block) {
+			const block head = block_alloc(d, table->block_count > 0 ? table->blocks[table->block_count - 1] : BLOCK_LAST);
+			if(!BLOCK_VALID(head)) {
+				pthread_mutex_unlock(&table->lock);
+				return -1;
+			}
+
+			table->blocks = realloc(table->blocks, (table->block_count + 1) * sizeof(block));
+			table->blocks[table->block_count++] = head;
+
+			if(disk_set_refcounts(d, head) != 0) {
+				pthread_mutex_unlock(&table->lock);
+				return -1;
+			}
+		}
+
+		if(table->count == table->capacity) {
+			table->capacity = table->capacity ? table->capacity * 2 : 64;
+			table->counts = realloc(table->counts, table->capacity * sizeof(struct dedup_count));
+			table->order = realloc(table->order, table->capacity * sizeof(uint32_t));
+		}
+
+		table->counts[table->count] = (struct dedup_count) {shared, refs};
+		memmove(table->order + position + 1, table->order + position, (table->count - position) * sizeof(uint32_t));
+		table->order[position] = table->count;
+		err = dedup_write(d, table->count++);
+	}
+
+	pthread_mutex_unlock(&table->lock);
+	if(err != 0) {
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "set references of block %u to %u", shared, refs);
+	return 0;
+}
+
+int dedup_shared(disk d, struct dedup_count **counts, uint32_t *count)
+{
+	*counts = NULL;
+	*count = 0;
+
+	if(!(disk_superblock(d)->features & DISK_FEATURE_DEDUP)) {
+		return 0;
+	}
+
+	struct dedup_table *table = disk_dedup_table(d);
+	pthread_mutex_lock(&table->lock);
+
+	if(dedup_load(d) != 0) {
+		pthread_mutex_unlock(&table->lock);
+		return -1;
+	}
+
+	*counts = malloc((table->count ? table->count : 1) * sizeof(struct dedup_count));
+	for(uint32_t i = 0; i < table->count; ++i) {
+		const struct dedup_count *c = &table->counts[table->order[i]];
+		if(c->refs > 1) {
+			(*counts)[(*count)++] = *c;
+		}
+	}
+
+	pthread_mutex_unlock(&table->lock);
+	return 0;
+}
+
+void dedup_write_begin(disk d)
+{
+	if(write_depth++ > 0) {
+		return;
+	}
+
+	// Blocks only gain references on disks with dedup feature
+	write_held = disk_superblock(d)->features & DISK_FEATURE_DEDUP;
+	if(write_held) {
+		pthread_rwlock_rdlock(&disk_dedup_table(d)->sharing);
+	}
+}
+
+void dedup_write_end(disk d)
+{
+	if(--write_depth > 0 || !write_held) {
+		return;
+	}
+
+	pthread_rwlock_unlock(&disk_dedup_table(d)->sharing);
+}
+
+int dedup_claim(disk d, block candidate, const uint8_t *data, uint8_t *buffer, bool *claimed)
+{
+	const struct superblock *sb = disk_superblock(d);
+	struct dedup_table *table = disk_dedup_table(d);
+	*claimed = false;
+
+	// Index may point at blocks that were freed or reused since they were indexed
+	if(candidate < sb->root_block || candidate >= sb->block_count) {
+		return 0;
+	}
+
+	// Candidate cannot be written in place or freed until it has its reference
+	pthread_rwlock_wrlock(&table->sharing);
+
+	int err = 0;
+	if(block_next(d, candidate) == (block) BLOCK_EXTENT && !journal_freeing(d, candidate)) {
+		err = block_read(d, candidate, buffer);
+		if(err == 0 && memcmp(buffer, data, sb->block_size) == 0) {
+			// A count that cannot grow leaves the duplicate alone
+			const uint32_t refs = dedup_refs(d, candidate);
+			if(refs == 0) {
+				err = -1;
+			} else if(refs < UINT32_MAX) {
+				err = dedup_set(d, candidate, refs + 1);
+				*claimed = err == 0;
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&table->sharing);
+	return err;
+}
+
+int dedup_compact(disk d)
+{
+	syslog(LOG_DEBUG, "compacting reference count table");
+
+	const struct superblock *sb = disk_superblock(d);
+	const uint32_t per_block = DEDUP_BLOCK_COUNT(sb);
+	struct dedup_table *table = disk_dedup_table(d);
+
+	// Old and new table replace each other in one operation
+	JOURNAL_SCOPE(d);
+	pthread_mutex_lock(&table->lock);
+
+	if(dedup_load(d) != 0) {
+		pthread_mutex_unlock(&table->lock);
+		return -1;
+	}
+
+	// Kept counts are written in block order
+	struct dedup_count *counts = malloc((table->count ? table->count : 1) * sizeof(struct dedup_count));
+	uint32_t kept = 0;
+	for(uint32_t i = 0; i < table->count; ++i) {
+		const struct dedup_count *c = &table->counts[table->order[i]];
+		if(c->refs > 1) {
+			counts[kept++] = *c;
+		}
+	}
+
+	const uint32_t needed = (kept + per_block - 1) / per_block;
+	if(kept == table->count && needed == table->block_count) {
+		free(counts);
+		pthread_mutex_unlock(&table->lock);
+		return 0;
+	}
+
+	free(table->counts);
+	table->counts = counts;
+	table->capacity = table->count ? table->count : 1;
+	table->count = kept;
+	for(uint32_t i = 0; i < kept; ++i) {
+		table->order[i] = i;
+	}
+
+	if(table->block_count > 0 && block_free_many(d, table->blocks[table->block_count - 1], UINT32_MAX) == BLOCK_INVALID) {
+		pthread_mutex_unlock(&table->lock);
+		return -1;
+	}
+
+	block head = BLOCK_LAST;
+	if(needed > 0) {
+		head = block_alloc_many(d, BLOCK_LAST, needed, 0);
+		if(!BLOCK_VALID(head)) {
+			table->block_count = 0;
+			table->loaded = false;
+			pthread_mutex_unlock(&table->lock);
+			return -1;
+		}
+	}
+
+	// Table order is reverse list order
+	table->blocks = realloc(table->blocks, (needed ? needed : 1) * sizeof(block));
+	table->block_count = needed;
+	block current = head;
+	for(uint32_t i = needed; i > 0; --i) {
+		table->blocks[i - 1] = current;
+		current = block_next(d, current);
+	}
+
+	int err = disk_set_refcounts(d, head);
+	for(uint32_t i = 0; i < needed && err == 0; ++i) {
+		err = dedup_write(d, i * per_block);
+	}
+
+	pthread_mutex_unlock(&table->lock);
+	if(err != 0) {
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "compacted reference count table to %u counts", kept);
+	return 0;
+}
+
+int dedup_compare(const void *a, const void *b)
+{
+	const block x = *(const block *) a;
+	const block y = *(const block *) b;
+	return (x > y) - (x < y);
+}
+
+int dedup_file(disk d, address addr, struct dedup_report *report)
+{
+	syslog(LOG_DEBUG, "deduplicating entry %u:%u", addr.end_block, addr.end_offset);
+
+	const struct superblock *sb = disk_superblock(d);
+
+	// Sharing, remapping, and freeing commit together
+	JOURNAL_SCOPE(d);
+
+	struct entry ent;
+	if(dir_read(d, addr, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
+		return -1;
+	}
+
+	struct extent_map map;
+	if(extent_load(d, ent.start_block, &map) != 0) {
+		return -1;
+	}
+
+	// Extents are walked as loaded while map is remapped
+	const uint32_t extent_count = map.count;
+	struct extent *extents = malloc((extent_count ? extent_count : 1) * sizeof(struct extent));
+	memcpy(extents, map.extents, extent_count * sizeof(struct extent));
+
+	const uint32_t chunk_block_count = sb->block_size < DEDUP_READ_SIZE ? DEDUP_READ_SIZE / sb->block_size : 1;
+	uint8_t *data = malloc((size_t) chunk_block_count * sb->block_size);
+	uint8_t *buffer = pool_get(sb->block_size);
+	block *duplicates = NULL;
+	uint32_t duplicate_count = 0;
+	int err = 0;
+
+	for(uint32_t i = 0; i < extent_count && !err; ++i) {
+		const struct extent *e = &extents[i];
+		for(uint32_t k = 0; k < e->length && !err;) {
+			const uint32_t chunk_count = e->length - k < chunk_block_count ? e->length - k : chunk_block_count;
+			if(block_read_many(d, e->physical + k, chunk_count, data) != 0) {
+				err = -1;
+				break;
+			}
+
+			for(uint32_t j = 0; j < chunk_count; ++j) {
+				const block b = e->physical + k + j;
+				const uint8_t *block_data = data + (size_t) j * sb->block_size;
+				const uint64_t hash = dedup_hash(block_data, sb->block_size);
+				++report->blocks;
+
+				block match;
+				if(dedup_lookup(d, hash, &match) != 0) {
+					err = -1;
+					break;
+				}
+
+				if(match == b) {
+					continue;
+				}
+
+				bool claimed = false;
+				if(match != BLOCK_INVALID && dedup_claim(d, match, block_data, buffer, &claimed) != 0) {
+					err = -1;
+					break;
+				}
+
+				// First block with this data is what later duplicates share
+				if(!claimed) {
+					if(dedup_insert(d, hash, b) != 0) {
+						err = -1;
+						break;
+					}
+
+					continue;
+				}
+
+				extent_remap(&map, e->logical + k + j, match);
+				duplicates = realloc(duplicates, (duplicate_count + 1) * sizeof(block));
+				duplicates[duplicate_count++] = b;
+				++report->shared;
+			}
+
+			k += chunk_count;
+		}
+	}
+
+	pool_put(buffer, sb->block_size);
+	free(data);
+	free(extents);
+
+	// Entry uses remapped blocks before duplicates are freed
+	if(!err && duplicate_count > 0) {
+		block head = ent.start_block;
+		err = extent_store(d, &head, &map) != 0;
+		ent.start_block = head;
+		err = err || dir_write(d, addr, &ent, sizeof(struct entry)) != sizeof(struct entry);
+	}
+
+	extent_destroy(&map);
+
+	// Duplicates are freed run by run
+	uint32_t run = 0;
+	for(uint32_t k = 1; !err && k <= duplicate_count; ++k) {
+		if(k == duplicate_count || duplicates[k] != duplicates[k - 1] + 1) {
+			err = block_free_extent(d, duplicates[run], k - run);
+			run = k;
+		}
+	}
+
+	free(duplicates);
+	if(err) {
+		syslog(LOG_ERR, "failed to deduplicate entry %u:%u", addr.end_block, addr.end_offset);
+		return -1;
+	}
+
+	++report->files;
+	syslog(LOG_DEBUG, "deduplicated %u blocks of entry %u:%u", duplicate_count, addr.end_block, addr.end_offset);
+	return 0;
+}
+
+uint64_t dedup_hash(const uint8_t *data, uint32_t size)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for(uint32_t i = 0; i < size; ++i) {
+		hash ^= data[i];
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+int dedup_insert(disk d, uint64_t hash, block b)
+{
+	const struct superblock *sb = disk_superblock(d);
+	const uint32_t per_block = DEDUP_HASH_COUNT(sb);
+	struct dedup_table *table = disk_dedup_table(d);
+	pthread_mutex_lock(&table->lock);
+
+	if(dedup_load(d) != 0) {
+		pthread_mutex_unlock(&table->lock);
+		return -1;
+	}
+
+	if(table->hash_block_count == 0) {
+		pthread_mutex_unlock(&table->lock);
+		return 0;
+	}
+
+	const block index = table->hash_blocks[hash % table->hash_block_count];
+	struct dedup_hash *hashes = pool_get(sb->block_size);
+	int err = block_read(d, index, hashes);
+
+	// Hash replaces itself or takes first empty slot and otherwise evicts its home slot
+	const uint32_t home = (hash >> 32) % per_block;
+	uint32_t slot = home;
+	for(uint32_t k = 0; k < DEDUP_HASH_PROBES; ++k) {
+		const uint32_t probe = (home + k) % per_block;
+		if(hashes[probe].b == BLOCK_FREE || hashes[probe].hash == hash) {
+			slot = probe;
+			break;
+		}
+	}
+
+	if(err == 0 && (hashes[slot].hash != hash || hashes[slot].b != b)) {
+		hashes[slot] = (struct dedup_hash) {hash, b};
+		err = block_write(d, index, hashes);
+	}
+
+	pool_put(hashes, sb->block_size);
+	pthread_mutex_unlock(&table->lock);
+	return err;
+}
+
+int dedup_load(disk d)
+{
+	struct dedup_table *table = disk_dedup_table(d);
+	if(table->loaded) {
+		return 0;
+	}
+
+	const struct superblock *sb = disk_superblock(d);
+	const uint32_t per_block = DEDUP_BLOCK_COUNT(sb);
+	table->count = 0;
+	table->block_count = 0;
+	table->hash_block_count = 0;
+
+	// Disks without the feature have no table
+	if(!(sb->features & DISK_FEATURE_DEDUP)) {
+		table->loaded = true;
+		return 0;
+	}
+
+	// Walk hash index list and keep its blocks in list order
+	uint32_t hash_capacity = 4;
+	table->hash_blocks = realloc(table->hash_blocks, hash_capacity * sizeof(block));
+	for(block current = DEDUP_INDEXED(sb) ? sb->hash_block : BLOCK_LAST; current != BLOCK_LAST; current = block_next(d, current)) {
+		// Lists can never be longer than the disk
+		if(!BLOCK_VALID(current) || table->hash_block_count == sb->block_count) {
+			syslog(LOG_ERR, "invalid hash index at %u", sb->hash_block);
+			return -1;
+		}
+
+		if(table->hash_block_count == hash_capacity) {
+			hash_capacity *= 2;
+			table->hash_blocks = realloc(table->hash_blocks, hash_capacity * sizeof(block));
+		}
+
+		table->hash_blocks[table->hash_block_count++] = current;
+	}
+
+	// Walk table list and keep its blocks in table order
+	uint32_t block_capacity = 4;
+	table->blocks = realloc(table->blocks, block_capacity * sizeof(block));
+	for(block current = sb->refcount_block; current != BLOCK_LAST; current = block_next(d, current)) {
+		// Lists can never be longer than the disk
+		if(!BLOCK_VALID(current) || table->block_count == sb->block_count) {
+			syslog(LOG_ERR, "invalid reference count table at %u", sb->refcount_block);
+			return -1;
+		}
+
+		if(table->block_count == block_capacity) {
+			block_capacity *= 2;
+			table->blocks = realloc(table->blocks, block_capacity * sizeof(block));
+		}
+
+		table->blocks[table->block_count++] = current;
+	}
+
+	for(uint32_t i = 0; i < table->block_count / 2; ++i) {
+		const block b = table->blocks[i];
+		table->blocks[i] = table->blocks[table->block_count - 1 - i];
+		table->blocks[table->block_count - 1 - i] = b;
+	}
+
+	// Every table block but the newest is full
+	uint8_t *buffer = pool_get(sb->block_size);
+	for(uint32_t i = 0; i < table->block_count; ++i) {
+		uint32_t count;
+		if(block_read(d, table->blocks[i], buffer) != 0) {
+			pool_put(buffer, sb->block_size);
+			return -1;
+		}
+
+		memcpy(&count, buffer, sizeof(uint32_t));
+		if(count > per_block || (count < per_block && i + 1 < table->block_count)) {
+			syslog(LOG_ERR, "invalid reference count table block %u", table->blocks[i]);
+			pool_put(buffer, sb->block_size);
+			return -1;
+		}
+
+		if(table->count + count > table->capacity) {
+			table->capacity = table->count + count;
+			table->counts = realloc(table->counts, table->capacity * sizeof(struct dedup_count));
+			table->order = realloc(table->order, table->capacity * sizeof(uint32_t));
+		}
+
+		memcpy(table->counts + table->count, buffer + sizeof(uint32_t), count * sizeof(struct dedup_count));
+		table->count += count;
+	}
+
+	pool_put(buffer, sb->block_size);
+
+	// Order counts by block with insertion sort since tables are mostly ordered
+	for(uint32_t i = 0; i < table->count; ++i) {
+		uint32_t k = i;
+		while(k > 0 && table->counts[table->order[k - 1]].shared > table->counts[i].shared) {
+			table->order[k] = table->order[k - 1];
+			--k;
+		}
+
+		table->order[k] = i;
+	}
+
+	table->loaded = true;
+	return 0;
+}
+
+int dedup_lookup(disk d, uint64_t hash, block *match)
+{
+	const struct superblock *sb = disk_superblock(d);
+	const uint32_t per_block = DEDUP_HASH_COUNT(sb);
+	struct dedup_table *table = disk_dedup_table(d);
+	*match = BLOCK_INVALID;
+
+	pthread_mutex_lock(&table->lock);
+
+	if(dedup_load(d) != 0) {
+		pthread_mutex_unlock(&table->lock);
+		return -1;
+	}
+
+	if(table->hash_block_count == 0) {
+		pthread_mutex_unlock(&table->lock);
+		return 0;
+	}
+
+	struct dedup_hash *hashes = pool_get(sb->block_size);
+	const int err = block_read(d, table->hash_blocks[hash % table->hash_block_count], hashes);
+
+	// Slots are never emptied so probing stops at the first empty one
+	const uint32_t home = (hash >> 32) % per_block;
+	for(uint32_t k = 0; k < DEDUP_HASH_PROBES && err == 0; ++k) {
+		const struct dedup_hash *h = &hashes[(home + k) % per_block];
+		if(h->b == BLOCK_FREE) {
+			break;
+		}
+
+		if(h->hash == hash) {
+			*match = h->b;
+			break;
+		}
+	}
+
+	pool_put(hashes, sb->block_size);
+	pthread_mutex_unlock(&table->lock);
+	return err;
+}
+
+struct dedup_count *dedup_search(struct dedup_table *table, block shared, uint32_t *position)
+{
+	uint32_t low = 0;
+	uint32_t high = table->count;
+
+	while(low < high) {
+		const uint32_t middle = low + (high - low) / 2;
+		struct dedup_count *c = &table->counts[table->order[middle]];
+
+		if(shared < c->shared) {
+			high = middle;
+		} else if(shared > c->shared) {
+			low = middle + 1;
+		} else {
+			*position = middle;
+			return c;
+		}
+	}
+
+	*position = low;
+	return NULL;
+}
+
+int dedup_share(disk d, block *head, struct extent_map *map, uint32_t first, uint32_t count, const uint8_t *data, const uint64_t *hashes, bool *shared)
+{
+	const struct superblock *sb = disk_superblock(d);
+	uint8_t *buffer = pool_get(sb->block_size);
+	block *replaced = NULL;
+	block *claimed = NULL;
+	uint32_t claimed_count = 0;
+	int err = 0;
+
+	for(uint32_t k = 0; k < count; ++k) {
+		// Unmapped file blocks are left for the access to report
+		const struct extent *e = extent_find(map, first + k);
+		if(!e) {
+			break;
+		}
+
+		const block physical = e->physical + (first + k - e->logical);
+		block match;
+		if(dedup_lookup(d, hashes[k], &match) != 0) {
+			err = -1;
+			break;
+		}
+
+		bool matched = false;
+		if(match != BLOCK_INVALID && match != physical && dedup_claim(d, match, data + (size_t) k * sb->block_size, buffer, &matched) != 0) {
+			err = -1;
+			break;
+		}
+
+		if(!matched) {
+			continue;
+		}
+
+		replaced = realloc(replaced, (claimed_count + 1) * sizeof(block));
+		claimed = realloc(claimed, (claimed_count + 1) * sizeof(block));
+		replaced[claimed_count] = physical;
+		claimed[claimed_count++] = match;
+		extent_remap(map, first + k, match);
+		shared[k] = true;
+	}
+
+	pool_put(buffer, sb->block_size);
+
+	// Map uses shared blocks before replaced blocks lose a reference
+	if(!err && claimed_count > 0) {
+		err = extent_store(d, head, map) != 0;
+	}
+
+	// Shared blocks give back their reference when map could not use them
+	const bool failed = err;
+	for(uint32_t k = 0; k < claimed_count; ++k) {
+		if(block_free_extent(d, failed ? claimed[k] : replaced[k], 1) != 0) {
+			err = -1;
+		}
+	}
+
+	free(replaced);
+	free(claimed);
+	if(err) {
+		syslog(LOG_ERR, "failed to share %u file blocks at %u", count, first);
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "shared %u of %u file blocks at %u", claimed_count, count, first);
+	return 0;
+}
+
+int dedup_walk(disk d, address addr, struct dedup_report *report)
+{
+	const struct superblock *sb = disk_superblock(d);
+
+	struct entry ent;
+	if(dir_read(d, addr, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
+		return -1;
+	}
+
+	// Only files mapped by extents and directories leading to them are visited
+	if(ENTRY_TOMBSTONE(ent) || ENTRY_INLINE(ent) || ent.start_block == BLOCK_LAST) {
+		return 0;
+	}
+
+	if(ENTRY_EXTENTS(sb, ent)) {
+		return dedup_file(d, addr, report);
+	}
+
+	if(!S_ISDIR(ent.mode)) {
+		return 0;
+	}
+
+	uint32_t capacity = 16;
+	uint32_t count = 0;
+	block *blocks = malloc(capacity * sizeof(block));
+	for(block current = ent.start_block; current != BLOCK_LAST; current = block_next(d, current)) {
+		// Lists can never be longer than the disk
+		if(!BLOCK_VALID(current) || count == sb->block_count) {
+			syslog(LOG_ERR, "invalid block list at %u", ent.start_block);
+			free(blocks);
+			return -1;
+		}
+
+		if(count == capacity) {
+			capacity *= 2;
+			blocks = realloc(blocks, capacity * sizeof(block));
+		}
+
+		blocks[count++] = current;
+	}
+
+	// Remapping a file rewrites its entry but never moves it
+	const uint32_t child_count = ent.size / sizeof(struct entry);
+	for(uint32_t i = 0; i < child_count; ++i) {
+		const address child = dir_locate(sb, blocks, ent.size, (i + 1) * sizeof(struct entry));
+		if(dedup_walk(d, child, report) != 0) {
+			free(blocks);
+			return -1;
+		}
+	}
+
+	free(blocks);
+	return 0;
+}
+
+int dedup_write(disk d, uint32_t index)
+{
+	const struct superblock *sb = disk_superblock(d);
+	const uint32_t per_block = DEDUP_BLOCK_COUNT(sb);
+	struct dedup_table *table = disk_dedup_table(d);
+
+	const uint32_t i = index / per_block;
+	const uint32_t first = i * per_block;
+	const uint32_t count = table->count - first < per_block ? table->count - first : per_block;
+
+	uint8_t *buffer = pool_get(sb->block_size);
+	memset(buffer, 0, sb->block_size);
+	memcpy(buffer, &count, sizeof(uint32_t));
+	memcpy(buffer + sizeof(uint32_t), table->counts + first, count * sizeof(struct dedup_count));
+
+	const int err = block_write(d, table->blocks[i], buffer);
+	pool_put(buffer, sb->block_size);
+	return err;
+}
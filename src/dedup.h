@@ -0,0 +1,118 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "block.h"
+#include "extent.h"
+#include <pthread.h>
+
+// Amount of reference counts held by a block of the reference count table
+#define DEDUP_BLOCK_COUNT(sb)	((sb->block_size - sizeof(uint32_t)) / sizeof(struct dedup_count))
+
+// Amount of hashes held by a block of the hash index
+#define DEDUP_HASH_COUNT(sb)	(sb->block_size / sizeof(struct dedup_hash))
+
+// Amount of slots a hash may occupy from its home slot within its index block
+#define DEDUP_HASH_PROBES	8
+
+// Check whether written blocks are looked up in hash index of disk
+// Disks deduplicated before they had a hash index have a zero head
+#define DEDUP_INDEXED(sb)	((sb)->features & DISK_FEATURE_DEDUP && (sb)->hash_block != BLOCK_LAST && (sb)->hash_block != BLOCK_FREE)
+
+// Amount of file blocks mapping an extent block
+struct __attribute__((__packed__)) dedup_count {
+    block shared;
+    uint32_t refs;
+};
+
+// Hash of data an extent block held when it was written
+struct __attribute__((__packed__)) dedup_hash {
+	uint64_t hash;
+	block b; // BLOCK_FREE marks an empty slot
+};
+
+// Reference counts of extent blocks shared by identical file blocks
+// On disk counts are a block list where each block starts with its amount of counts
+// Counts stay where they were added and never drop below one so changing a count rewrites only its own block
+// Hash index is a fixed block list of hashes of written extent blocks where each hash has a home block and slot
+// Indexed blocks are only hints which are checked before they are shared
+struct dedup_table {
+	pthread_mutex_t lock;
+	pthread_rwlock_t sharing; // Held shared while extent blocks are allocated, written in place, or freed and exclusively while a block gains a reference
+	struct dedup_count *counts; // Counts in table order
+	uint32_t *order; // Indices of counts ordered by block
+	uint32_t count;
+	uint32_t capacity;
+	block *blocks; // Table blocks in table order, which is reverse list order
+	uint32_t block_count;
+	block *hash_blocks; // Hash index blocks in list order
+	uint32_t hash_block_count;
+	bool loaded; // Table was read from disk
+};
+
+// Duplicate file blocks found by a deduplication pass
+struct dedup_report {
+	uint64_t files; // Files mapped by extents
+	uint64_t blocks; // File blocks scanned
+	uint64_t shared; // File blocks remapped to an identical block
+};
+
+// Write size bytes of data at offset of file mapped by map starting at head
+// Whole blocks identical to indexed blocks are remapped to them instead of being written
+// Written whole blocks are added to hash index
+// Returns amount of bytes written
+uint32_t dedup_access(disk d, block *head, struct extent_map *map, uint32_t offset, const void *data, uint32_t size);
+
+// Add a file block reference to each of count extent blocks
+// Blocks appearing more than once gain a reference for each appearance
+// Blocks are sorted in place
+// Returns non-zero on failure
+int dedup_add(disk d, block *blocks, uint32_t count);
+
+// Release resources of reference count table
+void dedup_destroy(struct dedup_table *table);
+
+// Remap file blocks of every file mapped by extents to the first identical block found and free duplicates
+// Hash index is created first so later writes are shared as they happen
+// Blocks are matched by hash index and compared before they are shared
+// Each file is remapped and its duplicates freed as one journaled operation
+// Report is filled with what was scanned and shared
+// Returns non-zero on failure
+int dedup_disk(disk d, struct dedup_report *report);
+
+// Create hash index and enable dedup feature unless disk already has an index
+// Returns non-zero on failure
+int dedup_enable(disk d);
+
+// Initialize an empty reference count table
+void dedup_init(struct dedup_table *table);
+
+// Describe report in buffer of size bytes
+// Returns amount of bytes described had buffer been large enough
+int dedup_print(const struct dedup_report *report, char *buffer, size_t size);
+
+// Count file blocks mapping extent block shared
+// Returns one when block is not shared and zero on failure
+uint32_t dedup_refs(disk d, block shared);
+
+// Drop a file block reference to extent block shared
+// Still shared is set when other file blocks still map block so it must not be freed
+// Returns non-zero on failure
+int dedup_release(disk d, block shared, bool *still_shared);
+
+// Set amount of file blocks mapping extent block shared
+// Blocks without a count are only added once more than one file block maps them
+// Returns non-zero on failure
+int dedup_set(disk d, block shared, uint32_t refs);
+
+// Copy counts of blocks mapped by more than one file block ordered by block
+// Returns non-zero on failure
+int dedup_shared(disk d, struct dedup_count **counts, uint32_t *count);
+
+// Start allocating, writing in place, or freeing extent blocks on calling thread
+// Blocks cannot gain references until it ends
+void dedup_write_begin(disk d);
+
+// Stop allocating, writing in place, or freeing extent blocks on calling thread
+void dedup_write_end(disk d);
+
+#endif
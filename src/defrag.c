@@ -0,0 +1,423 @@
+#include "dedup.h"
+#include "defrag.h"
+#include "entry.h"
+#include "extent.h"
+#include "inode.h"
+#include "journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+// Amount of bytes copied at once while moving a block list
+#define DEFRAG_COPY_SIZE (1 << 20)
+
+// Read block list starting at head in list order
+// Returns non-zero on failure
+int defrag_chain(disk d, block head, block **blocks, uint32_t *count);
+
+// Count runs of consecutive blocks in a block list
+uint32_t defrag_extents(const block *blocks, uint32_t count);
+
+// Move block list of entry at addr into a single run of free blocks
+// Nothing is moved when entry no longer matches expected entry or there is no free run
+// Returns 1 when list was moved, 0 when it was not, and -1 on failure
+int defrag_move(disk d, address addr, const struct entry *expected, const block *blocks, uint32_t count, struct defrag_report *report);
+
+// Move data of extent mapped file entry at addr into a single run of free blocks
+// Nothing is moved when entry no longer matches expected entry or there is no free run
+// Returns 1 when data was moved, 0 when it was not, and -1 on failure
+int defrag_move_extents(disk d, address addr, const struct entry *expected, struct defrag_report *report);
+
+// Read entry at addr and what it maps as one journaled operation so commits cannot change it halfway
+// Blocks is set to block list of entries with one and to NULL otherwise
+// Extent maps are summarized by count, extents, and whether any of their blocks is shared
+// Returns non-zero on failure
+int defrag_read(disk d, address addr, struct entry *ent, block **blocks, uint32_t *count, uint32_t *extents, bool *shared);
+
+// Measure or move block lists of children of entry at addr and then of entry itself
+// Returns non-zero on failure
+int defrag_walk(disk d, address addr, bool move, struct defrag_report *report);
+
+int defrag_disk(disk d, struct defrag_report *report)
+{
+	syslog(LOG_DEBUG, "defragmenting disk");
+
+	const struct superblock *sb = disk_superblock(d);
+	memset(report, 0, sizeof(struct defrag_report));
+
+	address root = {sb->root_block, sizeof(struct entry)};
+	if(defrag_walk(d, root, true, report) != 0) {
+		return -1;
+	}
+
+	syslog(LOG_INFO, "defragmented disk: moved %lu of %lu block lists", (unsigned long) report->moved, (unsigned long) report->lists);
+	return 0;
+}
+
+int defrag_measure(disk d, struct defrag_report *report)
+{
+	syslog(LOG_DEBUG, "measuring fragmentation");
+
+	const struct superblock *sb = disk_superblock(d);
+	memset(report, 0, sizeof(struct defrag_report));
+
+	address root = {sb->root_block, sizeof(struct entry)};
+	if(defrag_walk(d, root, false, report) != 0) {
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "measured fragmentation: %lu of %lu block lists fragmented", (unsigned long) report->fragmented, (unsigned long) report->lists);
+	return 0;
+}
+
+int defrag_print(const struct defrag_report *report, char *buffer, size_t size)
+{
+	return snprintf(buffer, size, "%lu block lists, %lu fragmented (%.1f%%), %.2f extents per list, %lu moved\n",
+			(unsigned long) report->lists,
+			(unsigned long) report->fragmented,
+			report->lists ? 100.0 * report->fragmented / report->lists : 0.0,
+			report->lists ? (double) report->extents / report->lists : 0.0,
+			(unsigned long) report->moved);
+}
+
+int defrag_chain(disk d, block head, block **blocks, uint32_t *count)
+{
+	const struct superblock *sb = disk_superblock(d);
+	uint32_t capacity = 16;
+	*blocks = malloc(capacity * sizeof(block));
+	*count = 0;
+
+	for(block current = head; current != BLOCK_LAST; current = block_next(d, current)) {
+		// Lists can never be longer than the disk
+		if(!BLOCK_VALID(current) || *count == sb->block_count) {
+			syslog(LOG_ERR, "invalid block list at %u", head);
+			free(*blocks);
+			return -1;
+		}
+
+		if(*count == capacity) {
+			capacity *= 2;
+			*blocks = realloc(*blocks, capacity * sizeof(block));
+		}
+
+		(*blocks)[(*count)++] = current;
+	}
+
+	return 0;
+}
+
+uint32_t defrag_extents(const block *blocks, uint32_t count)
+{
+	// Lists are allocated in ascending order so each block follows the next one in list order
+	uint32_t extents = count > 0;
+	for(uint32_t i = 1; i < count; ++i) {
+		if(blocks[i] != blocks[i - 1] - 1) {
+			++extents;
+		}
+	}
+
+	return extents;
+}
+
+int defrag_move(disk d, address addr, const struct entry *expected, const block *blocks, uint32_t count, struct defrag_report *report)
+{
+	syslog(LOG_DEBUG, "moving %u blocks of entry %u:%u", count, addr.end_block, addr.end_offset);
+
+	const struct superblock *sb = disk_superblock(d);
+
+	// Copy, relink, and free commit together while no operation writes entry or its data
+	JOURNAL_EXCLUSIVE_SCOPE(d);
+
+	// Entry may have changed since it was found on a mounted disk
+	struct entry ent;
+	if(dir_read(d, addr, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
+		return -1;
+	}
+
+	if(memcmp(ent.name, expected->name, sizeof(ent.name)) != 0
+			|| ent.create_time != expected->create_time
+			|| ent.start_block != expected->start_block
+			|| ent.size != expected->size) {
+		syslog(LOG_DEBUG, "entry %u:%u changed while defragmenting", addr.end_block, addr.end_offset);
+		return 0;
+	}
+
+	const block head = block_alloc_many(d, BLOCK_LAST, count, BLOCK_ALLOC_CONTIGUOUS);
+	if(!BLOCK_VALID(head)) {
+		syslog(LOG_DEBUG, "no run of %u free blocks for entry %u:%u", count, addr.end_block, addr.end_offset);
+		return 0;
+	}
+
+	// New list runs backward from head so data is in ascending block order
+	const block first = head - (count - 1);
+	const uint32_t chunk_block_count = sb->block_size < DEFRAG_COPY_SIZE ? DEFRAG_COPY_SIZE / sb->block_size : 1;
+	uint8_t *buffer = malloc((size_t) chunk_block_count * sb->block_size);
+	int err = 0;
+
+	// File data bypasses journal while directory data is journaled
+	const bool data = S_ISREG(ent.mode);
+	if(data) {
+		journal_data_begin();
+	}
+
+	for(uint32_t k = 0; k < count && !err;) {
+		const uint32_t chunk_count = count - k < chunk_block_count ? count - k : chunk_block_count;
+
+		// Read runs of old blocks at once
+		for(uint32_t j = 0; j < chunk_count && !err;) {
+			const block start = blocks[count - 1 - k - j];
+			uint32_t length = 1;
+			while(j + length < chunk_count && blocks[count - 1 - k - j - length] == start + length) {
+				++length;
+			}
+
+			err = block_read_many(d, start, length, buffer + (size_t) j * sb->block_size);
+			j += length;
+		}
+
+		err = err || block_write_many(d, first + k, chunk_count, buffer);
+		k += chunk_count;
+	}
+
+	if(data) {
+		journal_data_end();
+	}
+
+	free(buffer);
+
+	if(err) {
+		block_free_many(d, head, count);
+		return -1;
+	}
+
+	// Entry uses new list before old list is freed
+	// Entry is read again right before it is written so only its start block changes
+	if(dir_read(d, addr, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
+		block_free_many(d, head, count);
+		return -1;
+	}
+
+	ent.start_block = head;
+	if(dir_write(d, addr, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
+		block_free_many(d, head, count);
+		return -1;
+	}
+
+	// Children of a moved directory are at new addresses
+	inode_reload(d, addr);
+
+	if(block_free_many(d, blocks[0], count) == BLOCK_INVALID) {
+		syslog(LOG_ERR, "failed to free old blocks of entry %u:%u", addr.end_block, addr.end_offset);
+	}
+
+	++report->moved;
+	syslog(LOG_DEBUG, "moved %u blocks of entry %u:%u to %u", count, addr.end_block, addr.end_offset, first);
+	return 1;
+}
+
+int defrag_move_extents(disk d, address addr, const struct entry *expected, struct defrag_report *report)
+{
+	syslog(LOG_DEBUG, "moving extents of entry %u:%u", addr.end_block, addr.end_offset);
+
+	const struct superblock *sb = disk_superblock(d);
+
+	// Copy, remap, and free commit together while no operation writes entry or its data
+	JOURNAL_EXCLUSIVE_SCOPE(d);
+
+	// Entry may have changed since it was found on a mounted disk
+	struct entry ent;
+	if(dir_read(d, addr, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
+		return -1;
+	}
+
+	if(memcmp(ent.name, expected->name, sizeof(ent.name)) != 0
+			|| ent.create_time != expected->create_time
+			|| ent.start_block != expected->start_block
+			|| ent.size != expected->size) {
+		syslog(LOG_DEBUG, "entry %u:%u changed while defragmenting", addr.end_block, addr.end_offset);
+		return 0;
+	}
+
+	struct extent_map map;
+	if(extent_load(d, ent.start_block, &map) != 0) {
+		return -1;
+	}
+
+	const uint32_t count = extent_count(&map);
+	block *blocks = malloc((size_t) count * sizeof(block));
+	if(block_alloc_extent(d, count, BLOCK_ALLOC_CONTIGUOUS, blocks) != 0) {
+		syslog(LOG_DEBUG, "no run of %u free blocks for entry %u:%u", count, addr.end_block, addr.end_offset);
+		free(blocks);
+		extent_destroy(&map);
+		return 0;
+	}
+
+	const block first = blocks[0];
+	free(blocks);
+
+	// Copy extent by extent in large chunks
+	const uint32_t chunk_block_count = sb->block_size < DEFRAG_COPY_SIZE ? DEFRAG_COPY_SIZE / sb->block_size : 1;
+	uint8_t *buffer = malloc((size_t) chunk_block_count * sb->block_size);
+	int err = 0;
+
+	journal_data_begin();
+	for(uint32_t i = 0; i < map.count && !err; ++i) {
+		const struct extent *e = &map.extents[i];
+		for(uint32_t k = 0; k < e->length && !err;) {
+			const uint32_t chunk_count = e->length - k < chunk_block_count ? e->length - k : chunk_block_count;
+			err = block_read_many(d, e->physical + k, chunk_count, buffer) != 0
+				|| block_write_many(d, first + e->logical + k, chunk_count, buffer) != 0;
+			k += chunk_count;
+		}
+	}
+	journal_data_end();
+
+	free(buffer);
+
+	// Entry uses new extent before old extents are freed
+	struct extent single = {0, first, count};
+	const struct extent_map moved = {&single, 1, 1};
+
+	block head = ent.start_block;
+	err = err || extent_store(d, &head, &moved) != 0;
+
+	// Entry is read again right before it is written so only its start block changes
+	err = err || dir_read(d, addr, &ent, sizeof(struct entry)) != sizeof(struct entry);
+	ent.start_block = head;
+
+	if(err || dir_write(d, addr, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
+		block_free_extent(d, first, count);
+		extent_destroy(&map);
+		return -1;
+	}
+
+	inode_update(d, addr);
+
+	for(uint32_t i = 0; i < map.count; ++i) {
+		if(block_free_extent(d, map.extents[i].physical, map.extents[i].length) != 0) {
+			syslog(LOG_ERR, "failed to free old blocks of entry %u:%u", addr.end_block, addr.end_offset);
+		}
+	}
+
+	extent_destroy(&map);
+
+	++report->moved;
+	syslog(LOG_DEBUG, "moved %u blocks of entry %u:%u to %u", count, addr.end_block, addr.end_offset, first);
+	return 1;
+}
+
+int defrag_read(disk d, address addr, struct entry *ent, block **blocks, uint32_t *count, uint32_t *extents, bool *shared)
+{
+	const struct superblock *sb = disk_superblock(d);
+	*blocks = NULL;
+	*count = 0;
+	*extents = 0;
+	*shared = false;
+
+	JOURNAL_SCOPE(d);
+
+	if(dir_read(d, addr, ent, sizeof(struct entry)) != sizeof(struct entry)) {
+		return -1;
+	}
+
+	// Only entries with data in blocks have block lists
+	if(ENTRY_TOMBSTONE(*ent) || ENTRY_INLINE(*ent) || ent->start_block == BLOCK_LAST) {
+		return 0;
+	}
+
+	// Extent maps are measured by their extents instead of their own block list
+	if(ENTRY_EXTENTS(sb, *ent)) {
+		struct extent_map map;
+		if(extent_load(d, ent->start_block, &map) != 0) {
+			return -1;
+		}
+
+		*count = extent_count(&map);
+		*extents = map.count;
+
+		// Moving shared blocks would give file copies of its own
+		for(uint32_t i = 0; i < map.count && !*shared && (sb->features & DISK_FEATURE_DEDUP); ++i) {
+			for(uint32_t k = 0; k < map.extents[i].length && !*shared; ++k) {
+				*shared = dedup_refs(d, map.extents[i].physical + k) != 1;
+			}
+		}
+
+		extent_destroy(&map);
+		return 0;
+	}
+
+	if(defrag_chain(d, ent->start_block, blocks, count) != 0) {
+		return -1;
+	}
+
+	*extents = defrag_extents(*blocks, *count);
+	return 0;
+}
+
+int defrag_walk(disk d, address addr, bool move, struct defrag_report *report)
+{
+	const struct superblock *sb = disk_superblock(d);
+
+	struct entry ent;
+	block *blocks;
+	uint32_t count;
+	uint32_t extents;
+	bool shared;
+	if(defrag_read(d, addr, &ent, &blocks, &count, &extents, &shared) != 0) {
+		return -1;
+	}
+
+	// Nothing is mapped
+	if(count == 0) {
+		free(blocks);
+		return 0;
+	}
+
+	if(!blocks) {
+		if(move && extents > 1 && !shared) {
+			const int moved = defrag_move_extents(d, addr, &ent, report);
+			if(moved < 0) {
+				return -1;
+			}
+
+			extents = moved ? 1 : extents;
+		}
+
+		++report->lists;
+		report->blocks += count;
+		report->extents += extents;
+		report->fragmented += extents > 1;
+		return 0;
+	}
+
+	// Children are handled first since moving them rewrites entries in this list
+	if(S_ISDIR(ent.mode)) {
+		const uint32_t child_count = ent.size / sizeof(struct entry);
+		for(uint32_t i = 0; i < child_count; ++i) {
+			const address child = dir_locate(sb, blocks, ent.size, (i + 1) * sizeof(struct entry));
+			if(defrag_walk(d, child, move, report) != 0) {
+				free(blocks);
+				return -1;
+			}
+		}
+	}
+
+	if(move && extents > 1) {
+		const int moved = defrag_move(d, addr, &ent, blocks, count, report);
+		if(moved < 0) {
+			free(blocks);
+			return -1;
+		}
+
+		extents = moved ? 1 : extents;
+	}
+
+	++report->lists;
+	report->blocks += count;
+	report->extents += extents;
+	report->fragmented += extents > 1;
+
+	free(blocks);
+	return 0;
+}
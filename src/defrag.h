@@ -0,0 +1,30 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include "dir.h"
+
+// Fragmentation of block lists on a disk
+struct defrag_report {
+	uint64_t lists; // Block lists of non-empty entries
+	uint64_t fragmented; // Block lists made of more than one extent
+	uint64_t extents; // Runs of consecutive blocks in block lists
+	uint64_t blocks;
+	uint64_t moved; // Block lists moved into a single extent
+};
+
+// Move every fragmented block list into a single run of free blocks
+// Each list is copied, linked to its entry, and freed as one journaled operation that no other operation runs alongside
+// Lists without a large enough free run stay where they are
+// Report is filled with fragmentation after defragmenting
+// Returns non-zero on failure
+int defrag_disk(disk d, struct defrag_report *report);
+
+// Measure fragmentation of every block list
+// Returns non-zero on failure
+int defrag_measure(disk d, struct defrag_report *report);
+
+// Describe report in buffer of size bytes
+// Returns amount of bytes described had buffer been large enough
+int defrag_print(const struct defrag_report *report, char *buffer, size_t size);
+
+#endif
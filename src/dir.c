@@ -1,4 +1,5 @@
 #include "dir.h"
+#include "pool.h"
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
@@ -28,30 +29,64 @@ uint32_t dir_access(disk d, address offset, void *readdata, const void *writedat
 		return 0;
 	}
 
-	void *buffer = malloc(sb->block_size);
+	void *buffer = writedata ? pool_get(sb->block_size) : NULL; // Only writes need whole blocks
 	uint32_t accessed = 0; // Amount of bytes accessed
 
-	// Access data block by block
+	// Access data run by run
 	while(accessed < size) {
 		if(!BLOCK_VALID(offset.end_block)) {
 			syslog(LOG_ERR, "invalid block %u", offset.end_block);
 			break;
 		}
 
+		// Whole blocks that are consecutive on disk are accessed together
+		// Blocks of a list step down so a run of them holds data in ascending block order
+		const uint32_t whole_count = (size - accessed) / sb->block_size;
+		if(!(readdata && writedata) && offset.end_offset == sb->block_size && whole_count > 1) {
+			block next;
+			const uint32_t count = block_next_run(d, offset.end_block, whole_count, &next);
+			if(count == 0) {
+				break;
+			}
+
+			const block start = offset.end_block - (count - 1);
+			const uint32_t run_size = count * sb->block_size;
+			const uint32_t data_offset = size - (accessed + run_size);
+			if(readdata && block_read_many(d, start, count, readdata + data_offset) != 0) {
+				break;
+			}
+
+			if(writedata && block_write_many(d, start, count, writedata + data_offset) != 0) {
+				break;
+			}
+
+			accessed += run_size;
+
+			// Seek next address
+			offset.end_block = next;
+			offset.end_offset = sb->block_size;
+			continue;
+		}
+
 		// Access boundaries
 		const uint32_t max_access_size = accessed + offset.end_offset;
 		const uint32_t block_offset = max_access_size > size ? offset.end_offset - (size - accessed) : 0;
 		const uint32_t data_size = offset.end_offset - block_offset;
 		const uint32_t data_offset = size - (accessed + data_size);
 
-		// Read is not needed when writing entire block
-		if(readdata || data_size < sb->block_size) {
+		// Reads only need accessed bytes of block
+		if(!writedata) {
+			if(block_read_range(d, offset.end_block, block_offset, data_size, readdata + data_offset) != 0) {
+				break;
+			}
+		} else if(readdata || data_size < sb->block_size) {
+			// Read is not needed when writing entire block
 			if(block_read(d, offset.end_block, buffer) != 0) {
 				break;
 			}
 		}
 
-		if(readdata) {
+		if(readdata && writedata) {
 			// Get appropriate data
 			memcpy(readdata + data_offset, buffer + block_offset, data_size);
 		}
@@ -79,10 +114,22 @@ uint32_t dir_access(disk d, address offset, void *readdata, const void *writedat
 			accessed
 			);
 
-	free(buffer);
+	pool_put(buffer, sb->block_size);
 	return accessed;
 }
 
+address dir_locate(const struct superblock *sb, const block *blocks, uint32_t size, uint32_t end)
+{
+	// First block only holds end of data
+	const uint32_t first_chunk_size = (size - 1) % sb->block_size + 1;
+	if(end > size - first_chunk_size) {
+		return (address) {blocks[0], end - (size - first_chunk_size)};
+	}
+
+	const uint32_t remaining = size - first_chunk_size - end;
+	return (address) {blocks[remaining / sb->block_size + 1], sb->block_size - remaining % sb->block_size};
+}
+
 address dir_seek(disk d, address addr, uint32_t offset)
 {
 	syslog(LOG_DEBUG, "seeking %u:%u backward by %u", addr.end_block, addr.end_offset, offset);
@@ -91,7 +138,7 @@ address dir_seek(disk d, address addr, uint32_t offset)
 
 	uint32_t seeked = 0;
 
-	// Seek data block by block
+	// Seek data run by run
 	while(1) {
 		if(!BLOCK_VALID(addr.end_block)) {
 			syslog(LOG_ERR, "invalid block %u", addr.end_block);
@@ -103,13 +150,17 @@ address dir_seek(disk d, address addr, uint32_t offset)
 			// Done seeking
 			addr.end_offset -= offset - seeked;
 			break;
-		} else {
-			// Seek next address
-			addr.end_block = block_next(d, addr.end_block);
-			addr.end_offset = sb->block_size;
 		}
 
-		seeked += max_seek_size;
+		// Skip past blocks that are consecutive on disk together
+		const uint32_t steps = (offset - max_seek_size - 1) / sb->block_size + 1;
+		block next;
+		const uint32_t count = block_next_run(d, addr.end_block, steps, &next);
+
+		// Seek next address
+		seeked = max_seek_size + (count > 0 ? count - 1 : 0) * sb->block_size;
+		addr.end_block = count > 0 ? next : BLOCK_INVALID;
+		addr.end_offset = sb->block_size;
 	}
 
 	syslog(LOG_DEBUG, "seeked to %u:%u", addr.end_block, addr.end_offset);
@@ -27,6 +27,10 @@ extern const address DIR_ADDRESS_INVALID;
 // Returns amount of bytes accessed
 uint32_t dir_access(disk d, address offset, void *readdata, const void *writedata, uint32_t size);
 
+// Get address of past-the-end offset end in data of size bytes
+// Blocks hold data in list order starting with block at end of data
+address dir_locate(const struct superblock *sb, const block *blocks, uint32_t size, uint32_t end);
+
 // Seek an address by offset backwards
 // Returns invalid address on failure
 address dir_seek(disk d, address addr, uint32_t offset);
@@ -1,35 +1,144 @@
 #include "block.h"
+#include "dedup.h"
 #include "disk.h"
 #include "entry.h"
-#include <fuse.h>
+#include "inode.h"
+#include "journal.h"
+#include "pool.h"
+#include "small.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <time.h>
 #include <stdio.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
 
-#define DISK_BLOCK_SIZE	1024
+// Amount of bytes generated and written at once while formatting or zeroing
+#define DISK_FORMAT_CHUNK_SIZE	(1 << 20)
+
+// A block list waiting to be freed
+struct reclaim {
+    block head;
+    struct reclaim *next;
+};
 
 struct disk_info {
-    FILE *file;
+    int fd;
+    int direct_fd; // Disk file opened for direct I/O, -1 when unused
+    int flags; // Discard and direct I/O are cleared atomically while disk is in use
     struct superblock superblock;
+    block root; // Block holding entry of shown root directory, zero for root block of superblock
+    pthread_mutex_t fat_lock;
+
+	// FAT blocks cached on first use so FAT entries are read without locking
+	// Loading and updating cached FAT blocks is serialized by its own lock
+	pthread_mutex_t fat_cache_lock;
+	block **fat_cache;
+	uint32_t fat_cache_count; // Amount of FAT blocks cache has room for
+    struct small_store small;
+    struct dedup_table dedup;
+    struct journal journal;
+    struct inode_table inodes;
+
+    // Background reclaiming of removed block lists
+    pthread_mutex_t reclaim_lock;
+    pthread_cond_t reclaim_cond;
+    pthread_t reclaim_thread;
+    struct reclaim *reclaim_queue;
+    bool reclaim_running;
+    bool reclaim_stopping;
 };
 
-// Read or write block entire contents of block
+// Read or write entire contents of count consecutive blocks
 // Offset must be valid
-// Buffer must be size of a block
+// Buffer must be size of count blocks
 // Returns zero on success; otherwise, returns non-zero
-int block_readwrite(disk disk, block offset, void *readbuf, const void *writebuf);
+int block_readwrite(disk disk, block offset, uint32_t count, void *readbuf, const void *writebuf);
+
+// Read size bytes of disk file at position bypassing host page cache when disk is opened for it
+// Returns non-zero on failure
+int read_disk(disk disk, void *buffer, size_t size, off_t position);
+
+// Write size bytes to disk file at position bypassing host page cache when disk is opened for it
+// Returns non-zero on failure
+int write_disk(disk disk, const void *buffer, size_t size, off_t position);
+
+// Access size bytes at position with direct I/O through an aligned buffer
+// Returns zero on success, positive when host filesystem rejects direct I/O, and negative on failure
+int direct_readwrite(disk disk, void *readbuf, const void *writebuf, size_t size, off_t position);
+
+// Get FAT entry of a block on a freshly formatted disk
+block format_fat_entry(const struct superblock *sb, uint64_t b);
+
+// Read superblock again and check it
+// Returns non-zero on failure
+int read_superblock(disk disk);
+
+// Drop cached FAT blocks and make room for FAT blocks of current superblock
+void reset_fat_cache(disk disk);
+
+// Copy count blocks written at offset to the cached FAT blocks among them
+void update_fat_cache(disk disk, block offset, uint32_t count, const void *buffer);
+
+// Free queued block lists until disk is closed
+void *reclaim_loop(void *data);
+
+// Check that superblock describes a disk this program can use
+// Features of version 0 superblocks are set from their journal and inline sizes
+// Returns non-zero on failure
+int validate_superblock(struct superblock *sb);
+
+// Must be defined here because disk is defined here
+int block_discard(disk disk, block offset, uint32_t count)
+{
+	// Freed blocks keep their host storage unless requested otherwise
+	if(!(__atomic_load_n(&disk->flags, __ATOMIC_RELAXED) & DISK_DISCARD)) {
+		return 0;
+	}
+
+	syslog(LOG_DEBUG, "discarding %u blocks at %u", count, offset);
+
+    const struct superblock *sb = disk_superblock(disk);
+	const off_t position = (off_t) offset * sb->block_size;
+	const off_t size = (off_t) count * sb->block_size;
+
+	if(fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, position, size) != 0) {
+		// Host filesystem cannot punch holes so stop trying
+		if(errno == EOPNOTSUPP) {
+			__atomic_and_fetch(&disk->flags, ~DISK_DISCARD, __ATOMIC_RELAXED);
+			syslog(LOG_WARNING, "disk does not support discarding blocks");
+			return 0;
+		}
+
+		syslog(LOG_ERR, "failed to discard %u blocks at %u", count, offset);
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "discarded %u blocks at %u", count, offset);
+	return 0;
+}
 
 // Must be defined here because disk is defined here
 int block_read(disk disk, block offset, void *buffer)
 {
-	return block_readwrite(disk, offset, buffer, NULL);
+	return block_readwrite(disk, offset, 1, buffer, NULL);
 }
 
-int block_readwrite(disk disk, block offset, void *readbuf, const void *writebuf)
+// Must be defined here because disk is defined here
+int block_read_many(disk disk, block offset, uint32_t count, void *buffer)
+{
+	return block_readwrite(disk, offset, count, buffer, NULL);
+}
+
+// Must be defined here because disk is defined here
+int block_read_range(disk disk, block offset, uint32_t position, uint32_t size, void *buffer)
 {
-	syslog(LOG_DEBUG, "%s%s%s block %u", readbuf ? "reading" : "", (readbuf && writebuf) ? "/" : "", writebuf ? "writing" : "", offset);
+	syslog(LOG_DEBUG, "reading %u bytes at %u:%u", size, offset, position);
 
 	// Offset must be valid
 	if(!BLOCK_VALID(offset)) {
@@ -38,100 +147,367 @@ int block_readwrite(disk disk, block offset, void *readbuf, const void *writebuf
 	}
 
     const struct superblock *sb = disk_superblock(disk);
+	const off_t start = (off_t) offset * sb->block_size + position;
+
+	if(pread(disk->fd, buffer, size, start) != (ssize_t) size) {
+		syslog(LOG_ERR, "failed to read %u bytes at %u:%u", size, offset, position);
+		return -1;
+	}
+
+	// Metadata waiting to be committed is newer than disk
+	journal_overlay_range(disk, offset, position, size, buffer);
+
+	syslog(LOG_DEBUG, "read %u bytes at %u:%u", size, offset, position);
+	return 0;
+}
+
+int block_readwrite(disk disk, block offset, uint32_t count, void *readbuf, const void *writebuf)
+{
+	syslog(LOG_DEBUG, "%s%s%s %u blocks at %u", readbuf ? "reading" : "", (readbuf && writebuf) ? "/" : "", writebuf ? "writing" : "", count, offset);
+
+	// Offset must be valid
+	if(!BLOCK_VALID(offset)) {
+		syslog(LOG_ERR, "invalid block %u", offset);
+		return -1;
+	}
 
-	// Seek to block position
-	if(fseek(disk->file, offset * sb->block_size, SEEK_SET) != 0) {
-		syslog(LOG_ERR, "failed to seek disk to block %u", offset);
+	// Read-only disks are never written
+	if(writebuf && (disk->flags & DISK_READONLY)) {
+		syslog(LOG_ERR, "cannot write %u blocks at %u of read-only disk", count, offset);
 		return -1;
 	}
 
+    const struct superblock *sb = disk_superblock(disk);
+	const size_t size = (size_t) count * sb->block_size;
+
+	const off_t position = (off_t) offset * sb->block_size;
+
 	if(readbuf) {
-		// Read entire block
-		if(fread(readbuf, sb->block_size, 1, disk->file) != 1) {
-			syslog(LOG_ERR, "failed to read block %u", offset);
+		// Read entire blocks
+		if(read_disk(disk, readbuf, size, position) != 0) {
+			syslog(LOG_ERR, "failed to read %u blocks at %u", count, offset);
 			return -1;
 		}
+
+		// Metadata waiting to be committed is newer than disk
+		journal_overlay(disk, offset, count, readbuf);
 	}
 
-	if(writebuf) {
-		// Write entire block
-		if(fwrite(writebuf, sb->block_size, 1, disk->file) != 1) {
-			syslog(LOG_ERR, "failed to write block %u", offset);
+	// Metadata is kept until it is committed
+	if(writebuf && journal_store(disk, offset, count, writebuf) != 0) {
+		// Write entire blocks
+		if(write_disk(disk, writebuf, size, position) != 0) {
+			syslog(LOG_ERR, "failed to write %u blocks at %u", count, offset);
 			return -1;
 		}
 	}
 
-	syslog(LOG_DEBUG, "%s%s%s block %u", readbuf ? "read" : "", (readbuf && writebuf) ? "/" : "", writebuf ? "wrote" : "", offset);
+	// Cached FAT blocks must match newest written FAT
+	if(writebuf && offset < BLOCK_FAT + sb->fat_block_count && offset + count > BLOCK_FAT) {
+		update_fat_cache(disk, offset, count, writebuf);
+	}
+
+	syslog(LOG_DEBUG, "%s%s%s %u blocks at %u", readbuf ? "read" : "", (readbuf && writebuf) ? "/" : "", writebuf ? "wrote" : "", count, offset);
+	return 0;
+}
+
+// Must be defined here because disk is defined here
+int block_reclaim(disk disk, block head)
+{
+	// Empty lists have nothing to free
+	if(!BLOCK_VALID(head)) {
+		return 0;
+	}
+
+	if(!(disk->flags & DISK_RECLAIM)) {
+		return block_free_many(disk, head, UINT32_MAX) == BLOCK_INVALID ? -1 : 0;
+	}
+
+	syslog(LOG_DEBUG, "queueing block list %u for reclaiming", head);
+
+	struct reclaim *item = malloc(sizeof(struct reclaim));
+	item->head = head;
+
+	pthread_mutex_lock(&disk->reclaim_lock);
+
+	// Thread is started on first use since mounting may fork after opening disk
+	if(!disk->reclaim_running) {
+		if(pthread_create(&disk->reclaim_thread, NULL, reclaim_loop, disk) != 0) {
+			pthread_mutex_unlock(&disk->reclaim_lock);
+			free(item);
+			syslog(LOG_WARNING, "failed to start reclaiming, freeing block list %u now", head);
+			return block_free_many(disk, head, UINT32_MAX) == BLOCK_INVALID ? -1 : 0;
+		}
+
+		disk->reclaim_running = true;
+	}
+
+	item->next = disk->reclaim_queue;
+	disk->reclaim_queue = item;
+	pthread_cond_signal(&disk->reclaim_cond);
+	pthread_mutex_unlock(&disk->reclaim_lock);
+
+	syslog(LOG_DEBUG, "queued block list %u for reclaiming", head);
+	return 0;
+}
+
+// Must be defined here because disk is defined here
+int block_reserve(disk disk, block offset, uint32_t count)
+{
+	syslog(LOG_DEBUG, "reserving %u blocks at %u", count, offset);
+
+    const struct superblock *sb = disk_superblock(disk);
+	const off_t position = (off_t) offset * sb->block_size;
+	const off_t size = (off_t) count * sb->block_size;
+
+	// Reservation is only a hint so failure is not an error
+	if(fallocate(disk->fd, FALLOC_FL_KEEP_SIZE, position, size) != 0) {
+		syslog(LOG_DEBUG, "failed to reserve %u blocks at %u", count, offset);
+		return 0;
+	}
+
+	syslog(LOG_DEBUG, "reserved %u blocks at %u", count, offset);
 	return 0;
 }
 
 // Must be defined here because disk is defined here
 int block_write(disk disk, block offset, const void *buffer)
 {
-	return block_readwrite(disk, offset, NULL, buffer);
+	return block_readwrite(disk, offset, 1, NULL, buffer);
+}
+
+// Must be defined here because disk is defined here
+int block_write_many(disk disk, block offset, uint32_t count, const void *buffer)
+{
+	return block_readwrite(disk, offset, count, NULL, buffer);
+}
+
+// Must be defined here because disk is defined here
+int block_zero(disk disk, block offset, uint32_t count)
+{
+	syslog(LOG_DEBUG, "zeroing %u blocks at %u", count, offset);
+
+    const struct superblock *sb = disk_superblock(disk);
+	const off_t position = (off_t) offset * sb->block_size;
+	const off_t size = (off_t) count * sb->block_size;
+
+	// Let host filesystem zero range without writing when possible
+	if(fallocate(disk->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, position, size) == 0) {
+		syslog(LOG_DEBUG, "zeroed %u blocks at %u", count, offset);
+		return 0;
+	}
+
+	// Otherwise write zeros chunk by chunk bypassing journal like file data
+	const uint32_t chunk_block_count = sb->block_size < DISK_FORMAT_CHUNK_SIZE ? DISK_FORMAT_CHUNK_SIZE / sb->block_size : 1;
+	void *buffer = calloc(chunk_block_count, sb->block_size);
+	journal_data_begin();
+	for(uint32_t i = 0; i < count;) {
+		const uint32_t chunk_count = count - i < chunk_block_count ? count - i : chunk_block_count;
+		if(block_write_many(disk, offset + i, chunk_count, buffer) != 0) {
+			journal_data_end();
+			free(buffer);
+			return -1;
+		}
+
+		i += chunk_count;
+	}
+
+	journal_data_end();
+	free(buffer);
+	syslog(LOG_DEBUG, "zeroed %u blocks at %u", count, offset);
+	return 0;
 }
 
 int disk_close(disk disk)
 {
 	syslog(LOG_DEBUG, "closing disk");
 
+	// Finish freeing queued block lists
+	pthread_mutex_lock(&disk->reclaim_lock);
+	const bool running = disk->reclaim_running;
+	disk->reclaim_stopping = true;
+	pthread_cond_signal(&disk->reclaim_cond);
+	pthread_mutex_unlock(&disk->reclaim_lock);
+
+	if(running) {
+		pthread_join(disk->reclaim_thread, NULL);
+	}
+
+	// Metadata must reach its home blocks before disk file is closed
+	if(journal_close(disk) != 0) {
+		syslog(LOG_ERR, "failed to close journal");
+	}
+
+	if(disk->direct_fd >= 0) {
+		close(disk->direct_fd);
+	}
+
     // Must be able to close disk file
-    if(fclose(disk->file) != 0) {
+    if(close(disk->fd) != 0) {
 		syslog(LOG_ERR, "failed to close disk");
         return -1;
     }
 
     // Done using disk
+	pthread_cond_destroy(&disk->reclaim_cond);
+	pthread_mutex_destroy(&disk->reclaim_lock);
+	pthread_mutex_destroy(&disk->fat_lock);
+	for(uint32_t i = 0; i < disk->fat_cache_count; ++i) {
+		free(disk->fat_cache[i]);
+	}
+
+	free(disk->fat_cache);
+	pthread_mutex_destroy(&disk->fat_cache_lock);
+	small_destroy(&disk->small);
+	dedup_destroy(&disk->dedup);
+	journal_destroy(&disk->journal);
+	inode_destroy(&disk->inodes);
     free(disk);
 	syslog(LOG_INFO, "closed disk");
     return 0;
 }
 
+struct dedup_table *disk_dedup_table(disk disk)
+{
+	return &disk->dedup;
+}
+
+void disk_fat_lock(disk disk)
+{
+	pthread_mutex_lock(&disk->fat_lock);
+}
+
+void disk_fat_unlock(disk disk)
+{
+	pthread_mutex_unlock(&disk->fat_lock);
+}
+
+const uint32_t *disk_fat_cache(disk disk, uint32_t index)
+{
+	if(index >= disk->fat_cache_count) {
+		syslog(LOG_ERR, "invalid FAT block %u", index);
+		return NULL;
+	}
+
+	// Cached FAT blocks are read without locking
+	block *entries = __atomic_load_n(&disk->fat_cache[index], __ATOMIC_ACQUIRE);
+	if(entries) {
+		return entries;
+	}
+
+	// FAT block is loaded while writers wait so no write is missed
+	pthread_mutex_lock(&disk->fat_cache_lock);
+	entries = disk->fat_cache[index];
+	if(!entries) {
+		entries = malloc(disk->superblock.block_size);
+		if(block_read(disk, BLOCK_FAT + index, entries) != 0) {
+			pthread_mutex_unlock(&disk->fat_cache_lock);
+			free(entries);
+			return NULL;
+		}
+
+		__atomic_store_n(&disk->fat_cache[index], entries, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&disk->fat_cache_lock);
+	return entries;
+}
+
+int disk_flush(disk disk, bool data_only)
+{
+	if((data_only ? fdatasync(disk->fd) : fsync(disk->fd)) != 0) {
+		syslog(LOG_ERR, "failed to flush disk");
+		return -1;
+	}
+
+	return 0;
+}
+
 int disk_format(disk disk, struct superblock sb)
 {
-	syslog(LOG_DEBUG, "formating disk: magic %x, block count %u, fat_block_count %u, block size %u, root block %u",
+	syslog(LOG_DEBUG, "formating disk: magic %x, block count %u, fat_block_count %u, block size %u, root block %u, inline size %u, journal %u blocks at %u, version %u, features %x",
 			sb.magic,
 			sb.block_count,
 			sb.fat_block_count,
 			sb.block_size,
-			sb.root_block);
+			sb.root_block,
+			sb.inline_size,
+			sb.journal_block_count,
+			sb.journal_block,
+			sb.version,
+			sb.features);
+
+	if(validate_superblock(&sb) != 0) {
+		return -1;
+	}
 
 	disk->superblock = sb;
+	reset_fat_cache(disk);
 
-	void *buffer = malloc(disk->superblock.block_size);
-	memset(buffer, 0, disk->superblock.block_size);
+	// Unwritten regions of a new disk file read as zero, which is BLOCK_FREE
+	struct stat st;
+	const bool fresh = fstat(disk->fd, &st) == 0 && st.st_size == 0;
 
-	fseek(disk->file, sb.block_size * sb.block_count - 1, SEEK_SET);
-	fputc('\0', disk->file);
+	// Format in chunks of whole blocks so memory use does not grow with disk size
+	const uint32_t chunk_block_count = sb.block_size < DISK_FORMAT_CHUNK_SIZE ? DISK_FORMAT_CHUNK_SIZE / sb.block_size : 1;
+	void *buffer = malloc((size_t) chunk_block_count * sb.block_size);
+	memset(buffer, 0, sb.block_size);
+
+	// Extend disk file to its full size without allocating host storage
+	if(ftruncate(disk->fd, (off_t) sb.block_size * sb.block_count) != 0) {
+		free(buffer);
+		syslog(LOG_ERR, "failed to extend disk to %u blocks", sb.block_count);
+		return -1;
+	}
 
 	// Write superblock on disk
 	memcpy(buffer, &disk->superblock, sizeof(struct superblock));
 	if(block_write(disk, BLOCK_SUPERBLOCK, buffer) != 0) {
+		free(buffer);
 		return -1;
 	}
 
-	free(buffer);
-
-	block *fat_buffer = malloc(disk->superblock.block_count * sizeof(block));
-	for(block i = 0; i < disk->superblock.block_count; ++i) {
-		if(i == disk->superblock.root_block) {
-			fat_buffer[i] = BLOCK_LAST;
-		} else if(i < disk->superblock.fat_block_count + 1) {
-			fat_buffer[i] = BLOCK_INVALID;
-		} else {
-			fat_buffer[i] = BLOCK_FREE;
+	// Generate and write FAT chunk by chunk
+	const uint32_t entry_count = BLOCK_FAT_ENTRY_COUNT(disk_superblock(disk));
+	block *fat_buffer = buffer;
+	uint32_t written = 0;
+	for(uint32_t i = 0; i < sb.fat_block_count;) {
+		const uint32_t count = sb.fat_block_count - i < chunk_block_count ? sb.fat_block_count - i : chunk_block_count;
+		const uint64_t first = (uint64_t) i * entry_count;
+		const uint64_t end = first + (uint64_t) count * entry_count;
+
+		// Chunks of only free blocks are already zero on a new disk file
+		// Metadata blocks including journal are all before root block
+		const bool free_chunk = first > sb.root_block && end <= sb.block_count;
+
+		if(!fresh || !free_chunk) {
+			for(uint64_t b = first; b < end; ++b) {
+				fat_buffer[b - first] = format_fat_entry(&sb, b);
+			}
+
+			if(block_write_many(disk, BLOCK_FAT + i, count, fat_buffer) != 0) {
+				free(buffer);
+				return -1;
+			}
+
+			written += count;
 		}
+
+		i += count;
 	}
 
-	// Write FAT block by block
-	for(uint32_t i = 0; i < disk->superblock.fat_block_count; ++i) {
-		if(block_write(disk, BLOCK_FAT + i, ((uint8_t *) fat_buffer) + i * disk->superblock.block_size) != 0) {
-			free(fat_buffer);
+	syslog(LOG_DEBUG, "wrote %u of %u FAT blocks", written, sb.fat_block_count);
+
+	// Stale journal contents must never be replayed
+	if(sb.journal_block_count > 0) {
+		memset(buffer, 0, sb.block_size);
+		if(block_write(disk, sb.journal_block, buffer) != 0) {
+			free(buffer);
 			return -1;
 		}
 	}
-	
-	free(fat_buffer);
+
+	free(buffer);
 
 	// Setup root directory
 	time_t current_time = time(NULL);
@@ -143,7 +519,7 @@ int disk_format(disk disk, struct superblock sb)
 		.size = 0,
 		.start_block = BLOCK_LAST,
 		.mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IXOTH,
-		.unused = 0
+		.free_slot = 0
     };
 
 	address root = {sb.root_block, sizeof(struct entry)};
@@ -151,48 +527,456 @@ int disk_format(disk disk, struct superblock sb)
 		return -1;
 	}
 
-	syslog(LOG_INFO, "formatted disk: magic %x, block count %u, fat_block_count %u, block size %u, root block %u",
+	syslog(LOG_INFO, "formatted disk: magic %x, block count %u, fat_block_count %u, block size %u, root block %u, inline size %u, journal %u blocks at %u, version %u, features %x",
 			sb.magic,
 			sb.block_count,
 			sb.fat_block_count,
 			sb.block_size,
-			sb.root_block);
-	return 0;
+			sb.root_block,
+			sb.inline_size,
+			sb.journal_block_count,
+			sb.journal_block,
+			sb.version,
+			sb.features);
+
+	// Start journaling freshly formatted disk
+	return journal_open(disk);
 }
 
-disk disk_open(const char *path, bool truncate)
+disk disk_open(const char *path, int flags)
 {
 	syslog(LOG_DEBUG, "opening disk '%s'", path);
 
     disk disk = malloc(sizeof(struct disk_info));
-	disk->file = NULL;
+	disk->fd = -1;
+	disk->direct_fd = -1;
+	disk->flags = flags;
 
 	// Open disk file
-	if(!truncate) {
-		disk->file = fopen(path, "r+");
+	const int mode = flags & DISK_READONLY ? O_RDONLY : O_RDWR;
+	if(!(flags & DISK_TRUNCATE)) {
+		disk->fd = open(path, mode);
 	}
 
-	// Open disk file and truncate when disk file was not opened
-	if(!disk->file) {
-		disk->file = fopen(path, "w+");
+	// Open disk file and truncate once locked when disk file was not opened
+	bool truncate = flags & DISK_TRUNCATE;
+	if(disk->fd < 0 && !(flags & DISK_READONLY)) {
+		disk->fd = open(path, O_RDWR | O_CREAT, 0666);
+		truncate = true;
 	}
 
     // Disk file could not be opened
-    if(!disk->file) {
+    if(disk->fd < 0) {
 		free(disk);
 		syslog(LOG_ERR, "failed to open disk %s", path);
         return NULL;
     }
 
+	// Readers share disk file while a writer has it to itself
+	if(flock(disk->fd, (flags & DISK_READONLY ? LOCK_SH : LOCK_EX) | LOCK_NB) != 0) {
+		close(disk->fd);
+		free(disk);
+		syslog(LOG_ERR, "disk %s is in use", path);
+		return NULL;
+	}
+
+	// Disk file in use by someone else must be left untouched so truncate only after locking it
+	if(truncate && ftruncate(disk->fd, 0) != 0) {
+		close(disk->fd);
+		free(disk);
+		syslog(LOG_ERR, "failed to truncate disk %s", path);
+		return NULL;
+	}
+
+	// Whole blocks are accessed through a second descriptor bypassing host page cache
+	// Small accesses such as the superblock and FAT entries keep using the first one
+	if(flags & DISK_DIRECT) {
+		disk->direct_fd = open(path, mode | O_DIRECT);
+		if(disk->direct_fd < 0) {
+			disk->flags &= ~DISK_DIRECT;
+			syslog(LOG_WARNING, "disk does not support direct I/O, using host page cache");
+		}
+	}
+
+	disk->root = 0;
+	pthread_mutex_init(&disk->fat_lock, NULL);
+	pthread_mutex_init(&disk->fat_cache_lock, NULL);
+	disk->fat_cache = NULL;
+	disk->fat_cache_count = 0;
+	small_init(&disk->small);
+	dedup_init(&disk->dedup);
+	pthread_mutex_init(&disk->reclaim_lock, NULL);
+	pthread_cond_init(&disk->reclaim_cond, NULL);
+	disk->reclaim_queue = NULL;
+	disk->reclaim_running = false;
+	disk->reclaim_stopping = false;
+	journal_init(&disk->journal);
+	inode_init(&disk->inodes);
+
 	// Read existing superblock on disk
 	// Can't use block_read since block size size is unknown
-	fread(&disk->superblock, sizeof(struct superblock), 1, disk->file);
+	if(pread(disk->fd, &disk->superblock, sizeof(struct superblock), 0) != sizeof(struct superblock)) {
+		memset(&disk->superblock, 0, sizeof(struct superblock));
+	}
+
+	// Disk must be usable and consistent before it is used
+	// Replayed journal may have rewritten superblock
+	if(!(flags & DISK_TRUNCATE) && (validate_superblock(&disk->superblock) != 0 || journal_open(disk) != 0 || read_superblock(disk) != 0)) {
+		if(disk->direct_fd >= 0) {
+			close(disk->direct_fd);
+		}
+
+		close(disk->fd);
+		journal_destroy(&disk->journal);
+		pthread_cond_destroy(&disk->reclaim_cond);
+		pthread_mutex_destroy(&disk->reclaim_lock);
+		pthread_mutex_destroy(&disk->fat_lock);
+		pthread_mutex_destroy(&disk->fat_cache_lock);
+		small_destroy(&disk->small);
+		dedup_destroy(&disk->dedup);
+		inode_destroy(&disk->inodes);
+		free(disk);
+		syslog(LOG_ERR, "failed to open disk %s", path);
+		return NULL;
+	}
+
+	// Replayed FAT blocks are on disk before any of them is cached
+	reset_fat_cache(disk);
+
+	// FAT of a read-only disk never changes so it is loaded once
+	for(uint32_t i = 0; flags & DISK_READONLY && i < disk->fat_cache_count; ++i) {
+		if(!disk_fat_cache(disk, i)) {
+			disk_close(disk);
+			syslog(LOG_ERR, "failed to load FAT of disk %s", path);
+			return NULL;
+		}
+	}
 
 	syslog(LOG_INFO, "opened disk '%s'", path);
     return disk;
 }
 
+block format_fat_entry(const struct superblock *sb, uint64_t b)
+{
+	if(b == sb->root_block) {
+		return BLOCK_LAST;
+	}
+
+	// Metadata blocks and entries past the disk end are never allocatable
+	if(b < sb->root_block || b >= sb->block_count) {
+		return BLOCK_INVALID;
+	}
+
+	return BLOCK_FREE;
+}
+
+struct inode_table *disk_inode_table(disk disk)
+{
+	return &disk->inodes;
+}
+
+struct journal *disk_journal(disk disk)
+{
+	return &disk->journal;
+}
+
+bool disk_readonly(disk disk)
+{
+	return disk->flags & DISK_READONLY;
+}
+
+uint32_t disk_root(disk disk)
+{
+	return disk->root ? disk->root : disk->superblock.root_block;
+}
+
+int disk_set_hashes(disk disk, uint32_t head)
+{
+	syslog(LOG_DEBUG, "setting hash index to %u", head);
+
+	struct superblock sb = disk->superblock;
+	sb.features |= DISK_FEATURE_DEDUP;
+	sb.hash_block = head;
+
+	// Superblock is alone in its block
+	uint8_t *buffer = pool_get(sb.block_size);
+	memset(buffer, 0, sb.block_size);
+	memcpy(buffer, &sb, sizeof(struct superblock));
+	const int err = block_write(disk, BLOCK_SUPERBLOCK, buffer);
+	pool_put(buffer, sb.block_size);
+
+	if(err != 0) {
+		return -1;
+	}
+
+	disk->superblock = sb;
+	syslog(LOG_DEBUG, "set hash index to %u", head);
+	return 0;
+}
+
+int disk_set_refcounts(disk disk, uint32_t head)
+{
+	syslog(LOG_DEBUG, "setting reference count table to %u", head);
+
+	struct superblock sb = disk->superblock;
+	sb.features |= DISK_FEATURE_DEDUP;
+	sb.refcount_block = head;
+
+	// Superblock is alone in its block
+	uint8_t *buffer = pool_get(sb.block_size);
+	memset(buffer, 0, sb.block_size);
+	memcpy(buffer, &sb, sizeof(struct superblock));
+	const int err = block_write(disk, BLOCK_SUPERBLOCK, buffer);
+	pool_put(buffer, sb.block_size);
+
+	if(err != 0) {
+		return -1;
+	}
+
+	disk->superblock = sb;
+	syslog(LOG_DEBUG, "set reference count table to %u", head);
+	return 0;
+}
+
+void disk_set_root(disk disk, uint32_t root)
+{
+	syslog(LOG_DEBUG, "showing root directory at %u", root);
+	disk->root = root;
+}
+
+int disk_set_snapshots(disk disk, uint32_t head)
+{
+	syslog(LOG_DEBUG, "setting snapshot table to %u", head);
+
+	struct superblock sb = disk->superblock;
+	sb.features |= DISK_FEATURE_SNAPSHOT;
+	sb.snapshot_block = head;
+
+	// Superblock is alone in its block
+	uint8_t *buffer = pool_get(sb.block_size);
+	memset(buffer, 0, sb.block_size);
+	memcpy(buffer, &sb, sizeof(struct superblock));
+	const int err = block_write(disk, BLOCK_SUPERBLOCK, buffer);
+	pool_put(buffer, sb.block_size);
+
+	if(err != 0) {
+		return -1;
+	}
+
+	disk->superblock = sb;
+	syslog(LOG_DEBUG, "set snapshot table to %u", head);
+	return 0;
+}
+
+struct small_store *disk_small_store(disk disk)
+{
+	return &disk->small;
+}
+
 const struct superblock *disk_superblock(const disk disk)
 {
     return &disk->superblock;
 }
+
+int disk_sync(disk disk, bool data_only)
+{
+	syslog(LOG_DEBUG, "synchronizing disk");
+
+	// Committing makes metadata durable along with data written before it
+	if(journal_commit(disk) != 0 || disk_flush(disk, data_only) != 0) {
+		syslog(LOG_ERR, "failed to synchronize disk");
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "synchronized disk");
+	return 0;
+}
+
+int read_disk(disk disk, void *buffer, size_t size, off_t position)
+{
+	if(__atomic_load_n(&disk->flags, __ATOMIC_RELAXED) & DISK_DIRECT) {
+		const int err = direct_readwrite(disk, buffer, NULL, size, position);
+		if(err <= 0) {
+			return err;
+		}
+	}
+
+	return pread(disk->fd, buffer, size, position) == (ssize_t) size ? 0 : -1;
+}
+
+int write_disk(disk disk, const void *buffer, size_t size, off_t position)
+{
+	if(__atomic_load_n(&disk->flags, __ATOMIC_RELAXED) & DISK_DIRECT) {
+		const int err = direct_readwrite(disk, NULL, buffer, size, position);
+		if(err <= 0) {
+			return err;
+		}
+	}
+
+	return pwrite(disk->fd, buffer, size, position) == (ssize_t) size ? 0 : -1;
+}
+
+int direct_readwrite(disk disk, void *readbuf, const void *writebuf, size_t size, off_t position)
+{
+	const struct superblock *sb = disk_superblock(disk);
+
+	// Block aligned buffers such as pooled ones are used as is and others go through a pooled buffer
+	const void *data = readbuf ? readbuf : writebuf;
+	size_t bounce_size = 0;
+	void *buffer = (void *) data;
+	if((uintptr_t) data % sb->block_size != 0) {
+		bounce_size = sb->block_size;
+		while(bounce_size < size) {
+			bounce_size *= 2;
+		}
+
+		buffer = pool_get(bounce_size);
+		if(!buffer) {
+			return -1;
+		}
+
+		if(writebuf) {
+			memcpy(buffer, writebuf, size);
+		}
+	}
+
+	const ssize_t done = readbuf ? pread(disk->direct_fd, buffer, size, position) : pwrite(disk->direct_fd, buffer, size, position);
+	if(done < 0 && errno == EINVAL) {
+		// Host filesystem rejects direct I/O of this block size so stop trying
+		pool_put(bounce_size ? buffer : NULL, bounce_size);
+		__atomic_and_fetch(&disk->flags, ~DISK_DIRECT, __ATOMIC_RELAXED);
+		syslog(LOG_WARNING, "disk rejected direct I/O, using host page cache");
+		return 1;
+	}
+
+	if(readbuf && bounce_size && done == (ssize_t) size) {
+		memcpy(readbuf, buffer, size);
+	}
+
+	pool_put(bounce_size ? buffer : NULL, bounce_size);
+	return done == (ssize_t) size ? 0 : -1;
+}
+
+int read_superblock(disk disk)
+{
+	struct superblock sb;
+	if(pread(disk->fd, &sb, sizeof(struct superblock), 0) != sizeof(struct superblock) || validate_superblock(&sb) != 0) {
+		syslog(LOG_ERR, "failed to read superblock");
+		return -1;
+	}
+
+	disk->superblock = sb;
+	return 0;
+}
+
+void reset_fat_cache(disk disk)
+{
+	for(uint32_t i = 0; i < disk->fat_cache_count; ++i) {
+		free(disk->fat_cache[i]);
+	}
+
+	free(disk->fat_cache);
+	disk->fat_cache_count = disk->superblock.fat_block_count;
+	disk->fat_cache = calloc(disk->fat_cache_count, sizeof(block *));
+}
+
+void update_fat_cache(disk disk, block offset, uint32_t count, const void *buffer)
+{
+	const struct superblock *sb = disk_superblock(disk);
+	const uint32_t entry_count = BLOCK_FAT_ENTRY_COUNT(sb);
+
+	pthread_mutex_lock(&disk->fat_cache_lock);
+
+	// Only cached FAT blocks are updated since others are read from disk when needed
+	for(uint32_t i = 0; i < count; ++i) {
+		if(offset + i < BLOCK_FAT || offset + i >= BLOCK_FAT + disk->fat_cache_count) {
+			continue;
+		}
+
+		block *entries = disk->fat_cache[offset + i - BLOCK_FAT];
+		if(!entries) {
+			continue;
+		}
+
+		// Each entry is replaced atomically so lock-free readers never see a torn entry
+		const block *written = (const block *) ((const uint8_t *) buffer + (size_t) i * sb->block_size);
+		for(uint32_t k = 0; k < entry_count; ++k) {
+			__atomic_store_n(&entries[k], written[k], __ATOMIC_RELAXED);
+		}
+	}
+
+	pthread_mutex_unlock(&disk->fat_cache_lock);
+}
+
+void *reclaim_loop(void *data)
+{
+	disk disk = data;
+
+	pthread_mutex_lock(&disk->reclaim_lock);
+	while(1) {
+		// Wait for queued lists unless stopping
+		while(!disk->reclaim_queue && !disk->reclaim_stopping) {
+			pthread_cond_wait(&disk->reclaim_cond, &disk->reclaim_lock);
+		}
+
+		struct reclaim *item = disk->reclaim_queue;
+		if(!item) {
+			break;
+		}
+
+		disk->reclaim_queue = item->next;
+		pthread_mutex_unlock(&disk->reclaim_lock);
+
+		// Freeing fails only on disk errors so the list is left allocated
+		{
+			JOURNAL_SCOPE(disk);
+			if(block_free_many(disk, item->head, UINT32_MAX) == BLOCK_INVALID) {
+				syslog(LOG_ERR, "failed to reclaim block list %u", item->head);
+			}
+		}
+
+		free(item);
+		pthread_mutex_lock(&disk->reclaim_lock);
+	}
+
+	pthread_mutex_unlock(&disk->reclaim_lock);
+	return NULL;
+}
+
+int validate_superblock(struct superblock *sb)
+{
+	if(sb->magic != DISK_MAGIC) {
+		syslog(LOG_ERR, "invalid magic %x", sb->magic);
+		return -1;
+	}
+
+	if(sb->version > DISK_VERSION) {
+		syslog(LOG_ERR, "unsupported version %u", sb->version);
+		return -1;
+	}
+
+	if(sb->version == 0) {
+		sb->features = (sb->journal_block_count ? DISK_FEATURE_JOURNAL : 0) | (sb->inline_size ? DISK_FEATURE_INLINE : 0);
+	}
+
+	if(sb->features & ~DISK_FEATURES) {
+		syslog(LOG_ERR, "unsupported features %x", sb->features & ~DISK_FEATURES);
+		return -1;
+	}
+
+	if(!DISK_BLOCK_SIZE_VALID(sb->block_size)) {
+		syslog(LOG_ERR, "invalid block size %u", sb->block_size);
+		return -1;
+	}
+
+	// Disabled features must not leave anything for other code to use
+	if((!(sb->features & DISK_FEATURE_JOURNAL) && sb->journal_block_count)
+			|| (!(sb->features & DISK_FEATURE_INLINE) && sb->inline_size)
+			|| ((sb->features & DISK_FEATURE_DEDUP) && !(sb->features & DISK_FEATURE_EXTENTS))
+			|| ((sb->features & DISK_FEATURE_SNAPSHOT) && !(sb->features & DISK_FEATURE_EXTENTS))) {
+		syslog(LOG_ERR, "superblock uses disabled features");
+		return -1;
+	}
+
+	return 0;
+}
@@ -5,9 +5,51 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Magic of a FAT filesystem superblock
+#define DISK_MAGIC	0x2345beef
+
+// Newest superblock version
+// Version 0 superblocks predate features, which are implied by their journal and inline sizes
+#define DISK_VERSION	1
+
+// Disk features
+// A disk with features this program does not know is never opened
+#define DISK_FEATURE_JOURNAL	(1 << 0) // Metadata journal
+#define DISK_FEATURE_INLINE		(1 << 1) // Small files and long names in small blocks
+#define DISK_FEATURE_EXTENTS	(1 << 2) // Files mapped by extents instead of block lists
+#define DISK_FEATURE_DEDUP		(1 << 3) // Extent blocks shared by identical file blocks, enabled by deduplicating or formatting for it
+#define DISK_FEATURE_SNAPSHOT	(1 << 4) // Frozen root directories sharing extent blocks with later writes, enabled by the first snapshot
+#define DISK_FEATURES			(DISK_FEATURE_JOURNAL | DISK_FEATURE_INLINE | DISK_FEATURE_EXTENTS | DISK_FEATURE_DEDUP | DISK_FEATURE_SNAPSHOT)
+
+// Block sizes
+// Large blocks suit bulk data since FAT size and block list length shrink with block size
+#define DISK_BLOCK_SIZE_MIN		512
+#define DISK_BLOCK_SIZE_MAX		(1 << 20)
+#define DISK_BLOCK_SIZE_DEFAULT	4096
+#define DISK_BLOCK_SIZE_VALID(size)	((size) >= DISK_BLOCK_SIZE_MIN && (size) <= DISK_BLOCK_SIZE_MAX && ((size) & ((size) - 1)) == 0)
+
+// Disk open flags
+#define DISK_TRUNCATE	(1 << 0) // Create an empty disk file
+#define DISK_DISCARD	(1 << 1) // Punch holes in disk file for freed blocks
+#define DISK_RECLAIM	(1 << 2) // Free removed block lists in the background
+#define DISK_DIRECT		(1 << 3) // Access whole blocks bypassing host page cache when host filesystem allows it
+#define DISK_READONLY	(1 << 4) // Never write disk file so other read-only openers can share it
+
 // A FAT filesystem disk
 typedef struct disk_info *disk;
 
+// Reference counts of shared blocks of a FAT filesystem disk
+struct dedup_table;
+
+// Cached entries of a FAT filesystem disk
+struct inode_table;
+
+// Metadata journal of a FAT filesystem disk
+struct journal;
+
+// Small blocks of a FAT filesystem disk
+struct small_store;
+
 // FAT filesystem superblock information
 struct __attribute__((__packed__)) superblock {
     uint32_t magic;
@@ -15,21 +57,93 @@ struct __attribute__((__packed__)) superblock {
     uint32_t fat_block_count;
     uint32_t block_size;
     uint32_t root_block;
+    uint32_t inline_size; // Maximum size of files stored in small blocks, zero when disabled
+    uint32_t journal_block; // First journal block
+    uint32_t journal_block_count; // Amount of journal blocks, zero when disabled
+    uint32_t version;
+    uint32_t features; // Disk features enabled when formatting
+    uint32_t refcount_block; // Head of reference count table of shared blocks, unused without dedup feature
+    uint32_t hash_block; // Head of hash index of written extent blocks, unused without dedup feature
+    uint32_t snapshot_block; // Head of snapshot table, unused without snapshot feature
 };
 
 // Close a FAT filesystem disk
+// Waits for block lists queued for reclaiming to be freed
+// Commits journal
 // Returns non-zero on failure
 int disk_close(disk disk);
 
+// Get reference counts of shared blocks of disk
+struct dedup_table *disk_dedup_table(disk disk);
+
+// Wait for exclusive access to FAT
+void disk_fat_lock(disk disk);
+
+// Release exclusive access to FAT
+void disk_fat_unlock(disk disk);
+
+// Get entries of FAT block index loading them on first use
+// Entries stay coherent with FAT writes and must be read atomically
+// Reading them needs no lock
+// Returns NULL on failure
+const uint32_t *disk_fat_cache(disk disk, uint32_t index);
+
+// Flush disk writes to stable storage without committing journal
+// Only data needed to read it back is flushed when data_only is set
+// Returns non-zero on failure
+int disk_flush(disk disk, bool data_only);
+
 // Format a FAT filesystem according to a superblock
 // Returns non-zero on failure
 int disk_format(disk disk, struct superblock sb);
 
-// Open a FAT filesystem disk
+// Get cached entries of disk
+struct inode_table *disk_inode_table(disk disk);
+
+// Get metadata journal of disk
+struct journal *disk_journal(disk disk);
+
+// Open a FAT filesystem disk with disk open flags
+// Superblock must have a known version, known features, and a valid block size
+// Replays metadata committed to journal but not to its home blocks
+// Disk file is locked so only read-only openers share it
+// Read-only disks load their whole FAT and cannot be opened while their journal needs replaying
 // Returns NULL on failure
-disk disk_open(const char *path, bool truncate);
+disk disk_open(const char *path, int flags);
+
+// Check whether disk was opened read-only
+bool disk_readonly(disk disk);
+
+// Get block holding entry of root directory of disk alone
+// It is root block of superblock unless a snapshot was chosen as root
+uint32_t disk_root(disk disk);
+
+// Enable dedup feature and point superblock at hash index starting at head
+// Returns non-zero on failure
+int disk_set_hashes(disk disk, uint32_t head);
+
+// Enable dedup feature and point superblock at reference count table starting at head
+// Returns non-zero on failure
+int disk_set_refcounts(disk disk, uint32_t head);
+
+// Show root directory held by root block instead of root directory of superblock
+// Only read-only disks may show another root directory
+// Must be set before any entry is looked up
+void disk_set_root(disk disk, uint32_t root);
+
+// Enable snapshot feature and point superblock at snapshot table starting at head
+// Returns non-zero on failure
+int disk_set_snapshots(disk disk, uint32_t head);
+
+// Get small block store of disk
+struct small_store *disk_small_store(disk disk);
 
 // Get FAT superblock
 const struct superblock *disk_superblock(const disk disk);
 
+// Commit journal and flush disk writes to stable storage
+// Only data needed to read it back is flushed when data_only is set
+// Returns non-zero on failure
+int disk_sync(disk disk, bool data_only);
+
 #endif
@@ -1,11 +1,35 @@
 #include "entry.h"
-#include <fuse.h>
+#include "dedup.h"
+#include "extent.h"
+#include "inode.h"
+#include "journal.h"
+#include "small.h"
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <time.h>
 
-uint32_t entry_alloc(disk d, address entry, uint32_t size)
+// Allocate size bytes past end of an inline or empty file entry
+// Returns amount of bytes allocated
+uint32_t inline_alloc(disk d, address entry, struct entry *ent, uint32_t size, bool zero);
+
+// Allocate blocks for ent holding ent->size bytes and write size bytes of data at their start
+// Blocks are released again on failure
+// Returns non-zero on failure
+int inline_move(disk d, struct entry *ent, const void *data, uint32_t size, bool zero);
+
+// Allocate size bytes past end of a file entry mapped by extents
+// Returns amount of bytes allocated
+uint32_t mapped_alloc(disk d, address entry, struct entry *ent, uint32_t size, bool zero);
+
+// Hash a name using FNV-1a
+uint32_t name_hash(const char *name);
+
+// Get address of child entry at slot in entry directory
+// Returns invalid address on failure
+address slot_address(disk d, const struct entry *parent, uint32_t slot);
+
+uint32_t entry_alloc(disk d, address entry, uint32_t size, bool zero)
 {
 	syslog(LOG_DEBUG, "allocating %u bytes for entry %u:%u", size, entry.end_block, entry.end_offset);
 
@@ -16,53 +40,143 @@ uint32_t entry_alloc(disk d, address entry, uint32_t size)
 		return 0;
 	}
 
-	block next = ent.start_block;
-	uint32_t block_unallocated = sb->block_size - ENTRY_FIRST_CHUNK_SIZE(sb, ent);
-	uint32_t allocated = 0;
+	// Small files live in small block cells
+	if(ENTRY_INLINE(ent) || (S_ISREG(ent.mode) && ent.size == 0 && size > 0 && size <= sb->inline_size)) {
+		return inline_alloc(d, entry, &ent, size, zero);
+	}
+
+	if(ENTRY_EXTENTS(sb, ent)) {
+		return mapped_alloc(d, entry, &ent, size, zero);
+	}
+
+	const uint32_t first_chunk_size = ENTRY_FIRST_CHUNK_SIZE(sb, ent);
+	uint32_t block_unallocated = sb->block_size - first_chunk_size;
 
 	// Completely unallocated blocks don't exist
 	if(block_unallocated == sb->block_size) {
 		block_unallocated = 0;
 	}
 
-	// Allocate block by block
-	while(1) {
-		ent.start_block = next;
+	// Zero unallocated part of first block that becomes allocated
+	if(zero && block_unallocated > 0 && size > 0) {
+		const uint32_t zero_size = size < block_unallocated ? size : block_unallocated;
+		void *zeros = calloc(1, zero_size);
+		address addr = {ent.start_block, first_chunk_size + zero_size};
 
-		const uint32_t max_allocation_size = allocated + block_unallocated;
-		if(max_allocation_size >= size) {
-			// Done allocating
-			allocated = size;
-			break;
-		} else {
-			// Allocate chunk
-			allocated += block_unallocated;
-
-			// Allocate another block
-			block_unallocated = sb->block_size;
-			next = block_alloc(d, next);
-			if(!BLOCK_VALID(next)) {
-				break;
-			}
+		// File data bypasses journal
+		if(S_ISREG(ent.mode)) {
+			journal_data_begin();
+		}
+
+		const uint32_t zeroed = dir_write(d, addr, zeros, zero_size);
+
+		if(S_ISREG(ent.mode)) {
+			journal_data_end();
+		}
+
+		free(zeros);
+
+		if(zeroed != zero_size) {
+			return 0;
 		}
 	}
 
+	// Allocate every missing block at once
+	if(size > block_unallocated) {
+		const uint32_t count = (size - block_unallocated - 1) / sb->block_size + 1;
+		const int flags = (zero ? BLOCK_ALLOC_ZERO : 0) | (size >= ENTRY_RESERVE_SIZE ? BLOCK_ALLOC_RESERVE : 0);
+
+		const block head = block_alloc_many(d, ent.start_block, count, flags);
+		if(!BLOCK_VALID(head)) {
+			return 0;
+		}
+
+		ent.start_block = head;
+	}
+
 	// Update size and access and modify times
 	time_t t = time(NULL);
 	ent.access_time = t;
 	ent.modify_time = t;
-	ent.size += allocated;
+	ent.size += size;
 	if(dir_write(d, entry, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
 		// TODO Blocks were allocated but entry cannot access them
 		syslog(LOG_CRIT, "failed to update entry %u:%u", entry.end_block, entry.end_offset);
 		return 0;
 	}
 
-	syslog(LOG_DEBUG, "allocated %u bytes for entry %u:%u", allocated, entry.end_block, entry.end_offset);
-	return allocated;
+	syslog(LOG_DEBUG, "allocated %u bytes for entry %u:%u", size, entry.end_block, entry.end_offset);
+	return size;
+}
+
+int entry_compact(disk d, address entry)
+{
+	syslog(LOG_DEBUG, "compacting entry %u:%u", entry.end_block, entry.end_offset);
+
+	const struct superblock *sb = disk_superblock(d);
+
+	struct entry parent;
+	if(dir_read(d, entry, &parent, sizeof(struct entry)) != sizeof(struct entry)) {
+		return -1;
+	}
+
+	const uint32_t count = parent.size / sizeof(struct entry);
+	if(count == 0) {
+		return 0;
+	}
+
+	// Read every child at once
+	struct entry *children = malloc(parent.size);
+	address head = {parent.start_block, ENTRY_FIRST_CHUNK_SIZE(sb, parent)};
+	if(dir_read(d, head, children, parent.size) != parent.size) {
+		free(children);
+		return -1;
+	}
+
+	// Move live children in front of tombstones keeping their order
+	uint32_t live = 0;
+	for(uint32_t i = 0; i < count; ++i) {
+		if(!ENTRY_TOMBSTONE(children[i])) {
+			children[live++] = children[i];
+		}
+	}
+
+	// Write live children over the start of directory
+	if(live > 0) {
+		const uint32_t live_size = live * sizeof(struct entry);
+		const address addr = slot_address(d, &parent, live - 1);
+		if(!DIR_ADDRESS_VALID(sb, addr) || dir_write(d, addr, children, live_size) != live_size) {
+			free(children);
+			return -1;
+		}
+	}
+
+	free(children);
+
+	// Drop tombstones at end of directory
+	const uint32_t dead_size = (count - live) * sizeof(struct entry);
+	if(entry_free(d, entry, dead_size) != dead_size) {
+		return -1;
+	}
+
+	// No free slots are left
+	if(dir_read(d, entry, &parent, sizeof(struct entry)) != sizeof(struct entry)) {
+		return -1;
+	}
+
+	parent.free_slot = 0;
+	if(dir_write(d, entry, &parent, sizeof(struct entry)) != sizeof(struct entry)) {
+		return -1;
+	}
+
+	// Cached children moved to new addresses
+	inode_reload(d, entry);
+
+	syslog(LOG_DEBUG, "compacted entry %u:%u from %u to %u children", entry.end_block, entry.end_offset, count, live);
+	return 0;
 }
 
-address entry_find(disk d, address entry, const char *name)
+address entry_find(disk d, address entry, const char *name, uint32_t *slot)
 {
 	syslog(LOG_DEBUG, "finding '%s' in entry %u:%u", name, entry.end_block, entry.end_offset);
 
@@ -80,32 +194,56 @@ address entry_find(disk d, address entry, const char *name)
 
 	address addr = {parent.start_block, ENTRY_FIRST_CHUNK_SIZE(sb, parent)};
 
-	// Find entry with specified name
-	while(1) {
-		if(!DIR_ADDRESS_VALID(sb, addr)) {
-			break;
-		}
+	// Long names are compared by hash before reading them
+	const size_t length = strlen(name);
+	const bool long_name = length > ENTRY_NAME_LENGTH;
+	const uint32_t hash = long_name ? name_hash(name) : 0;
+	char child_name[ENTRY_LONG_NAME_LENGTH + 1];
 
+	// Find entry with specified name
+	for(uint32_t i = parent.size / sizeof(struct entry); i > 0; --i) {
 		// Read child entry
 		struct entry child;
 		if(dir_read(d, addr, &child, sizeof(struct entry)) != sizeof(struct entry)) {
 			break;
 		}
 
-		if(strcmp(child.name, name) == 0) {
+		bool match;
+		if(ENTRY_TOMBSTONE(child)) {
+			match = false;
+		} else if(!long_name) {
+			match = strcmp(child.name, name) == 0;
+		} else {
+			match = ENTRY_LONG_NAME(child)
+				&& child.long_name.length == length
+				&& child.long_name.hash == hash
+				&& entry_name(d, &child, child_name) == 0
+				&& strcmp(child_name, name) == 0;
+		}
+
+		if(match) {
+			// Get child slot when needed
+			if(slot) {
+				*slot = i - 1;
+			}
+
 			syslog(LOG_DEBUG, "found '%s' in entry %u:%u at %u:%u",
 					name,
 					entry.end_block,
 					entry.end_offset,
 					addr.end_block,
 					addr.end_offset);
-			break;
+			return addr;
 		}
 
-		addr = dir_seek(d, addr, sizeof(struct entry));
+		// Seek previous child unless this is the first one
+		if(i > 1) {
+			addr = dir_seek(d, addr, sizeof(struct entry));
+		}
 	}
 
-	return addr;
+	syslog(LOG_DEBUG, "'%s' not found in entry %u:%u", name, entry.end_block, entry.end_offset);
+	return DIR_ADDRESS_INVALID;
 }
 
 uint32_t entry_free(disk d, address entry, uint32_t size)
@@ -125,31 +263,45 @@ uint32_t entry_free(disk d, address entry, uint32_t size)
 		return 0;
 	}
 
-	uint32_t block_allocated = ENTRY_FIRST_CHUNK_SIZE(sb, ent);
-	uint32_t freed = 0;
+	if(ENTRY_INLINE(ent)) {
+		// Cell is freed only once file is empty
+		if(size == ent.size) {
+			if(small_free(d, ent.start_block, ent.inline_cell - 1) != 0) {
+				return 0;
+			}
 
-	// Free block by block
-	while(1) {
-		if(!BLOCK_VALID(ent.start_block)) {
-			break;
+			ent.start_block = BLOCK_LAST;
+			ent.inline_cell = 0;
 		}
+	} else if(ENTRY_EXTENTS(sb, ent)) {
+		// Only blocks that become completely unused are freed
+		const uint32_t count = ent.size - size == 0 ? 0 : (ent.size - size - 1) / sb->block_size + 1;
 
-		const uint32_t max_free_size = freed + block_allocated;
-		if(max_free_size > size) {
-			// Done freeing
-			freed = size;
-			break;
-		} else {
-			block next = block_next(d, ent.start_block);
+		struct extent_map map;
+		if(extent_load(d, ent.start_block, &map) != 0) {
+			return 0;
+		}
+
+		block head = ent.start_block;
+		const int err = extent_shrink(d, &map, count) != 0 || extent_store(d, &head, &map) != 0;
+		ent.start_block = head;
+		extent_destroy(&map);
 
-			// Free block
-			if(block_free(d, ent.start_block) != 0) {
-				break;
+		if(err) {
+			return 0;
+		}
+	} else {
+		// Only blocks that become completely unused are freed
+		const uint32_t first_chunk_size = ENTRY_FIRST_CHUNK_SIZE(sb, ent);
+		const uint32_t count = size < first_chunk_size || size == 0 ? 0 : (size - first_chunk_size) / sb->block_size + 1;
+
+		// Free every unused block at once
+		if(count > 0) {
+			const block next = block_free_many(d, ent.start_block, count);
+			if(next == BLOCK_INVALID) {
+				return 0;
 			}
 
-			// Update next block information
-			freed += block_allocated;
-			block_allocated = sb->block_size;
 			ent.start_block = next;
 		}
 	}
@@ -158,17 +310,217 @@ uint32_t entry_free(disk d, address entry, uint32_t size)
 	time_t t = time(NULL);
 	ent.access_time = t;
 	ent.modify_time = t;
-	ent.size -= freed;
+	ent.size -= size;
 	if(dir_write(d, entry, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
 		// TODO Blocks were freed but entry still tries to use them
 		syslog(LOG_CRIT, "failed to update entry %u:%u", entry.end_block, entry.end_offset);
 		return 0;
 	}
 
-	syslog(LOG_DEBUG, "freed %u bytes for entry %u:%u", freed, entry.end_block, entry.end_offset);
-	return freed;
+	syslog(LOG_DEBUG, "freed %u bytes for entry %u:%u", size, entry.end_block, entry.end_offset);
+	return size;
+}
+
+int entry_name(disk d, const struct entry *ent, char *name)
+{
+	if(!ENTRY_LONG_NAME(*ent)) {
+		strncpy(name, ent->name, ENTRY_NAME_LENGTH + 1);
+		name[ENTRY_NAME_LENGTH] = '\0';
+		return 0;
+	}
+
+	const uint32_t length = ent->long_name.length;
+	if(small_access(d, ent->long_name.small_block, ent->long_name.cell, 0, name, NULL, length) != length) {
+		syslog(LOG_ERR, "failed to read name at %u:%u", ent->long_name.small_block, ent->long_name.cell);
+		return -1;
+	}
+
+	name[length] = '\0';
+	return 0;
+}
+
+int entry_release(disk d, const struct entry *ent)
+{
+	if(entry_release_name(d, ent) != 0) {
+		return -1;
+	}
+
+	if(ENTRY_INLINE(*ent)) {
+		return small_free(d, ent->start_block, ent->inline_cell - 1);
+	}
+
+	// Extent maps are freed at once since their blocks do not form a list to reclaim
+	if(ENTRY_EXTENTS(disk_superblock(d), *ent)) {
+		return extent_release(d, ent->start_block);
+	}
+
+	return block_reclaim(d, ent->start_block);
+}
+
+int entry_release_name(disk d, const struct entry *ent)
+{
+	if(!ENTRY_LONG_NAME(*ent)) {
+		return 0;
+	}
+
+	return small_free(d, ent->long_name.small_block, ent->long_name.cell);
+}
+
+int entry_rename(disk d, struct entry *ent, const char *name)
+{
+	const struct superblock *sb = disk_superblock(d);
+	const size_t length = strlen(name);
+
+	if(length > ENTRY_NAME_MAX(sb)) {
+		syslog(LOG_ERR, "name too long '%s'", name);
+		return -1;
+	}
+
+	if(length <= ENTRY_NAME_LENGTH) {
+		strncpy(ent->name, name, sizeof(ent->name));
+	} else {
+		// Store long name in its own cell
+		block small;
+		uint32_t cell;
+		if(small_alloc(d, &small, &cell) != 0) {
+			return -1;
+		}
+
+		if(small_access(d, small, cell, 0, NULL, name, length) != length) {
+			small_free(d, small, cell);
+			return -1;
+		}
+
+		memset(ent->name, 0, sizeof(ent->name));
+		ent->long_name.length = length;
+		ent->long_name.hash = name_hash(name);
+		ent->long_name.small_block = small;
+		ent->long_name.cell = cell;
+	}
+
+	return 0;
+}
+
+int entry_link(disk d, address entry, const struct entry *child, address *child_addr)
+{
+	syslog(LOG_DEBUG, "linking '%s' in entry %u:%u", child->name, entry.end_block, entry.end_offset);
+
+	const struct superblock *sb = disk_superblock(d);
+
+	struct entry parent;
+	if(dir_read(d, entry, &parent, sizeof(struct entry)) != sizeof(struct entry)) {
+		return -1;
+	}
+
+	address addr;
+	if(parent.free_slot != 0) {
+		// Reuse first free slot
+		addr = slot_address(d, &parent, parent.free_slot - 1);
+		struct entry tombstone;
+		if(!DIR_ADDRESS_VALID(sb, addr) || dir_read(d, addr, &tombstone, sizeof(struct entry)) != sizeof(struct entry)) {
+			return -1;
+		}
+
+		if(dir_write(d, addr, child, sizeof(struct entry)) != sizeof(struct entry)) {
+			return -1;
+		}
+
+		// Remove slot from free slots
+		time_t t = time(NULL);
+		parent.access_time = t;
+		parent.modify_time = t;
+		parent.free_slot = tombstone.free_slot;
+		if(dir_write(d, entry, &parent, sizeof(struct entry)) != sizeof(struct entry)) {
+			syslog(LOG_CRIT, "failed to update entry %u:%u", entry.end_block, entry.end_offset);
+			return -1;
+		}
+	} else {
+		// Allocate enough space for child at end of entry
+		if(entry_alloc(d, entry, sizeof(struct entry), false) != sizeof(struct entry)) {
+			return -1;
+		}
+
+		if(dir_read(d, entry, &parent, sizeof(struct entry)) != sizeof(struct entry)) {
+			return -1;
+		}
+
+		// Child is the last entry
+		addr = (address) {parent.start_block, ENTRY_FIRST_CHUNK_SIZE(sb, parent)};
+		if(dir_write(d, addr, child, sizeof(struct entry)) != sizeof(struct entry)) {
+			return -1;
+		}
+	}
+
+	// Get child address when needed
+	if(child_addr) {
+		*child_addr = addr;
+	}
+
+	syslog(LOG_DEBUG, "linked '%s' in entry %u:%u at %u:%u", child->name, entry.end_block, entry.end_offset, addr.end_block, addr.end_offset);
+	return 0;
 }
 
+int entry_unlink(disk d, address entry, address child, uint32_t slot)
+{
+	syslog(LOG_DEBUG, "unlinking %u:%u from entry %u:%u", child.end_block, child.end_offset, entry.end_block, entry.end_offset);
+
+	const struct superblock *sb = disk_superblock(d);
+
+	struct entry parent;
+	if(dir_read(d, entry, &parent, sizeof(struct entry)) != sizeof(struct entry)) {
+		return -1;
+	}
+
+	// Amount of tombstones in directory
+	uint32_t tombstones = 0;
+	if(parent.free_slot != 0) {
+		struct entry first;
+		const address addr = slot_address(d, &parent, parent.free_slot - 1);
+		if(!DIR_ADDRESS_VALID(sb, addr) || dir_read(d, addr, &first, sizeof(struct entry)) != sizeof(struct entry)) {
+			return -1;
+		}
+
+		tombstones = first.size;
+	}
+
+	if(slot + 1 == parent.size / sizeof(struct entry)) {
+		// Last entry is simply dropped
+		if(entry_free(d, entry, sizeof(struct entry)) != sizeof(struct entry)) {
+			return -1;
+		}
+
+		parent.size -= sizeof(struct entry);
+	} else {
+		// Replace entry with a tombstone at front of free slots
+		struct entry tombstone = {
+			.size = tombstones + 1,
+			.free_slot = parent.free_slot,
+		};
+
+		if(dir_write(d, child, &tombstone, sizeof(struct entry)) != sizeof(struct entry)) {
+			return -1;
+		}
+
+		time_t t = time(NULL);
+		parent.access_time = t;
+		parent.modify_time = t;
+		parent.free_slot = slot + 1;
+		if(dir_write(d, entry, &parent, sizeof(struct entry)) != sizeof(struct entry)) {
+			syslog(LOG_CRIT, "failed to update entry %u:%u", entry.end_block, entry.end_offset);
+			return -1;
+		}
+
+		++tombstones;
+	}
+
+	// Compact once tombstones take more than half of directory
+	if(tombstones * 2 * sizeof(struct entry) > parent.size && entry_compact(d, entry) != 0) {
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "unlinked %u:%u from entry %u:%u", child.end_block, child.end_offset, entry.end_block, entry.end_offset);
+	return 0;
+}
 
 uint32_t entry_access(disk d, address entry, uint32_t offset, void *readdata, const void *writedata, uint32_t size)
 {
@@ -194,28 +546,77 @@ uint32_t entry_access(disk d, address entry, uint32_t offset, void *readdata, co
 		return 0;
 	}
 
-	const uint32_t end = offset + size;
-	const uint32_t end_offset = end < ent.size ? ent.size - end : 0;
-	address addr = {ent.start_block, ENTRY_FIRST_CHUNK_SIZE(sb, ent)};
-	addr = dir_seek(d, addr, end_offset);
-	if(!DIR_ADDRESS_VALID(sb, addr)) {
-		return 0;
-	}
+	uint32_t accessed;
+	if(ENTRY_INLINE(ent)) {
+		// Inline data is accessed without walking any block list
+		size = size < ent.size - offset ? size : ent.size - offset;
+		accessed = small_access(d, ent.start_block, ent.inline_cell - 1, offset, readdata, writedata, size);
+	} else if(ENTRY_EXTENTS(sb, ent)) {
+		// Offset is found in extent map without walking any block list
+		struct extent_map map;
+		if(extent_load(d, ent.start_block, &map) != 0) {
+			return 0;
+		}
 
-	// Update size since end offset may be cut short
-	size = (ent.size - end_offset) - offset;
+		size = size < ent.size - offset ? size : ent.size - offset;
 
-	// Perform directory access
-	uint32_t accessed = dir_access(d, addr, readdata, writedata, size);
+		block head = ent.start_block;
+		if(writedata && !readdata && DEDUP_INDEXED(sb)) {
+			// Whole blocks already on disk are shared instead of written
+			accessed = dedup_access(d, &head, &map, offset, writedata, size);
+		} else {
+			// Shared blocks get blocks of their own before they are written
+			// Blocks cannot gain references while they are written in place
+			accessed = 0;
+			dedup_write_begin(d);
+			if(!writedata || extent_unshare(d, &head, &map, offset, size) == 0) {
+				// File data bypasses journal
+				journal_data_begin();
+				accessed = extent_access(d, &map, offset, readdata, writedata, size);
+				journal_data_end();
+			}
 
-	// Update access and modify times
-	time_t t = time(NULL);
-	ent.access_time = t;
-	ent.modify_time = writedata ? t : ent.modify_time;
-	if(dir_write(d, entry, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
-		// Entry has been read/written but entry has not been updated
-		syslog(LOG_CRIT, "failed to update entry %u:%u", entry.end_block, entry.end_offset);
-		return 0;
+			dedup_write_end(d);
+		}
+
+		ent.start_block = head;
+
+		extent_destroy(&map);
+	} else {
+		const uint32_t end = offset + size;
+		const uint32_t end_offset = end < ent.size ? ent.size - end : 0;
+		address addr = {ent.start_block, ENTRY_FIRST_CHUNK_SIZE(sb, ent)};
+		addr = dir_seek(d, addr, end_offset);
+		if(!DIR_ADDRESS_VALID(sb, addr)) {
+			return 0;
+		}
+
+		// Update size since end offset may be cut short
+		size = (ent.size - end_offset) - offset;
+
+		// Perform directory access
+		// File data bypasses journal
+		if(S_ISREG(ent.mode)) {
+			journal_data_begin();
+		}
+
+		accessed = dir_access(d, addr, readdata, writedata, size);
+
+		if(S_ISREG(ent.mode)) {
+			journal_data_end();
+		}
+	}
+
+	// Update access and modify times unless disk is never written
+	if(!disk_readonly(d)) {
+		time_t t = time(NULL);
+		ent.access_time = t;
+		ent.modify_time = writedata ? t : ent.modify_time;
+		if(dir_write(d, entry, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
+			// Entry has been read/written but entry has not been updated
+			syslog(LOG_CRIT, "failed to update entry %u:%u", entry.end_block, entry.end_offset);
+			return 0;
+		}
 	}
 
 	syslog(LOG_DEBUG, "%s%s%s %u bytes from entry %u:%u at %u",
@@ -229,3 +630,236 @@ uint32_t entry_access(disk d, address entry, uint32_t offset, void *readdata, co
 
 	return accessed;
 }
+
+uint32_t inline_alloc(disk d, address entry, struct entry *ent, uint32_t size, bool zero)
+{
+	const struct superblock *sb = disk_superblock(d);
+	const uint32_t old_size = ent->size;
+
+	if(old_size + size > sb->inline_size) {
+		// Move inline data to blocks once it no longer fits
+		char *data = malloc(old_size);
+		if(small_access(d, ent->start_block, ent->inline_cell - 1, 0, data, NULL, old_size) != old_size) {
+			free(data);
+			return 0;
+		}
+
+		// Entry points at blocks only once they hold the data so failures leave inline file untouched
+		struct entry moved = *ent;
+		moved.size = old_size + size;
+		moved.start_block = BLOCK_LAST;
+		moved.inline_cell = 0;
+		const int err = inline_move(d, &moved, data, old_size, zero);
+		free(data);
+		if(err != 0) {
+			return 0;
+		}
+
+		time_t t = time(NULL);
+		moved.access_time = t;
+		moved.modify_time = t;
+		if(dir_write(d, entry, &moved, sizeof(struct entry)) != sizeof(struct entry)) {
+			if(ENTRY_EXTENTS(sb, moved) ? extent_release(d, moved.start_block) != 0 : block_free_many(d, moved.start_block, UINT32_MAX) == BLOCK_INVALID) {
+				syslog(LOG_CRIT, "failed to release blocks of entry %u:%u", entry.end_block, entry.end_offset);
+			}
+
+			return 0;
+		}
+
+		// Cell is no longer reachable once entry points at blocks
+		if(small_free(d, ent->start_block, ent->inline_cell - 1) != 0) {
+			syslog(LOG_ERR, "failed to free inline cell of entry %u:%u", entry.end_block, entry.end_offset);
+		}
+
+		*ent = moved;
+		syslog(LOG_DEBUG, "moved %u inline bytes of entry %u:%u to blocks", old_size, entry.end_block, entry.end_offset);
+		return size;
+	}
+
+	if(!ENTRY_INLINE(*ent)) {
+		// Cells are zeroed when allocated
+		block small;
+		uint32_t cell;
+		if(small_alloc(d, &small, &cell) != 0) {
+			return 0;
+		}
+
+		ent->start_block = small;
+		ent->inline_cell = cell + 1;
+	} else if(zero) {
+		// Shrinking leaves old data past inline file end
+		void *zeros = calloc(1, size);
+		const uint32_t zeroed = small_access(d, ent->start_block, ent->inline_cell - 1, old_size, NULL, zeros, size);
+		free(zeros);
+
+		if(zeroed != size) {
+			return 0;
+		}
+	}
+
+	// Update size and access and modify times
+	time_t t = time(NULL);
+	ent->access_time = t;
+	ent->modify_time = t;
+	ent->size += size;
+	if(dir_write(d, entry, ent, sizeof(struct entry)) != sizeof(struct entry)) {
+		syslog(LOG_CRIT, "failed to update entry %u:%u", entry.end_block, entry.end_offset);
+		return 0;
+	}
+
+	syslog(LOG_DEBUG, "allocated %u inline bytes for entry %u:%u", size, entry.end_block, entry.end_offset);
+	return size;
+}
+
+int inline_move(disk d, struct entry *ent, const void *data, uint32_t size, bool zero)
+{
+	const struct superblock *sb = disk_superblock(d);
+	const uint32_t count = (ent->size + sb->block_size - 1) / sb->block_size;
+	const int flags = (zero ? BLOCK_ALLOC_ZERO : 0) | (ent->size >= ENTRY_RESERVE_SIZE ? BLOCK_ALLOC_RESERVE : 0);
+
+	if(ENTRY_EXTENTS(sb, *ent)) {
+		struct extent_map map;
+		if(extent_load(d, BLOCK_LAST, &map) != 0) {
+			return -1;
+		}
+
+		if(extent_grow(d, &map, count, flags) != 0) {
+			extent_destroy(&map);
+			return -1;
+		}
+
+		// File data bypasses journal
+		journal_data_begin();
+		const uint32_t written = extent_access(d, &map, 0, NULL, data, size);
+		journal_data_end();
+
+		block head = BLOCK_LAST;
+		if(written != size || extent_store(d, &head, &map) != 0) {
+			extent_shrink(d, &map, 0);
+			extent_destroy(&map);
+			return -1;
+		}
+
+		extent_destroy(&map);
+		ent->start_block = head;
+		return 0;
+	}
+
+	const block head = block_alloc_many(d, BLOCK_LAST, count, flags);
+	if(!BLOCK_VALID(head)) {
+		return -1;
+	}
+
+	// Data ends ent->size - size bytes before end of list
+	address addr = {head, ENTRY_FIRST_CHUNK_SIZE(sb, (*ent))};
+	addr = dir_seek(d, addr, ent->size - size);
+
+	// File data bypasses journal
+	journal_data_begin();
+	const uint32_t written = DIR_ADDRESS_VALID(sb, addr) ? dir_access(d, addr, NULL, data, size) : 0;
+	journal_data_end();
+
+	if(written != size) {
+		block_free_many(d, head, UINT32_MAX);
+		return -1;
+	}
+
+	ent->start_block = head;
+	return 0;
+}
+
+uint32_t mapped_alloc(disk d, address entry, struct entry *ent, uint32_t size, bool zero)
+{
+	const struct superblock *sb = disk_superblock(d);
+
+	// Entry size cannot grow past what it can represent
+	if((uint64_t) ent->size + size > UINT32_MAX) {
+		syslog(LOG_ERR, "cannot allocate %u bytes for entry of %u bytes", size, ent->size);
+		return 0;
+	}
+
+	struct extent_map map;
+	if(extent_load(d, ent->start_block, &map) != 0) {
+		return 0;
+	}
+
+	// Zero unallocated part of last block that becomes allocated
+	// Last block gets a block of its own first when it is shared
+	block head = ent->start_block;
+	const uint32_t last_chunk_size = ent->size % sb->block_size;
+	if(zero && last_chunk_size > 0 && size > 0) {
+		const uint32_t zero_size = size < sb->block_size - last_chunk_size ? size : sb->block_size - last_chunk_size;
+		dedup_write_begin(d);
+		if(extent_unshare(d, &head, &map, ent->size, zero_size) != 0) {
+			dedup_write_end(d);
+			extent_destroy(&map);
+			return 0;
+		}
+
+		void *zeros = calloc(1, zero_size);
+
+		// File data bypasses journal
+		journal_data_begin();
+		const uint32_t zeroed = extent_access(d, &map, ent->size, NULL, zeros, zero_size);
+		journal_data_end();
+		dedup_write_end(d);
+
+		free(zeros);
+
+		if(zeroed != zero_size) {
+			extent_destroy(&map);
+			return 0;
+		}
+	}
+
+	// Allocate every missing block at once so they are contiguous when possible
+	const uint32_t needed = ((uint64_t) ent->size + size + sb->block_size - 1) / sb->block_size;
+	const uint32_t count = needed > extent_count(&map) ? needed - extent_count(&map) : 0;
+	const int flags = (zero ? BLOCK_ALLOC_ZERO : 0) | (size >= ENTRY_RESERVE_SIZE ? BLOCK_ALLOC_RESERVE : 0);
+	if(extent_grow(d, &map, count, flags) != 0 || extent_store(d, &head, &map) != 0) {
+		extent_destroy(&map);
+		return 0;
+	}
+
+	ent->start_block = head;
+
+	extent_destroy(&map);
+
+	// Update size and access and modify times
+	time_t t = time(NULL);
+	ent->access_time = t;
+	ent->modify_time = t;
+	ent->size += size;
+	if(dir_write(d, entry, ent, sizeof(struct entry)) != sizeof(struct entry)) {
+		syslog(LOG_CRIT, "failed to update entry %u:%u", entry.end_block, entry.end_offset);
+		return 0;
+	}
+
+	syslog(LOG_DEBUG, "allocated %u mapped bytes for entry %u:%u", size, entry.end_block, entry.end_offset);
+	return size;
+}
+
+uint32_t name_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	while(*name) {
+		hash ^= (uint8_t) *name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+address slot_address(disk d, const struct entry *parent, uint32_t slot)
+{
+	const struct superblock *sb = disk_superblock(d);
+
+	const uint32_t count = parent->size / sizeof(struct entry);
+	if(slot >= count) {
+		syslog(LOG_ERR, "slot %u out of %u slots", slot, count);
+		return DIR_ADDRESS_INVALID;
+	}
+
+	address addr = {parent->start_block, ENTRY_FIRST_CHUNK_SIZE(sb, (*parent))};
+	return dir_seek(d, addr, (count - 1 - slot) * sizeof(struct entry));
+}
@@ -2,13 +2,35 @@
 #define ENTRY_H
 
 #include "dir.h"
+#include <sys/stat.h>
 
-// Maximum entry name length
+// Maximum entry name length stored in entry itself
 #define ENTRY_NAME_LENGTH 23
 
+// Maximum entry name length stored in a small block cell
+#define ENTRY_LONG_NAME_LENGTH 255
+
+// Maximum entry name length supported by disk
+#define ENTRY_NAME_MAX(sb) (sb->inline_size <= ENTRY_NAME_LENGTH ? ENTRY_NAME_LENGTH : sb->inline_size < ENTRY_LONG_NAME_LENGTH ? sb->inline_size : ENTRY_LONG_NAME_LENGTH)
+
+// Minimum allocation size in bytes worth reserving host storage for
+#define ENTRY_RESERVE_SIZE (1 << 20)
+
 // Calculate allocated size of first block
 #define ENTRY_FIRST_CHUNK_SIZE(sb, ent) (ent.size == 0 ? 0 : ((ent.size - 1) % sb->block_size + 1))
 
+// Test whether file data is stored in a small block cell
+#define ENTRY_INLINE(ent) (S_ISREG((ent).mode) && (ent).inline_cell != 0)
+
+// Test whether file data is mapped by extents stored in block list start block
+#define ENTRY_EXTENTS(sb, ent) (((sb)->features & DISK_FEATURE_EXTENTS) && S_ISREG((ent).mode) && (ent).inline_cell == 0)
+
+// Test whether entry name is stored in a small block cell
+#define ENTRY_LONG_NAME(ent) ((ent).name[0] == '\0' && (ent).long_name.length > ENTRY_NAME_LENGTH)
+
+// Test whether directory slot is an unlinked entry
+#define ENTRY_TOMBSTONE(ent) ((ent).mode == 0)
+
 // Perform only entry read access
 #define entry_read(d, entry, offset, data, size) entry_access(d, entry, offset, data, NULL, size)
 
@@ -17,29 +39,83 @@
 
 // A directory entry
 // Time fields are in seconds
+// Unlinked slots are tombstones linked into a free slot list of their directory
+// Tombstone size is the amount of tombstones in the list starting at it
+// Inline files have their data in a cell of small block start block
+// Files of disks with extents have an extent map in block list start block
+// Long names start with a null character and are stored in a small block cell
 struct __attribute__((__packed__)) entry {
-    char name[ENTRY_NAME_LENGTH + 1];
+    union {
+        char name[ENTRY_NAME_LENGTH + 1];
+        struct __attribute__((__packed__)) {
+            char marker; // Null character
+            uint8_t length; // Name length in bytes
+            uint32_t hash; // Name hash to reject other names without reading them
+            uint32_t small_block; // Small block holding name
+            uint32_t cell; // Cell holding name
+        } long_name;
+    };
     uint64_t create_time;
     uint64_t modify_time;
     uint64_t access_time;
     uint32_t size; // Size of directory in bytes
     uint32_t start_block; // First block in directory
     uint32_t mode; // mode_t bitset
-    uint32_t unused; // Force entry structure size to be 64 bytes
+    union {
+        uint32_t free_slot; // First free slot in directory plus one, zero when there is none
+        uint32_t inline_cell; // Cell of inline file data plus one, zero when data is in blocks
+    };
 };
 
 // Allocate size bytes past end of entry
+// Files small enough are stored inline and move to blocks once they grow too large
+// Allocated bytes are zeroed when zero is set
 // Returns amount of bytes allocated
-uint32_t entry_alloc(disk d, address entry, uint32_t size);
+uint32_t entry_alloc(disk d, address entry, uint32_t size, bool zero);
+
+// Compact entry directory by removing all tombstones
+// Child entries keep their order but move to new addresses
+// Returns non-zero on failure
+int entry_compact(disk d, address entry);
 
 // Find address of child entry in entry directory
+// Slot is set to index of child entry in directory when not NULL
 // Returns invalid address on failure
-address entry_find(disk d, address entry, const char *name);
+address entry_find(disk d, address entry, const char *name, uint32_t *slot);
 
 // Allocate size bytes before end of entry
 // Returns amount of bytes freed
 uint32_t entry_free(disk d, address entry, uint32_t size);
 
+// Free all data and long name of an entry that is no longer linked
+// Returns non-zero on failure
+int entry_release(disk d, const struct entry *ent);
+
+// Free long name of an entry
+// Does nothing when name is stored in entry itself
+// Returns non-zero on failure
+int entry_release_name(disk d, const struct entry *ent);
+
+// Set name of entry storing long names in a small block cell
+// Previous long name of entry must be released separately
+// Returns non-zero on failure
+int entry_rename(disk d, struct entry *ent, const char *name);
+
+// Get name of entry
+// Name must be able to hold ENTRY_LONG_NAME_LENGTH + 1 bytes
+// Returns non-zero on failure
+int entry_name(disk d, const struct entry *ent, char *name);
+
+// Add child entry to entry directory reusing a free slot when there is one
+// Child address can be NULL if it is not needed
+// Returns non-zero on failure
+int entry_link(disk d, address entry, const struct entry *child, address *child_addr);
+
+// Remove child entry at child address and slot from entry directory
+// Child contents are not freed
+// Returns non-zero on failure
+int entry_unlink(disk d, address entry, address child, uint32_t slot);
+
 // Access at most size bytes of data to offset
 // Stops accessing at entry end
 // Returns amount of bytes accessed
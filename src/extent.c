@@ -0,0 +1,500 @@
+#include "extent.h"
+#include "dedup.h"
+#include "journal.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+// Append a run of blocks to map merging it into last extent when they are consecutive
+void extent_append(struct extent_map *map, block physical, uint32_t length);
+
+// Read blocks of block list starting at head in list order
+// Returns non-zero on failure
+int extent_list(disk d, block head, block **blocks, uint32_t *count);
+
+uint32_t extent_access(disk d, const struct extent_map *map, uint32_t offset, void *readdata, const void *writedata, uint32_t size)
+{
+	syslog(LOG_DEBUG, "%s%s%s %u mapped bytes at %u",
+			readdata ? "reading" : "",
+			readdata && writedata ? "/" : "",
+			writedata ? "writing" : "",
+			size,
+			offset
+			);
+
+	const struct superblock *sb = disk_superblock(d);
+	void *buffer = NULL; // Only partial block writes need a whole block
+	uint32_t accessed = 0;
+
+	while(accessed < size) {
+		const uint32_t logical = (offset + accessed) / sb->block_size;
+		const uint32_t position = (offset + accessed) % sb->block_size;
+
+		const struct extent *e = extent_find(map, logical);
+		if(!e) {
+			syslog(LOG_ERR, "file block %u is not mapped", logical);
+			break;
+		}
+
+		const block physical = e->physical + (logical - e->logical);
+		uint32_t amount;
+
+		if(position == 0 && size - accessed >= sb->block_size) {
+			// Whole blocks of a run are accessed at once
+			const uint32_t run = e->logical + e->length - logical;
+			const uint32_t count = (size - accessed) / sb->block_size < run ? (size - accessed) / sb->block_size : run;
+			amount = count * sb->block_size;
+
+			if(readdata && block_read_many(d, physical, count, (uint8_t *) readdata + accessed) != 0) {
+				break;
+			}
+
+			if(writedata && block_write_many(d, physical, count, (const uint8_t *) writedata + accessed) != 0) {
+				break;
+			}
+		} else {
+			amount = sb->block_size - position < size - accessed ? sb->block_size - position : size - accessed;
+
+			if(!writedata) {
+				if(block_read_range(d, physical, position, amount, (uint8_t *) readdata + accessed) != 0) {
+					break;
+				}
+			} else {
+				if(!buffer) {
+					buffer = pool_get(sb->block_size);
+				}
+
+				if(block_read(d, physical, buffer) != 0) {
+					break;
+				}
+
+				if(readdata) {
+					memcpy((uint8_t *) readdata + accessed, (uint8_t *) buffer + position, amount);
+				}
+
+				memcpy((uint8_t *) buffer + position, (const uint8_t *) writedata + accessed, amount);
+				if(block_write(d, physical, buffer) != 0) {
+					break;
+				}
+			}
+		}
+
+		accessed += amount;
+	}
+
+	pool_put(buffer, sb->block_size);
+	syslog(LOG_DEBUG, "%s%s%s %u mapped bytes at %u",
+			readdata ? "read" : "",
+			readdata && writedata ? "/" : "",
+			writedata ? "wrote" : "",
+			accessed,
+			offset
+			);
+
+	return accessed;
+}
+
+uint32_t extent_count(const struct extent_map *map)
+{
+	if(map->count == 0) {
+		return 0;
+	}
+
+	const struct extent *last = &map->extents[map->count - 1];
+	return last->logical + last->length;
+}
+
+void extent_destroy(struct extent_map *map)
+{
+	free(map->extents);
+	map->extents = NULL;
+	map->count = 0;
+	map->capacity = 0;
+}
+
+const struct extent *extent_find(const struct extent_map *map, uint32_t logical)
+{
+	uint32_t low = 0;
+	uint32_t high = map->count;
+
+	while(low < high) {
+		const uint32_t middle = low + (high - low) / 2;
+		const struct extent *e = &map->extents[middle];
+
+		if(logical < e->logical) {
+			high = middle;
+		} else if(logical >= e->logical + e->length) {
+			low = middle + 1;
+		} else {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+int extent_grow(disk d, struct extent_map *map, uint32_t count, int flags)
+{
+	syslog(LOG_DEBUG, "growing extent map by %u blocks", count);
+
+	// Nothing to allocate
+	if(count == 0) {
+		return 0;
+	}
+
+	block *blocks = malloc((size_t) count * sizeof(block));
+	if(block_alloc_extent(d, count, flags, blocks) != 0) {
+		free(blocks);
+		return -1;
+	}
+
+	// Allocated blocks are ascending so runs of them become single extents
+	uint32_t run = 0;
+	for(uint32_t k = 1; k <= count; ++k) {
+		if(k == count || blocks[k] != blocks[k - 1] + 1) {
+			extent_append(map, blocks[run], k - run);
+			run = k;
+		}
+	}
+
+	free(blocks);
+	syslog(LOG_DEBUG, "grew extent map to %u extents", map->count);
+	return 0;
+}
+
+int extent_load(disk d, block head, struct extent_map *map)
+{
+	const struct superblock *sb = disk_superblock(d);
+	const uint32_t per_block = EXTENT_BLOCK_COUNT(sb);
+	memset(map, 0, sizeof(struct extent_map));
+
+	block *blocks;
+	uint32_t count;
+	if(extent_list(d, head, &blocks, &count) != 0) {
+		return -1;
+	}
+
+	uint8_t *buffer = pool_get(sb->block_size);
+	for(uint32_t i = 0; i < count; ++i) {
+		if(block_read(d, blocks[i], buffer) != 0) {
+			pool_put(buffer, sb->block_size);
+			free(blocks);
+			extent_destroy(map);
+			return -1;
+		}
+
+		uint32_t extent_count;
+		memcpy(&extent_count, buffer, sizeof(uint32_t));
+		if(extent_count > per_block) {
+			syslog(LOG_ERR, "invalid extent map block %u", blocks[i]);
+			pool_put(buffer, sb->block_size);
+			free(blocks);
+			extent_destroy(map);
+			return -1;
+		}
+
+		if(map->count + extent_count > map->capacity) {
+			map->capacity = map->count + extent_count;
+			map->extents = realloc(map->extents, map->capacity * sizeof(struct extent));
+		}
+
+		memcpy(map->extents + map->count, buffer + sizeof(uint32_t), extent_count * sizeof(struct extent));
+		map->count += extent_count;
+	}
+
+	pool_put(buffer, sb->block_size);
+	free(blocks);
+	return 0;
+}
+
+int extent_release(disk d, block head)
+{
+	syslog(LOG_DEBUG, "releasing extent map %u", head);
+
+	// Empty files have no map
+	if(!BLOCK_VALID(head)) {
+		return 0;
+	}
+
+	struct extent_map map;
+	if(extent_load(d, head, &map) != 0) {
+		return -1;
+	}
+
+	int err = 0;
+	for(uint32_t i = 0; i < map.count && err == 0; ++i) {
+		err = block_free_extent(d, map.extents[i].physical, map.extents[i].length);
+	}
+
+	extent_destroy(&map);
+
+	if(err != 0 || block_free_many(d, head, UINT32_MAX) == BLOCK_INVALID) {
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "released extent map %u", head);
+	return 0;
+}
+
+void extent_remap(struct extent_map *map, uint32_t logical, block physical)
+{
+	const uint32_t index = extent_find(map, logical) - map->extents;
+	const struct extent old = map->extents[index];
+
+	// Extent is split into the part before file block, file block, and the part after it
+	struct extent parts[3];
+	uint32_t part_count = 0;
+	if(logical > old.logical) {
+		parts[part_count++] = (struct extent) {old.logical, old.physical, logical - old.logical};
+	}
+
+	const uint32_t middle = index + part_count;
+	parts[part_count++] = (struct extent) {logical, physical, 1};
+	if(logical + 1 < old.logical + old.length) {
+		parts[part_count++] = (struct extent) {logical + 1, old.physical + (logical - old.logical) + 1, old.logical + old.length - logical - 1};
+	}
+
+	if(map->count + part_count - 1 > map->capacity) {
+		map->capacity = map->count + part_count - 1 > map->capacity * 2 ? map->count + part_count - 1 : map->capacity * 2;
+		map->extents = realloc(map->extents, map->capacity * sizeof(struct extent));
+	}
+
+	memmove(map->extents + index + part_count, map->extents + index + 1, (map->count - index - 1) * sizeof(struct extent));
+	memcpy(map->extents + index, parts, part_count * sizeof(struct extent));
+	map->count += part_count - 1;
+
+	// Remapped block may continue the extent before it or be continued by the one after it
+	if(middle + 1 < map->count && physical + 1 == map->extents[middle + 1].physical) {
+		map->extents[middle].length += map->extents[middle + 1].length;
+		memmove(map->extents + middle + 1, map->extents + middle + 2, (map->count - middle - 2) * sizeof(struct extent));
+		--map->count;
+	}
+
+	if(middle > 0 && map->extents[middle - 1].physical + map->extents[middle - 1].length == physical) {
+		map->extents[middle - 1].length += map->extents[middle].length;
+		memmove(map->extents + middle, map->extents + middle + 1, (map->count - middle - 1) * sizeof(struct extent));
+		--map->count;
+	}
+}
+
+int extent_shrink(disk d, struct extent_map *map, uint32_t count)
+{
+	syslog(LOG_DEBUG, "shrinking extent map to %u blocks", count);
+
+	// Free runs from end of file
+	while(map->count > 0) {
+		struct extent *last = &map->extents[map->count - 1];
+		if(last->logical + last->length <= count) {
+			break;
+		}
+
+		const uint32_t keep = last->logical < count ? count - last->logical : 0;
+		if(block_free_extent(d, last->physical + keep, last->length - keep) != 0) {
+			return -1;
+		}
+
+		last->length = keep;
+		if(keep == 0) {
+			--map->count;
+		}
+	}
+
+	syslog(LOG_DEBUG, "shrank extent map to %u extents", map->count);
+	return 0;
+}
+
+int extent_store(disk d, block *head, const struct extent_map *map)
+{
+	const struct superblock *sb = disk_superblock(d);
+	const uint32_t per_block = EXTENT_BLOCK_COUNT(sb);
+	const uint32_t needed = (map->count + per_block - 1) / per_block;
+
+	block *blocks;
+	uint32_t count;
+	if(extent_list(d, *head, &blocks, &count) != 0) {
+		return -1;
+	}
+
+	// Map is moved to a new list when it changes size
+	// Old list is freed once the operation commits so a crash keeps the old map
+	if(count != needed) {
+		free(blocks);
+
+		if(BLOCK_VALID(*head) && block_free_many(d, *head, UINT32_MAX) == BLOCK_INVALID) {
+			return -1;
+		}
+
+		*head = BLOCK_LAST;
+		if(needed > 0) {
+			*head = block_alloc_many(d, BLOCK_LAST, needed, 0);
+			if(!BLOCK_VALID(*head)) {
+				*head = BLOCK_LAST;
+				return -1;
+			}
+		}
+
+		if(extent_list(d, *head, &blocks, &count) != 0) {
+			return -1;
+		}
+	}
+
+	uint8_t *buffer = pool_get(sb->block_size);
+	for(uint32_t i = 0; i < count; ++i) {
+		const uint32_t first = i * per_block;
+		const uint32_t extent_count = map->count - first < per_block ? map->count - first : per_block;
+
+		memset(buffer, 0, sb->block_size);
+		memcpy(buffer, &extent_count, sizeof(uint32_t));
+		memcpy(buffer + sizeof(uint32_t), map->extents + first, extent_count * sizeof(struct extent));
+
+		if(block_write(d, blocks[i], buffer) != 0) {
+			pool_put(buffer, sb->block_size);
+			free(blocks);
+			return -1;
+		}
+	}
+
+	pool_put(buffer, sb->block_size);
+	free(blocks);
+	return 0;
+}
+
+int extent_unshare(disk d, block *head, struct extent_map *map, uint32_t offset, uint32_t size)
+{
+	const struct superblock *sb = disk_superblock(d);
+
+	// Nothing is shared until a deduplication pass enables sharing
+	if(!(sb->features & DISK_FEATURE_DEDUP) || size == 0) {
+		return 0;
+	}
+
+	syslog(LOG_DEBUG, "unsharing %u mapped bytes at %u", size, offset);
+
+	const uint64_t end = (uint64_t) offset + size;
+	const uint32_t last = (end - 1) / sb->block_size;
+	block *shared = NULL;
+	block *copies = NULL;
+	uint32_t count = 0;
+	void *buffer = NULL; // Only partly written blocks need their data copied
+	int err = 0;
+
+	for(uint32_t logical = offset / sb->block_size; logical <= last; ++logical) {
+		// Unmapped file blocks are left for the access to report
+		const struct extent *e = extent_find(map, logical);
+		if(!e) {
+			break;
+		}
+
+		const block physical = e->physical + (logical - e->logical);
+		const uint32_t refs = dedup_refs(d, physical);
+		if(refs == 0) {
+			err = -1;
+			break;
+		}
+
+		if(refs == 1) {
+			continue;
+		}
+
+		block copy;
+		if(block_alloc_extent(d, 1, 0, &copy) != 0) {
+			err = -1;
+			break;
+		}
+
+		shared = realloc(shared, (count + 1) * sizeof(block));
+		copies = realloc(copies, (count + 1) * sizeof(block));
+		shared[count] = physical;
+		copies[count++] = copy;
+
+		// File data bypasses journal
+		const uint64_t start = (uint64_t) logical * sb->block_size;
+		if(start < offset || start + sb->block_size > end) {
+			if(!buffer) {
+				buffer = pool_get(sb->block_size);
+			}
+
+			journal_data_begin();
+			err = block_read(d, physical, buffer) != 0 || block_write(d, copy, buffer) != 0;
+			journal_data_end();
+
+			if(err) {
+				break;
+			}
+		}
+
+		extent_remap(map, logical, copy);
+	}
+
+	pool_put(buffer, sb->block_size);
+
+	// Map uses its copies before shared blocks lose a reference
+	if(!err && count > 0) {
+		err = extent_store(d, head, map) != 0;
+	}
+
+	// Copies are given back when map could not use them
+	const bool failed = err;
+	for(uint32_t k = 0; k < count; ++k) {
+		if(block_free_extent(d, failed ? copies[k] : shared[k], 1) != 0) {
+			err = -1;
+		}
+	}
+
+	free(shared);
+	free(copies);
+	if(err) {
+		syslog(LOG_ERR, "failed to unshare %u mapped bytes at %u", size, offset);
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "unshared %u blocks", count);
+	return 0;
+}
+
+void extent_append(struct extent_map *map, block physical, uint32_t length)
+{
+	const uint32_t logical = extent_count(map);
+
+	if(map->count > 0) {
+		struct extent *last = &map->extents[map->count - 1];
+		if(last->physical + last->length == physical) {
+			last->length += length;
+			return;
+		}
+	}
+
+	if(map->count == map->capacity) {
+		map->capacity = map->capacity ? map->capacity * 2 : 8;
+		map->extents = realloc(map->extents, map->capacity * sizeof(struct extent));
+	}
+
+	map->extents[map->count++] = (struct extent) {logical, physical, length};
+}
+
+int extent_list(disk d, block head, block **blocks, uint32_t *count)
+{
+	const struct superblock *sb = disk_superblock(d);
+	uint32_t capacity = 4;
+	*blocks = malloc(capacity * sizeof(block));
+	*count = 0;
+
+	for(block current = head; current != BLOCK_LAST; current = block_next(d, current)) {
+		// Lists can never be longer than the disk
+		if(!BLOCK_VALID(current) || *count == sb->block_count) {
+			syslog(LOG_ERR, "invalid extent map at %u", head);
+			free(*blocks);
+			return -1;
+		}
+
+		if(*count == capacity) {
+			capacity *= 2;
+			*blocks = realloc(*blocks, capacity * sizeof(block));
+		}
+
+		(*blocks)[(*count)++] = current;
+	}
+
+	return 0;
+}
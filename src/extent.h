@@ -0,0 +1,72 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include "block.h"
+
+// Amount of extents held by a block of an extent map
+#define EXTENT_BLOCK_COUNT(sb)	((sb->block_size - sizeof(uint32_t)) / sizeof(struct extent))
+
+// A run of consecutive file blocks stored in consecutive disk blocks
+struct __attribute__((__packed__)) extent {
+    uint32_t logical; // First file block of run
+    uint32_t physical; // First disk block of run
+    uint32_t length; // Amount of blocks in run
+};
+
+// Extent map of a file in memory ordered by file block
+// On disk extent maps are block lists where each block starts with its amount of extents
+struct extent_map {
+	struct extent *extents;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+// Access at most size bytes of file data mapped by map at offset
+// Stops accessing at first file block not in map
+// Returns amount of bytes accessed
+uint32_t extent_access(disk d, const struct extent_map *map, uint32_t offset, void *readdata, const void *writedata, uint32_t size);
+
+// Count file blocks mapped by map
+uint32_t extent_count(const struct extent_map *map);
+
+// Release resources of extent map
+void extent_destroy(struct extent_map *map);
+
+// Find extent holding file block logical using binary search
+// Returns NULL when file block is not mapped
+const struct extent *extent_find(const struct extent_map *map, uint32_t logical);
+
+// Allocate count file blocks past end of map
+// Blocks are prepared using block allocation flags
+// Returns non-zero on failure
+int extent_grow(disk d, struct extent_map *map, uint32_t count, int flags);
+
+// Read extent map stored in block list starting at head
+// Returns non-zero on failure
+int extent_load(disk d, block head, struct extent_map *map);
+
+// Free extent map stored in block list starting at head and every block it maps
+// Returns non-zero on failure
+int extent_release(disk d, block head);
+
+// Map file block logical of map to disk block physical
+// Extent holding file block is split and neighbouring extents continuing each other are merged
+// File block must be mapped
+void extent_remap(struct extent_map *map, uint32_t logical, block physical);
+
+// Free file blocks of map past the first count blocks
+// Returns non-zero on failure
+int extent_shrink(disk d, struct extent_map *map, uint32_t count);
+
+// Write map to block list starting at head
+// Head is replaced when map needs a different amount of blocks
+// Returns non-zero on failure
+int extent_store(disk d, block *head, const struct extent_map *map);
+
+// Give file blocks of map holding size bytes at offset blocks of their own when other file blocks share them
+// Shared data is copied unless it is completely overwritten
+// Map is written to block list starting at head before shared blocks lose a reference
+// Returns non-zero on failure
+int extent_unshare(disk d, block *head, struct extent_map *map, uint32_t offset, uint32_t size);
+
+#endif
@@ -0,0 +1,748 @@
+#include "inode.h"
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+// Amount of buckets of each index of an empty inode table
+#define INODE_BUCKET_COUNT_MIN	1024
+
+// Offset part of spare inode numbers that no address has
+#define INODE_SPARE_OFFSET	UINT32_MAX
+
+// Hash an entry address
+uint32_t inode_address_hash(address addr);
+
+// Add inode to address and name indexes and to children of parent as name at address
+void inode_attach(struct inode_table *table, struct inode *inode, struct inode *parent, const char *name, address addr);
+
+// Find linked inode by entry address
+// Returns NULL when no inode is cached at address
+struct inode *inode_by_address(struct inode_table *table, address addr);
+
+// Find cached child of parent by name
+// Returns NULL when child is not cached
+struct inode *inode_by_name(struct inode_table *table, const struct inode *parent, const char *name);
+
+// Find inode by number loading root inode when needed
+// Returns NULL when inode is unknown
+struct inode *inode_by_number(disk disk, uint64_t number);
+
+// Count child directories of a directory inode
+// Returns non-zero on failure
+int inode_count(disk disk, struct inode *inode);
+
+// Unlink inode and its cached children freeing the ones nothing refers to anymore
+void inode_cut(struct inode_table *table, struct inode *inode);
+
+// Free inode when nothing refers to it and then its parent when that leaves parent unreferenced
+void inode_drop(struct inode_table *table, struct inode *inode);
+
+// Free an unlinked inode
+void inode_free(struct inode_table *table, struct inode *inode);
+
+// Grow indexes by rehashing every inode once they hold as many inodes as they have buckets
+void inode_grow(struct inode_table *table);
+
+// Read entry at address into a new inode that is child of parent named name
+// Returns NULL on failure
+struct inode *inode_load(disk disk, struct inode *parent, const char *name, address addr);
+
+// Hash a child name of parent using FNV-1a
+uint32_t inode_name_hash(const struct inode *parent, const char *name);
+
+// Hash an inode number
+uint32_t inode_number_hash(uint64_t number);
+
+// Remove inode from address and name indexes and from children of its parent
+void inode_unindex(struct inode_table *table, struct inode *inode);
+
+void inode_destroy(struct inode_table *table)
+{
+	// Every inode is in number index
+	for(uint32_t i = 0; i < table->bucket_count; ++i) {
+		while(table->numbers[i]) {
+			struct inode *inode = table->numbers[i];
+			table->numbers[i] = inode->next_number;
+			free(inode->name);
+			free(inode);
+		}
+	}
+
+	free(table->addresses);
+	free(table->names);
+	free(table->numbers);
+	pthread_mutex_destroy(&table->lock);
+}
+
+void inode_forget(disk disk, uint64_t number, uint64_t count)
+{
+	struct inode_table *table = disk_inode_table(disk);
+	pthread_mutex_lock(&table->lock);
+
+	struct inode *inode = inode_by_number(disk, number);
+	if(inode) {
+		inode->lookups -= count < inode->lookups ? count : inode->lookups;
+		inode_drop(table, inode);
+	}
+
+	pthread_mutex_unlock(&table->lock);
+}
+
+int inode_get(disk disk, uint64_t number, address *addr, struct entry *ent, uint32_t *subdirs)
+{
+	struct inode_table *table = disk_inode_table(disk);
+	pthread_mutex_lock(&table->lock);
+
+	struct inode *inode = inode_by_number(disk, number);
+	if(!inode || inode->unlinked) {
+		pthread_mutex_unlock(&table->lock);
+		return -1;
+	}
+
+	// Child directories are only counted once they are needed
+	if(subdirs && S_ISDIR(inode->ent.mode) && !inode->counted && inode_count(disk, inode) != 0) {
+		pthread_mutex_unlock(&table->lock);
+		return -1;
+	}
+
+	// Get results when needed
+	if(addr) {
+		*addr = inode->addr;
+	}
+
+	if(ent) {
+		*ent = inode->ent;
+	}
+
+	if(subdirs) {
+		*subdirs = inode->subdirs;
+	}
+
+	pthread_mutex_unlock(&table->lock);
+	return 0;
+}
+
+void inode_hide(disk disk, uint64_t number)
+{
+	struct inode_table *table = disk_inode_table(disk);
+	pthread_mutex_lock(&table->lock);
+
+	struct inode *inode = inode_by_number(disk, number);
+	if(inode) {
+		inode->hidden = true;
+	}
+
+	pthread_mutex_unlock(&table->lock);
+}
+
+void inode_init(struct inode_table *table)
+{
+	pthread_mutex_init(&table->lock, NULL);
+	table->root = NULL;
+	table->bucket_count = INODE_BUCKET_COUNT_MIN;
+	table->addresses = calloc(table->bucket_count, sizeof(struct inode *));
+	table->names = calloc(table->bucket_count, sizeof(struct inode *));
+	table->numbers = calloc(table->bucket_count, sizeof(struct inode *));
+	table->count = 0;
+	table->generation = 1;
+	table->spare = 0;
+}
+
+void inode_link(disk disk, uint64_t parent, uint32_t mode)
+{
+	struct inode_table *table = disk_inode_table(disk);
+	pthread_mutex_lock(&table->lock);
+
+	struct inode *inode = inode_by_number(disk, parent);
+	if(inode && !inode->unlinked) {
+		// Parent size and times changed
+		if(dir_read(disk, inode->addr, &inode->ent, sizeof(struct entry)) != sizeof(struct entry)) {
+			inode->counted = false;
+		} else if(S_ISDIR(mode) && inode->counted) {
+			++inode->subdirs;
+		}
+	}
+
+	pthread_mutex_unlock(&table->lock);
+}
+
+int inode_lookup(disk disk, uint64_t parent, const char *name, uint64_t *number, uint64_t *generation)
+{
+	syslog(LOG_DEBUG, "looking up '%s' in inode %lu", name, (unsigned long) parent);
+
+	const struct superblock *sb = disk_superblock(disk);
+	struct inode_table *table = disk_inode_table(disk);
+	pthread_mutex_lock(&table->lock);
+
+	struct inode *child = NULL;
+	while(!child) {
+		struct inode *inode = inode_by_number(disk, parent);
+
+		// Only linked directories have children
+		if(!inode || inode->unlinked || !S_ISDIR(inode->ent.mode)) {
+			pthread_mutex_unlock(&table->lock);
+			return -1;
+		}
+
+		child = inode_by_name(table, inode, name);
+		if(child) {
+			break;
+		}
+
+		// Directory is searched without table lock so other lookups are not held up by its reads
+		const address dir = inode->addr;
+		pthread_mutex_unlock(&table->lock);
+		const address addr = entry_find(disk, dir, name, NULL);
+		pthread_mutex_lock(&table->lock);
+
+		// Search is repeated when parent went away or moved meanwhile
+		inode = inode_by_number(disk, parent);
+		if(!inode || inode->unlinked || inode->addr.end_block != dir.end_block || inode->addr.end_offset != dir.end_offset) {
+			continue;
+		}
+
+		if(!DIR_ADDRESS_VALID(sb, addr)) {
+			pthread_mutex_unlock(&table->lock);
+			return -1;
+		}
+
+		// Child may have been cached by another lookup meanwhile
+		child = inode_by_name(table, inode, name);
+		if(!child) {
+			child = inode_load(disk, inode, name, addr);
+			if(!child) {
+				pthread_mutex_unlock(&table->lock);
+				return -1;
+			}
+		}
+	}
+
+	++child->lookups;
+	*number = child->number;
+	*generation = child->generation;
+
+	pthread_mutex_unlock(&table->lock);
+	syslog(LOG_DEBUG, "looked up '%s' in inode %lu as inode %lu", name, (unsigned long) parent, (unsigned long) *number);
+	return 0;
+}
+
+int inode_lookup_at(disk disk, uint64_t parent, const char *name, address addr, uint64_t *number, uint64_t *generation)
+{
+	struct inode_table *table = disk_inode_table(disk);
+	pthread_mutex_lock(&table->lock);
+
+	struct inode *inode = inode_by_number(disk, parent);
+
+	// Only linked directories have children
+	if(!inode || inode->unlinked || !S_ISDIR(inode->ent.mode)) {
+		pthread_mutex_unlock(&table->lock);
+		return -1;
+	}
+
+	// Cached child is already kept at its address
+	struct inode *child = inode_by_name(table, inode, name);
+	if(!child) {
+		child = inode_load(disk, inode, name, addr);
+		if(!child) {
+			pthread_mutex_unlock(&table->lock);
+			return -1;
+		}
+	}
+
+	++child->lookups;
+	*number = child->number;
+	*generation = child->generation;
+
+	pthread_mutex_unlock(&table->lock);
+	return 0;
+}
+
+uint64_t inode_number(disk disk, address addr)
+{
+	struct inode_table *table = disk_inode_table(disk);
+	pthread_mutex_lock(&table->lock);
+
+	const struct inode *inode = inode_by_address(table, addr);
+	const uint64_t number = inode ? inode->number
+		: addr.end_block == disk_root(disk) && addr.end_offset == sizeof(struct entry) ? INODE_ROOT
+		: INODE_NUMBER(addr);
+
+	pthread_mutex_unlock(&table->lock);
+	return number;
+}
+
+int inode_open(disk disk, uint64_t number)
+{
+	struct inode_table *table = disk_inode_table(disk);
+	pthread_mutex_lock(&table->lock);
+
+	struct inode *inode = inode_by_number(disk, number);
+	if(!inode || inode->unlinked) {
+		pthread_mutex_unlock(&table->lock);
+		return -1;
+	}
+
+	++inode->opens;
+	pthread_mutex_unlock(&table->lock);
+	return 0;
+}
+
+bool inode_opened(disk disk, uint64_t parent, const char *name, uint64_t *number)
+{
+	struct inode_table *table = disk_inode_table(disk);
+	pthread_mutex_lock(&table->lock);
+
+	const struct inode *inode = inode_by_number(disk, parent);
+	const struct inode *child = inode ? inode_by_name(table, inode, name) : NULL;
+	const bool opened = child && child->opens > 0;
+	if(opened) {
+		*number = child->number;
+	}
+
+	pthread_mutex_unlock(&table->lock);
+	return opened;
+}
+
+int inode_release(disk disk, uint64_t number, uint64_t *parent, char *name)
+{
+	struct inode_table *table = disk_inode_table(disk);
+	pthread_mutex_lock(&table->lock);
+
+	struct inode *inode = inode_by_number(disk, number);
+	if(!inode || inode->opens == 0) {
+		pthread_mutex_unlock(&table->lock);
+		return 0;
+	}
+
+	// Hidden entry is removed by last release
+	int removed = 0;
+	if(--inode->opens == 0 && inode->hidden && !inode->unlinked) {
+		*parent = inode->parent->number;
+		strcpy(name, inode->name);
+		removed = 1;
+	}
+
+	inode_drop(table, inode);
+	pthread_mutex_unlock(&table->lock);
+	return removed;
+}
+
+void inode_reload(disk disk, address addr)
+{
+	syslog(LOG_DEBUG, "reloading inode at %u:%u", addr.end_block, addr.end_offset);
+
+	const struct superblock *sb = disk_superblock(disk);
+	struct inode_table *table = disk_inode_table(disk);
+	pthread_mutex_lock(&table->lock);
+
+	struct inode *inode = inode_by_address(table, addr);
+	if(!inode) {
+		pthread_mutex_unlock(&table->lock);
+		return;
+	}
+
+	if(dir_read(disk, addr, &inode->ent, sizeof(struct entry)) != sizeof(struct entry)) {
+		syslog(LOG_ERR, "failed to reload inode at %u:%u", addr.end_block, addr.end_offset);
+	}
+
+	inode->counted = false;
+
+	// Find every cached child again by name
+	for(struct inode *child = inode->children, *next; child; child = next) {
+		next = child->next_sibling;
+
+		const address child_addr = entry_find(disk, addr, child->name, NULL);
+		if(!DIR_ADDRESS_VALID(sb, child_addr)) {
+			inode_cut(table, child);
+			continue;
+		}
+
+		// Move child to its new address
+		struct inode **link = &table->addresses[inode_address_hash(child->addr) & (table->bucket_count - 1)];
+		while(*link != child) {
+			link = &(*link)->next_address;
+		}
+
+		*link = child->next_address;
+
+		child->addr = child_addr;
+		struct inode **bucket = &table->addresses[inode_address_hash(child_addr) & (table->bucket_count - 1)];
+		child->next_address = *bucket;
+		*bucket = child;
+
+		if(dir_read(disk, child_addr, &child->ent, sizeof(struct entry)) != sizeof(struct entry)) {
+			inode_cut(table, child);
+		}
+	}
+
+	inode_drop(table, inode);
+	pthread_mutex_unlock(&table->lock);
+}
+
+void inode_rename(disk disk, uint64_t parent, const char *name, uint64_t newparent, const char *newname, uint32_t mode, address addr)
+{
+	struct inode_table *table = disk_inode_table(disk);
+	pthread_mutex_lock(&table->lock);
+
+	struct inode *from = inode_by_number(disk, parent);
+	struct inode *to = inode_by_number(disk, newparent);
+
+	struct inode *child = from ? inode_by_name(table, from, name) : NULL;
+	if(child) {
+		// Children of child keep their addresses since they are stored in blocks of child
+		inode_unindex(table, child);
+
+		if(to && !to->unlinked) {
+			inode_attach(table, child, to, newname, addr);
+			if(dir_read(disk, addr, &child->ent, sizeof(struct entry)) != sizeof(struct entry)) {
+				inode_cut(table, child);
+			}
+		} else {
+			// Child cannot be reached through an unknown parent
+			child->unlinked = true;
+			while(child->children) {
+				inode_cut(table, child->children);
+			}
+
+			inode_drop(table, child);
+		}
+	}
+
+	// Parent sizes and times changed
+	if(from && !from->unlinked) {
+		if(dir_read(disk, from->addr, &from->ent, sizeof(struct entry)) != sizeof(struct entry)) {
+			from->counted = false;
+		} else if(S_ISDIR(mode) && from->counted && from->subdirs > 0) {
+			--from->subdirs;
+		}
+	}
+
+	if(to && !to->unlinked) {
+		if(dir_read(disk, to->addr, &to->ent, sizeof(struct entry)) != sizeof(struct entry)) {
+			to->counted = false;
+		} else if(S_ISDIR(mode) && to->counted) {
+			++to->subdirs;
+		}
+	}
+
+	inode_drop(table, from);
+	pthread_mutex_unlock(&table->lock);
+}
+
+void inode_unlink(disk disk, uint64_t parent, const char *name, uint32_t mode)
+{
+	struct inode_table *table = disk_inode_table(disk);
+	pthread_mutex_lock(&table->lock);
+
+	struct inode *inode = inode_by_number(disk, parent);
+	if(inode && !inode->unlinked) {
+		struct inode *child = inode_by_name(table, inode, name);
+		if(child) {
+			inode_cut(table, child);
+		}
+
+		// Parent size and times changed
+		if(dir_read(disk, inode->addr, &inode->ent, sizeof(struct entry)) != sizeof(struct entry)) {
+			inode->counted = false;
+		} else if(S_ISDIR(mode) && inode->counted && inode->subdirs > 0) {
+			--inode->subdirs;
+		}
+
+		inode_drop(table, inode);
+	}
+
+	pthread_mutex_unlock(&table->lock);
+}
+
+void inode_update(disk disk, address addr)
+{
+	struct inode_table *table = disk_inode_table(disk);
+	pthread_mutex_lock(&table->lock);
+
+	struct inode *inode = inode_by_address(table, addr);
+	if(inode && dir_read(disk, addr, &inode->ent, sizeof(struct entry)) != sizeof(struct entry)) {
+		syslog(LOG_ERR, "failed to update inode at %u:%u", addr.end_block, addr.end_offset);
+	}
+
+	pthread_mutex_unlock(&table->lock);
+}
+
+uint32_t inode_address_hash(address addr)
+{
+	return (addr.end_block * 2654435761u) ^ addr.end_offset;
+}
+
+void inode_attach(struct inode_table *table, struct inode *inode, struct inode *parent, const char *name, address addr)
+{
+	if(strcmp(inode->name, name) != 0) {
+		free(inode->name);
+		inode->name = strdup(name);
+	}
+
+	inode->addr = addr;
+	inode->parent = parent;
+	inode->hash = inode_name_hash(parent, name);
+
+	struct inode **bucket = &table->addresses[inode_address_hash(addr) & (table->bucket_count - 1)];
+	inode->next_address = *bucket;
+	*bucket = inode;
+
+	// Root has no name
+	if(parent) {
+		bucket = &table->names[inode->hash & (table->bucket_count - 1)];
+		inode->next_name = *bucket;
+		*bucket = inode;
+
+		inode->prev_sibling = NULL;
+		inode->next_sibling = parent->children;
+		if(inode->next_sibling) {
+			inode->next_sibling->prev_sibling = inode;
+		}
+
+		parent->children = inode;
+	}
+}
+
+struct inode *inode_by_address(struct inode_table *table, address addr)
+{
+	for(struct inode *inode = table->addresses[inode_address_hash(addr) & (table->bucket_count - 1)]; inode; inode = inode->next_address) {
+		if(inode->addr.end_block == addr.end_block && inode->addr.end_offset == addr.end_offset) {
+			return inode;
+		}
+	}
+
+	return NULL;
+}
+
+struct inode *inode_by_name(struct inode_table *table, const struct inode *parent, const char *name)
+{
+	const uint32_t hash = inode_name_hash(parent, name);
+
+	for(struct inode *inode = table->names[hash & (table->bucket_count - 1)]; inode; inode = inode->next_name) {
+		if(inode->hash == hash && inode->parent == parent && strcmp(inode->name, name) == 0) {
+			return inode;
+		}
+	}
+
+	return NULL;
+}
+
+struct inode *inode_by_number(disk disk, uint64_t number)
+{
+	struct inode_table *table = disk_inode_table(disk);
+
+	if(number == INODE_ROOT) {
+		if(!table->root) {
+			address root = {disk_root(disk), sizeof(struct entry)};
+			table->root = inode_load(disk, NULL, "", root);
+		}
+
+		return table->root;
+	}
+
+	for(struct inode *inode = table->numbers[inode_number_hash(number) & (table->bucket_count - 1)]; inode; inode = inode->next_number) {
+		if(inode->number == number) {
+			return inode;
+		}
+	}
+
+	return NULL;
+}
+
+int inode_count(disk disk, struct inode *inode)
+{
+	const struct superblock *sb = disk_superblock(disk);
+	const uint32_t count = inode->ent.size / sizeof(struct entry);
+
+	inode->subdirs = 0;
+
+	// Read every child at once
+	if(count > 0) {
+		struct entry *children = malloc(inode->ent.size);
+		address head = {inode->ent.start_block, ENTRY_FIRST_CHUNK_SIZE(sb, inode->ent)};
+		if(dir_read(disk, head, children, inode->ent.size) != inode->ent.size) {
+			free(children);
+			return -1;
+		}
+
+		for(uint32_t i = 0; i < count; ++i) {
+			if(!ENTRY_TOMBSTONE(children[i]) && S_ISDIR(children[i].mode)) {
+				++inode->subdirs;
+			}
+		}
+
+		free(children);
+	}
+
+	inode->counted = true;
+	return 0;
+}
+
+void inode_cut(struct inode_table *table, struct inode *inode)
+{
+	// Children of an unlinked directory cannot be reached anymore
+	while(inode->children) {
+		inode_cut(table, inode->children);
+	}
+
+	if(!inode->unlinked) {
+		inode_unindex(table, inode);
+		inode->unlinked = true;
+	}
+
+	if(inode->lookups == 0 && inode->opens == 0) {
+		inode_free(table, inode);
+	}
+}
+
+void inode_drop(struct inode_table *table, struct inode *inode)
+{
+	// Root lives as long as the table
+	while(inode && inode != table->root && inode->lookups == 0 && inode->opens == 0 && !inode->children) {
+		struct inode *parent = inode->parent;
+		inode_cut(table, inode);
+		inode = parent;
+	}
+}
+
+void inode_free(struct inode_table *table, struct inode *inode)
+{
+	// Remove from number index
+	struct inode **link = &table->numbers[inode_number_hash(inode->number) & (table->bucket_count - 1)];
+	while(*link != inode) {
+		link = &(*link)->next_number;
+	}
+
+	*link = inode->next_number;
+
+	--table->count;
+	free(inode->name);
+	free(inode);
+}
+
+void inode_grow(struct inode_table *table)
+{
+	if(table->count < table->bucket_count) {
+		return;
+	}
+
+	const uint32_t bucket_count = table->bucket_count * 2;
+	struct inode **addresses = calloc(bucket_count, sizeof(struct inode *));
+	struct inode **names = calloc(bucket_count, sizeof(struct inode *));
+	struct inode **numbers = calloc(bucket_count, sizeof(struct inode *));
+
+	for(uint32_t i = 0; i < table->bucket_count; ++i) {
+		while(table->addresses[i]) {
+			struct inode *moved = table->addresses[i];
+			table->addresses[i] = moved->next_address;
+			struct inode **bucket = &addresses[inode_address_hash(moved->addr) & (bucket_count - 1)];
+			moved->next_address = *bucket;
+			*bucket = moved;
+		}
+
+		while(table->names[i]) {
+			struct inode *moved = table->names[i];
+			table->names[i] = moved->next_name;
+			struct inode **bucket = &names[moved->hash & (bucket_count - 1)];
+			moved->next_name = *bucket;
+			*bucket = moved;
+		}
+
+		while(table->numbers[i]) {
+			struct inode *moved = table->numbers[i];
+			table->numbers[i] = moved->next_number;
+			struct inode **bucket = &numbers[inode_number_hash(moved->number) & (bucket_count - 1)];
+			moved->next_number = *bucket;
+			*bucket = moved;
+		}
+	}
+
+	free(table->addresses);
+	free(table->names);
+	free(table->numbers);
+	table->addresses = addresses;
+	table->names = names;
+	table->numbers = numbers;
+	table->bucket_count = bucket_count;
+}
+
+struct inode *inode_load(disk disk, struct inode *parent, const char *name, address addr)
+{
+	struct inode_table *table = disk_inode_table(disk);
+
+	struct inode *inode = calloc(1, sizeof(struct inode));
+	if(dir_read(disk, addr, &inode->ent, sizeof(struct entry)) != sizeof(struct entry)) {
+		free(inode);
+		return NULL;
+	}
+
+	inode_grow(table);
+
+	// Entries that moved keep numbers derived from their old address so new entries there need a spare number
+	inode->number = parent ? INODE_NUMBER(addr) : INODE_ROOT;
+	if(parent && inode_by_number(disk, inode->number)) {
+		inode->number = ((uint64_t) table->spare++ << 32) | INODE_SPARE_OFFSET;
+	}
+
+	inode->generation = table->generation++;
+	inode->name = strdup(name);
+	inode_attach(table, inode, parent, name, addr);
+
+	struct inode **bucket = &table->numbers[inode_number_hash(inode->number) & (table->bucket_count - 1)];
+	inode->next_number = *bucket;
+	*bucket = inode;
+
+	++table->count;
+	return inode;
+}
+
+uint32_t inode_name_hash(const struct inode *parent, const char *name)
+{
+	uint32_t hash = 2166136261u ^ (uint32_t) ((uintptr_t) parent >> 4);
+	for(; *name; ++name) {
+		hash ^= (uint8_t) *name;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+uint32_t inode_number_hash(uint64_t number)
+{
+	return (uint32_t) ((number ^ (number >> 29)) * 0x9e3779b97f4a7c15ull >> 32);
+}
+
+void inode_unindex(struct inode_table *table, struct inode *inode)
+{
+	// Remove from address index
+	struct inode **link = &table->addresses[inode_address_hash(inode->addr) & (table->bucket_count - 1)];
+	while(*link != inode) {
+		link = &(*link)->next_address;
+	}
+
+	*link = inode->next_address;
+
+	// Remove from name index and from children of parent
+	if(inode->parent) {
+		link = &table->names[inode->hash & (table->bucket_count - 1)];
+		while(*link != inode) {
+			link = &(*link)->next_name;
+		}
+
+		*link = inode->next_name;
+
+		if(inode->prev_sibling) {
+			inode->prev_sibling->next_sibling = inode->next_sibling;
+		} else {
+			inode->parent->children = inode->next_sibling;
+		}
+
+		if(inode->next_sibling) {
+			inode->next_sibling->prev_sibling = inode->prev_sibling;
+		}
+	}
+
+	inode->parent = NULL;
+	inode->prev_sibling = NULL;
+	inode->next_sibling = NULL;
+}
@@ -0,0 +1,114 @@
+#ifndef INODE_H
+#define INODE_H
+
+#include "entry.h"
+#include <pthread.h>
+
+// Inode number of root entry
+#define INODE_ROOT	1
+
+// Get inode number derived from an entry address
+// Addresses are past the superblock so derived numbers never collide with small reserved numbers
+#define INODE_NUMBER(addr)	(((uint64_t) (addr).end_block << 32) | (addr).end_offset)
+
+// A directory entry cached in memory while the kernel or an open file refers to it
+// Inode numbers are derived from entry addresses when entries are first cached
+// Numbers stay the same when entries move so the kernel can keep using them
+struct inode {
+	uint64_t number;
+	uint64_t generation; // Distinguishes inodes that reuse a number
+	address addr; // Address of entry
+	struct entry ent;
+	uint64_t lookups; // References held by kernel
+	uint32_t opens; // Open file handles
+	uint32_t subdirs; // Amount of child directories of a directory
+	bool counted; // Child directories were counted
+	bool unlinked; // Entry was removed from its directory
+	bool hidden; // Entry was unlinked while open and renamed to a hidden name until it is released
+	struct inode *parent; // Cached parent, NULL for root and unlinked inodes
+	struct inode *children; // First cached child
+	struct inode *prev_sibling;
+	struct inode *next_sibling;
+	struct inode *next_address; // Next inode in address bucket
+	struct inode *next_name; // Next inode in name bucket
+	struct inode *next_number; // Next inode in number bucket
+	uint32_t hash; // Hash of parent and name
+	char *name; // Name of entry, empty for root
+};
+
+// Cached entries of a disk indexed by inode number, by entry address, and by parent and name
+// Operations keep cached entries coherent with disk
+struct inode_table {
+	pthread_mutex_t lock;
+	struct inode *root;
+	struct inode **addresses; // Buckets of linked inodes by entry address
+	struct inode **names; // Buckets of linked inodes by parent and name
+	struct inode **numbers; // Buckets of inodes by number
+	uint32_t bucket_count;
+	uint32_t count;
+	uint64_t generation; // Generation of next inode
+	uint32_t spare; // Spare numbers handed out when a derived number is taken
+};
+
+// Release resources of inode table
+void inode_destroy(struct inode_table *table);
+
+// Drop count kernel references to inode number
+// Inode is freed once nothing refers to it
+void inode_forget(disk disk, uint64_t number, uint64_t count);
+
+// Get entry, entry address, and amount of child directories of inode number
+// Address, entry, and subdirs can be NULL if they are not needed
+// Returns non-zero when inode is unknown or was unlinked
+int inode_get(disk disk, uint64_t number, address *addr, struct entry *ent, uint32_t *subdirs);
+
+// Mark inode number as unlinked while open so it is removed once released
+void inode_hide(disk disk, uint64_t number);
+
+// Initialize an empty inode table
+void inode_init(struct inode_table *table);
+
+// Update cached parent after an entry with mode was linked into it
+void inode_link(disk disk, uint64_t parent, uint32_t mode);
+
+// Find child named name of directory inode parent caching it when needed
+// Found inode gains a kernel reference
+// Returns non-zero when there is no such child
+int inode_lookup(disk disk, uint64_t parent, const char *name, uint64_t *number, uint64_t *generation);
+
+// Find child named name at address of directory inode parent caching it when needed
+// Found inode gains a kernel reference
+// Returns non-zero when parent is not a linked directory or child cannot be read
+int inode_lookup_at(disk disk, uint64_t parent, const char *name, address addr, uint64_t *number, uint64_t *generation);
+
+// Get inode number of entry at address without caching it
+uint64_t inode_number(disk disk, address addr);
+
+// Add an open file handle to inode number
+// Returns non-zero when inode is unknown or was unlinked
+int inode_open(disk disk, uint64_t number);
+
+// Check whether cached child named name of directory inode parent has open file handles
+// Number is set to child inode number when it does
+bool inode_opened(disk disk, uint64_t parent, const char *name, uint64_t *number);
+
+// Remove an open file handle from inode number
+// Returns non-zero when inode was hidden and its entry named name in parent must now be removed
+// Name must be able to hold ENTRY_LONG_NAME_LENGTH + 1 bytes
+int inode_release(disk disk, uint64_t number, uint64_t *parent, char *name);
+
+// Reread directory entry at address and addresses of its cached children after they moved
+// Children that are no longer found are unlinked
+void inode_reload(disk disk, address addr);
+
+// Move cached child named name with mode of parent to newparent as newname at address after it was renamed
+// Must happen before old entry is unlinked so moving children of parent does not lose child
+void inode_rename(disk disk, uint64_t parent, const char *name, uint64_t newparent, const char *newname, uint32_t mode, address addr);
+
+// Update cached parent and unlink cached child after an entry named name with mode was unlinked from parent
+void inode_unlink(disk disk, uint64_t parent, const char *name, uint32_t mode);
+
+// Reread cached entry at address after it was written
+void inode_update(disk disk, address addr);
+
+#endif
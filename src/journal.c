@@ -0,0 +1,567 @@
+#include "journal.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+// Amount of dirty block hash buckets
+#define JOURNAL_BUCKET_COUNT 4096
+
+// Hash bucket of a dirty block
+#define JOURNAL_BUCKET(b) (((uint32_t) (b) * 2654435761u) % JOURNAL_BUCKET_COUNT)
+
+// Nesting of file data writes on calling thread
+static __thread int data_depth;
+
+// Nesting of journaled operations on calling thread
+static __thread int scope_depth;
+
+// Checksum a journal transaction using FNV-1a
+uint32_t journal_checksum(const struct journal_header *header, const uint8_t *images, size_t size);
+
+// Write dirty blocks while no operation is running
+// Returns non-zero on failure
+int journal_flush(disk d);
+
+// Find dirty block
+// Journal must be locked
+// Returns NULL when block is not dirty
+struct journal_entry *journal_find(struct journal *journal, block home);
+
+// Commit periodically until journal closes
+void *journal_loop(void *data);
+
+// Compare dirty blocks for sorting in ascending home order
+int compare_entries(const void *a, const void *b);
+
+disk journal_begin(disk d)
+{
+	struct journal *journal = disk_journal(d);
+	if(scope_depth++ > 0) {
+		return d;
+	}
+
+	// Thread is started on first use since mounting may fork after opening disk
+	if(journal->enabled && journal->interval > 0 && !journal->running) {
+		pthread_mutex_lock(&journal->thread_lock);
+		if(!journal->running && !journal->stopping) {
+			journal->running = pthread_create(&journal->thread, NULL, journal_loop, d) == 0;
+		}
+		pthread_mutex_unlock(&journal->thread_lock);
+	}
+
+	pthread_rwlock_rdlock(&journal->ops);
+	return d;
+}
+
+disk journal_begin_exclusive(disk d)
+{
+	// Operation of calling thread already holds operations shared and cannot wait for itself
+	if(scope_depth++ > 0) {
+		syslog(LOG_WARNING, "exclusive operation started within another operation");
+		return d;
+	}
+
+	pthread_rwlock_wrlock(&disk_journal(d)->ops);
+	return d;
+}
+
+int journal_close(disk d)
+{
+	struct journal *journal = disk_journal(d);
+	if(!journal->enabled) {
+		return 0;
+	}
+
+	syslog(LOG_DEBUG, "closing journal");
+
+	// Stop periodic commits
+	pthread_mutex_lock(&journal->thread_lock);
+	const bool running = journal->running;
+	journal->stopping = true;
+	pthread_cond_signal(&journal->thread_cond);
+	pthread_mutex_unlock(&journal->thread_lock);
+
+	if(running) {
+		pthread_join(journal->thread, NULL);
+	}
+
+	// Home blocks must be stable before header stops them being replayed
+	if(journal_commit(d) != 0 || disk_flush(d, false) != 0) {
+		return -1;
+	}
+
+	// Nothing is left to replay
+	const struct superblock *sb = disk_superblock(d);
+	journal->enabled = false;
+	void *header = calloc(1, sb->block_size);
+	const int err = block_write(d, sb->journal_block, header) != 0 || disk_flush(d, false) != 0;
+	free(header);
+
+	if(err) {
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "closed journal");
+	return 0;
+}
+
+int journal_commit(disk d)
+{
+	struct journal *journal = disk_journal(d);
+
+	// Operations of calling thread commit once they end
+	if(!journal->enabled || scope_depth > 0) {
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(&journal->ops);
+	const int err = journal_flush(d);
+	pthread_rwlock_unlock(&journal->ops);
+	return err;
+}
+
+void journal_data_begin(void)
+{
+	++data_depth;
+}
+
+void journal_data_end(void)
+{
+	--data_depth;
+}
+
+void journal_destroy(struct journal *journal)
+{
+	for(uint32_t i = 0; i < JOURNAL_BUCKET_COUNT; ++i) {
+		while(journal->buckets[i]) {
+			struct journal_entry *entry = journal->buckets[i];
+			journal->buckets[i] = entry->next;
+			free(entry);
+		}
+	}
+
+	free(journal->buckets);
+	free(journal->freed);
+	pthread_cond_destroy(&journal->thread_cond);
+	pthread_mutex_destroy(&journal->thread_lock);
+	pthread_mutex_destroy(&journal->lock);
+	pthread_rwlock_destroy(&journal->ops);
+}
+
+void journal_end(disk d)
+{
+	struct journal *journal = disk_journal(d);
+	if(--scope_depth > 0) {
+		return;
+	}
+
+	pthread_rwlock_unlock(&journal->ops);
+	if(!journal->enabled) {
+		return;
+	}
+
+	// Commit early before transaction outgrows journal
+	const struct superblock *sb = disk_superblock(d);
+	pthread_mutex_lock(&journal->lock);
+	const bool full = journal->dirty >= JOURNAL_CAPACITY(sb) / 2;
+	pthread_mutex_unlock(&journal->lock);
+
+	if(full || journal->interval == 0) {
+		journal_commit(d);
+	}
+}
+
+int journal_free(disk d, const block *blocks, uint32_t count)
+{
+	struct journal *journal = disk_journal(d);
+	if(!journal->enabled || journal->committing) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&journal->lock);
+
+	if(journal->freed_count + count > journal->freed_capacity) {
+		while(journal->freed_count + count > journal->freed_capacity) {
+			journal->freed_capacity = journal->freed_capacity ? journal->freed_capacity * 2 : 256;
+		}
+
+		journal->freed = realloc(journal->freed, journal->freed_capacity * sizeof(block));
+	}
+
+	memcpy(journal->freed + journal->freed_count, blocks, count * sizeof(block));
+	journal->freed_count += count;
+
+	pthread_mutex_unlock(&journal->lock);
+	return 0;
+}
+
+bool journal_freeing(disk d, block b)
+{
+	struct journal *journal = disk_journal(d);
+	if(!journal->enabled) {
+		return false;
+	}
+
+	pthread_mutex_lock(&journal->lock);
+
+	bool found = false;
+	for(uint32_t i = 0; i < journal->freed_count && !found; ++i) {
+		found = journal->freed[i] == b;
+	}
+
+	pthread_mutex_unlock(&journal->lock);
+	return found;
+}
+
+void journal_init(struct journal *journal)
+{
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&journal->ops, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	pthread_mutex_init(&journal->lock, NULL);
+	journal->buckets = calloc(JOURNAL_BUCKET_COUNT, sizeof(struct journal_entry *));
+	journal->dirty = 0;
+	journal->freed = NULL;
+	journal->freed_count = 0;
+	journal->freed_capacity = 0;
+	journal->sequence = 0;
+	journal->interval = JOURNAL_COMMIT_INTERVAL;
+	journal->enabled = false;
+	journal->committing = false;
+
+	pthread_mutex_init(&journal->thread_lock, NULL);
+	pthread_cond_init(&journal->thread_cond, NULL);
+	journal->running = false;
+	journal->stopping = false;
+}
+
+int journal_open(disk d)
+{
+	const struct superblock *sb = disk_superblock(d);
+	struct journal *journal = disk_journal(d);
+	const uint32_t capacity = JOURNAL_CAPACITY(sb);
+
+	// Disk has no journal
+	if(capacity == 0) {
+		return 0;
+	}
+
+	syslog(LOG_DEBUG, "opening journal");
+
+	struct journal_header *header = malloc(sb->block_size);
+	if(block_read(d, sb->journal_block, header) != 0) {
+		free(header);
+		return -1;
+	}
+
+	// Read-only disks have nothing to journal but cannot replay either
+	if(disk_readonly(d)) {
+		const bool replay = header->magic == JOURNAL_MAGIC && header->count > 0;
+		free(header);
+		if(replay) {
+			syslog(LOG_ERR, "journal must be replayed by opening disk read-write");
+			return -1;
+		}
+
+		return 0;
+	}
+
+	// Replay last committed transaction since it may not have reached home blocks
+	if(header->magic == JOURNAL_MAGIC && header->count > 0 && header->count <= capacity) {
+		const size_t size = (size_t) header->count * sb->block_size;
+		uint8_t *images = malloc(size);
+		if(block_read_many(d, sb->journal_block + 1, header->count, images) != 0) {
+			free(images);
+			free(header);
+			return -1;
+		}
+
+		if(journal_checksum(header, images, size) == header->checksum) {
+			for(uint32_t i = 0; i < header->count; ++i) {
+				if(block_write(d, header->blocks[i], images + (size_t) i * sb->block_size) != 0) {
+					free(images);
+					free(header);
+					return -1;
+				}
+			}
+
+			if(disk_flush(d, false) != 0) {
+				free(images);
+				free(header);
+				return -1;
+			}
+
+			syslog(LOG_INFO, "replayed %u journal blocks", header->count);
+		}
+
+		free(images);
+	}
+
+	journal->sequence = header->magic == JOURNAL_MAGIC ? header->sequence + 1 : 0;
+	journal->enabled = true;
+	free(header);
+
+	syslog(LOG_DEBUG, "opened journal");
+	return 0;
+}
+
+void journal_overlay(disk d, block offset, uint32_t count, void *buffer)
+{
+	struct journal *journal = disk_journal(d);
+	if(!journal->enabled || journal->dirty == 0) {
+		return;
+	}
+
+	const struct superblock *sb = disk_superblock(d);
+
+	pthread_mutex_lock(&journal->lock);
+	for(uint32_t i = 0; i < count; ++i) {
+		const struct journal_entry *entry = journal_find(journal, offset + i);
+		if(entry) {
+			memcpy((uint8_t *) buffer + (size_t) i * sb->block_size, entry->data, sb->block_size);
+		}
+	}
+	pthread_mutex_unlock(&journal->lock);
+}
+
+void journal_overlay_range(disk d, block offset, uint32_t position, uint32_t size, void *buffer)
+{
+	struct journal *journal = disk_journal(d);
+	if(!journal->enabled || journal->dirty == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&journal->lock);
+	const struct journal_entry *entry = journal_find(journal, offset);
+	if(entry) {
+		memcpy(buffer, entry->data + position, size);
+	}
+	pthread_mutex_unlock(&journal->lock);
+}
+
+void journal_scope_end(disk *d)
+{
+	journal_end(*d);
+}
+
+void journal_set_interval(disk d, unsigned interval)
+{
+	disk_journal(d)->interval = interval;
+}
+
+int journal_store(disk d, block offset, uint32_t count, const void *buffer)
+{
+	struct journal *journal = disk_journal(d);
+	if(!journal->enabled || journal->committing) {
+		return -1;
+	}
+
+	const struct superblock *sb = disk_superblock(d);
+
+	pthread_mutex_lock(&journal->lock);
+
+	// File data is written now and replaces any stale metadata
+	if(data_depth > 0) {
+		for(uint32_t i = 0; i < count; ++i) {
+			struct journal_entry **link = &journal->buckets[JOURNAL_BUCKET(offset + i)];
+			while(*link && (*link)->home != offset + i) {
+				link = &(*link)->next;
+			}
+
+			if(*link) {
+				struct journal_entry *entry = *link;
+				*link = entry->next;
+				free(entry);
+				--journal->dirty;
+			}
+		}
+
+		pthread_mutex_unlock(&journal->lock);
+		return -1;
+	}
+
+	for(uint32_t i = 0; i < count; ++i) {
+		struct journal_entry *entry = journal_find(journal, offset + i);
+		if(!entry) {
+			entry = malloc(sizeof(struct journal_entry) + sb->block_size);
+			entry->home = offset + i;
+			entry->next = journal->buckets[JOURNAL_BUCKET(offset + i)];
+			journal->buckets[JOURNAL_BUCKET(offset + i)] = entry;
+			++journal->dirty;
+		}
+
+		memcpy(entry->data, (const uint8_t *) buffer + (size_t) i * sb->block_size, sb->block_size);
+	}
+
+	pthread_mutex_unlock(&journal->lock);
+	return 0;
+}
+
+int compare_entries(const void *a, const void *b)
+{
+	const block x = (*(struct journal_entry * const *) a)->home;
+	const block y = (*(struct journal_entry * const *) b)->home;
+	return (x > y) - (x < y);
+}
+
+uint32_t journal_checksum(const struct journal_header *header, const uint8_t *images, size_t size)
+{
+	uint32_t hash = 2166136261u;
+	const uint8_t *parts[] = {(const uint8_t *) &header->sequence, (const uint8_t *) &header->count, (const uint8_t *) header->blocks, images};
+	const size_t sizes[] = {sizeof(header->sequence), sizeof(header->count), header->count * sizeof(block), size};
+
+	for(int p = 0; p < 4; ++p) {
+		for(size_t i = 0; i < sizes[p]; ++i) {
+			hash ^= parts[p][i];
+			hash *= 16777619u;
+		}
+	}
+
+	return hash;
+}
+
+struct journal_entry *journal_find(struct journal *journal, block home)
+{
+	struct journal_entry *entry = journal->buckets[JOURNAL_BUCKET(home)];
+	while(entry && entry->home != home) {
+		entry = entry->next;
+	}
+
+	return entry;
+}
+
+int journal_flush(disk d)
+{
+	const struct superblock *sb = disk_superblock(d);
+	struct journal *journal = disk_journal(d);
+
+	// Blocks freed by committed operations become free in this transaction
+	// Released blocks are forgotten at once since a failed commit leaves them free in dirty FAT
+	// where they can be allocated again and must not be released a second time
+	block *released = journal->freed;
+	const uint32_t released_count = journal->freed_count;
+	journal->freed = NULL;
+	journal->freed_count = 0;
+	journal->freed_capacity = 0;
+
+	if(released_count > 0 && block_release(d, released, released_count) != 0) {
+		free(released);
+		return -1;
+	}
+
+	if(journal->dirty == 0) {
+		free(released);
+		return 0;
+	}
+
+	syslog(LOG_DEBUG, "committing %u journal blocks", journal->dirty);
+
+	// Gather dirty blocks in home order
+	const uint32_t count = journal->dirty;
+	struct journal_entry **entries = malloc(count * sizeof(struct journal_entry *));
+	uint32_t found = 0;
+	for(uint32_t i = 0; i < JOURNAL_BUCKET_COUNT; ++i) {
+		for(struct journal_entry *entry = journal->buckets[i]; entry; entry = entry->next) {
+			entries[found++] = entry;
+		}
+	}
+
+	qsort(entries, count, sizeof(struct journal_entry *), compare_entries);
+
+	journal->committing = true;
+	int err = 0;
+
+	// File data and previous home blocks must be stable before journal is reused
+	err = disk_flush(d, false);
+
+	struct journal_header *header = calloc(1, sb->block_size);
+	if(!err && count <= JOURNAL_CAPACITY(sb)) {
+		// Write images followed by header that commits them
+		const size_t size = (size_t) count * sb->block_size;
+		uint8_t *images = malloc(size);
+		for(uint32_t i = 0; i < count; ++i) {
+			memcpy(images + (size_t) i * sb->block_size, entries[i]->data, sb->block_size);
+			header->blocks[i] = entries[i]->home;
+		}
+
+		header->magic = JOURNAL_MAGIC;
+		header->sequence = journal->sequence++;
+		header->count = count;
+		header->checksum = journal_checksum(header, images, size);
+
+		err = block_write_many(d, sb->journal_block + 1, count, images) != 0
+			|| block_write(d, sb->journal_block, header) != 0
+			|| disk_flush(d, false) != 0;
+
+		free(images);
+	} else if(!err) {
+		// Transaction does not fit so stop replaying older transactions over it
+		syslog(LOG_WARNING, "writing %u blocks without journaling", count);
+		err = block_write(d, sb->journal_block, header) != 0 || disk_flush(d, false) != 0;
+	}
+
+	free(header);
+
+	// Write home blocks
+	for(uint32_t i = 0; i < count && !err; ++i) {
+		err = block_write(d, entries[i]->home, entries[i]->data) != 0;
+	}
+
+	if(err) {
+		journal->committing = false;
+		free(entries);
+		free(released);
+		syslog(LOG_ERR, "failed to commit %u journal blocks", count);
+		return -1;
+	}
+
+	// Committed blocks are clean now
+	// Readers outside operations may still be overlaying dirty blocks
+	pthread_mutex_lock(&journal->lock);
+	memset(journal->buckets, 0, JOURNAL_BUCKET_COUNT * sizeof(struct journal_entry *));
+	journal->dirty = 0;
+	pthread_mutex_unlock(&journal->lock);
+
+	for(uint32_t i = 0; i < count; ++i) {
+		free(entries[i]);
+	}
+
+	free(entries);
+
+	// Freed blocks are committed so host storage can be released
+	block_discard_list(d, released, released_count);
+	free(released);
+	journal->committing = false;
+
+	syslog(LOG_DEBUG, "committed %u journal blocks", count);
+	return 0;
+}
+
+void *journal_loop(void *data)
+{
+	disk d = data;
+	struct journal *journal = disk_journal(d);
+
+	pthread_mutex_lock(&journal->thread_lock);
+	while(!journal->stopping) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += journal->interval;
+
+		if(pthread_cond_timedwait(&journal->thread_cond, &journal->thread_lock, &deadline) != ETIMEDOUT) {
+			continue;
+		}
+
+		pthread_mutex_unlock(&journal->thread_lock);
+		journal_commit(d);
+		pthread_mutex_lock(&journal->thread_lock);
+	}
+
+	pthread_mutex_unlock(&journal->thread_lock);
+	return NULL;
+}
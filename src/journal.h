@@ -0,0 +1,130 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "block.h"
+#include <pthread.h>
+
+// Magic of a committed journal header
+#define JOURNAL_MAGIC 0x6a6f726e
+
+// Default amount of seconds between group commits
+#define JOURNAL_COMMIT_INTERVAL 5
+
+// Maximum amount of blocks in a journal transaction
+// First journal block is the header listing home blocks of the following images
+#define JOURNAL_CAPACITY(sb) (sb->journal_block_count < 2 ? 0 \
+		: sb->journal_block_count - 1 < (sb->block_size - sizeof(struct journal_header)) / sizeof(block) \
+		? sb->journal_block_count - 1 : (sb->block_size - sizeof(struct journal_header)) / sizeof(block))
+
+// Run rest of enclosing scope as a single journaled operation
+#define JOURNAL_SCOPE(d) struct disk_info *journal_scope __attribute__((cleanup(journal_scope_end))) = journal_begin(d)
+
+// Run rest of enclosing scope as a single journaled operation while no other operation runs
+#define JOURNAL_EXCLUSIVE_SCOPE(d) struct disk_info *journal_scope __attribute__((cleanup(journal_scope_end))) = journal_begin_exclusive(d)
+
+// Journal header at first journal block
+// Checksum covers sequence, count, home blocks, and images
+struct __attribute__((__packed__)) journal_header {
+	uint32_t magic;
+	uint32_t sequence;
+	uint32_t count; // Amount of images in transaction
+	uint32_t checksum;
+	block blocks[]; // Home block of each image
+};
+
+// A dirty metadata block waiting to be committed
+struct journal_entry {
+	block home;
+	struct journal_entry *next;
+	uint8_t data[];
+};
+
+// Write-back metadata cache of a disk committed through the journal
+struct journal {
+	pthread_rwlock_t ops; // Held shared by operations and exclusively by commits and exclusive operations
+	pthread_mutex_t lock; // Protects dirty blocks and freed blocks
+	struct journal_entry **buckets;
+	uint32_t dirty;
+	block *freed; // Blocks freed since last commit
+	uint32_t freed_count;
+	uint32_t freed_capacity;
+	uint32_t sequence;
+	unsigned interval;
+	bool enabled;
+	bool committing;
+
+	// Periodic group commits
+	pthread_mutex_t thread_lock;
+	pthread_cond_t thread_cond;
+	pthread_t thread;
+	bool running;
+	bool stopping;
+};
+
+// Start a journaled operation
+// Commits wait until every started operation ends
+// Returns disk
+disk journal_begin(disk d);
+
+// Start a journaled operation that waits until every other started operation ends and keeps new ones waiting
+// Operations are excluded even when journaling is disabled
+// Must not be started within another operation of calling thread
+// Returns disk
+disk journal_begin_exclusive(disk d);
+
+// Commit outstanding operations and stop journaling
+// Returns non-zero on failure
+int journal_close(disk d);
+
+// Write dirty metadata blocks to journal and then to their home blocks
+// Does nothing when journaling is disabled
+// Returns non-zero on failure
+int journal_commit(disk d);
+
+// Start writing file data that bypasses journal on calling thread
+void journal_data_begin(void);
+
+// Stop writing file data that bypasses journal on calling thread
+void journal_data_end(void);
+
+// Release resources of journal
+void journal_destroy(struct journal *journal);
+
+// End a journaled operation
+// Commits when enough metadata is dirty
+void journal_end(disk d);
+
+// Free blocks in FAT once current transaction commits
+// Freed blocks cannot be allocated again before they are committed
+// Returns non-zero when journaling is disabled and blocks must be freed now
+int journal_free(disk d, const block *blocks, uint32_t count);
+
+// Check whether block was freed by an operation that has not committed yet
+bool journal_freeing(disk d, block b);
+
+// Initialize a disabled journal
+void journal_init(struct journal *journal);
+
+// Replay last committed transaction and start journaling when disk has a journal
+// Returns non-zero on failure
+int journal_open(disk d);
+
+// Copy dirty metadata of count blocks starting at offset over buffer
+void journal_overlay(disk d, block offset, uint32_t count, void *buffer);
+
+// Copy size bytes at position of dirty metadata of block at offset over buffer
+void journal_overlay_range(disk d, block offset, uint32_t position, uint32_t size, void *buffer);
+
+// End journaled operation of a scope
+void journal_scope_end(disk *d);
+
+// Set amount of seconds between group commits
+// Every operation commits when interval is zero
+void journal_set_interval(disk d, unsigned interval);
+
+// Keep metadata of count blocks starting at offset until it is committed
+// File data and writes without journaling are not kept
+// Returns non-zero when data was not kept and must be written now
+int journal_store(disk d, block offset, uint32_t count, const void *buffer);
+
+#endif
@@ -10,12 +10,20 @@ int main(int argc, char **argv) {
 	param_parse(&params, argc, argv);
 
 	switch(params.cmd) {
+		case CMD_CHECK:
+			return cmd_check(&params);
+		case CMD_DEDUP:
+			return cmd_dedup(&params);
+		case CMD_DEFRAG:
+			return cmd_defrag(&params);
 		case CMD_FORMAT:
 			return cmd_format(&params);
 		case CMD_HELP:
 			return cmd_help(&params);
 		case CMD_MOUNT:
 			return cmd_mount(&params);
+		case CMD_SNAPSHOT:
+			return cmd_snapshot(&params);
 		case CMD_VERSION:
 			return cmd_version(&params);
 		default:
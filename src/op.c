@@ -1,197 +1,1060 @@
 #include "op.h"
-#include "obj.h"
+#include "defrag.h"
+#include "inode.h"
+#include "journal.h"
+#include "pool.h"
 #include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <time.h>
 
-// Get currently mounted disk from fuse context
-#define FATFS_DISK(context)	(context->private_data)
+// Get mount of a request
+#define FATFS_MOUNT(req)	((struct fatfs_mount *) fuse_req_userdata(req))
 
-int fatfs_chmod(const char *path, mode_t mode)
+// Get currently mounted disk of a request
+#define FATFS_DISK(req)	(FATFS_MOUNT(req)->d)
+
+// Largest write kernel sends in one request
+#define FATFS_MAX_WRITE	(1 << 20)
+
+// Amount of child entries read at once while reading a directory
+#define FATFS_READDIR_CHUNK	64
+
+// Directory offset of first child entry after generated links
+#define FATFS_READDIR_CHILDREN	3
+
+// Name of control file in root that reports fragmentation and buffer usage when read and defragments disk when written
+#define FATFS_DEFRAG_NAME	".fatfs-defrag"
+
+// Inode number of control file which no entry address derives
+#define FATFS_DEFRAG_INO	2
+
+// Check if name in parent is the defragmenter control file
+#define FATFS_DEFRAG(parent, name)	((parent) == FUSE_ROOT_ID && strcmp(name, FATFS_DEFRAG_NAME) == 0)
+
+// Name an open file takes when it is unlinked, unique by inode number and short enough for any disk
+#define FATFS_HIDDEN_FORMAT	".fatfs-%" PRIx64
+
+// Add directory entry named name resuming at offset to buffer of size bytes
+// Only inode number and mode of entry stats are added unless plus is set
+// Returns size of entry which did not fit when it is larger than size
+size_t add_entry(fuse_req_t req, char *buffer, size_t size, const char *name, const struct fuse_entry_param *entry, off_t offset, bool plus);
+
+// Fill entry parameters of child named name at address of directory parent for kernel
+// Kernel gains a reference to child inode
+// Returns zero or negative error
+int fill_child(fuse_req_t req, uint64_t parent, const char *name, address addr, struct fuse_entry_param *entry);
+
+// Fill stats of control file
+void fill_defrag_stats(fuse_req_t req, struct stat *stats);
+
+// Look up child named name of parent and fill entry parameters for kernel
+// Kernel gains a reference to found inode
+// Returns zero or negative error
+int fill_entry(fuse_req_t req, uint64_t parent, const char *name, struct fuse_entry_param *entry);
+
+// Fill stats of inode number using entry and its amount of child directories
+void fill_stats(fuse_req_t req, uint64_t number, const struct entry *ent, uint32_t subdirs, struct stat *stats);
+
+// Rename open file named name in parent to a hidden name until its last handle is released
+// Returns zero or negative error
+int hide_entry(disk d, uint64_t parent, const char *name, uint64_t number);
+
+// Make a new entry named name with mode in directory parent
+// Returns zero or negative error
+int make_entry(disk d, uint64_t parent, const char *name, uint32_t mode);
+
+// Read directory entries of inode number from offset into buffer
+// Children are filled with every attribute and gain a kernel reference when plus is set
+// Returns amount of bytes filled or negative error
+int read_children(fuse_req_t req, uint64_t number, char *buffer, size_t size, off_t offset, bool plus);
+
+// Read size bytes at offset of fragmentation and buffer usage report into buffer
+// Returns amount of bytes read or negative error
+int read_defrag(disk d, char *buffer, size_t size, off_t offset);
+
+// Read size bytes at offset of file inode number into buffer
+// Returns amount of bytes read or negative error
+int read_entry(disk d, uint64_t number, char *buffer, size_t size, off_t offset);
+
+// Reread directory inode number and its cached children after a failed operation left them unknown
+void reload_entry(disk d, uint64_t number);
+
+// Remove entry named name from parent which must be a directory when directory is set and a file otherwise
+// Returns zero or negative error
+int remove_entry(disk d, uint64_t parent, const char *name, bool directory);
+
+// Rename entry named name in parent to newname in newparent replacing entry named newname
+// Returns zero or negative error
+int rename_entry(disk d, uint64_t parent, const char *name, uint64_t newparent, const char *newname, unsigned int flags);
+
+// Change attributes of inode number selected by to_set
+// Returns zero or negative error
+int set_attributes(disk d, uint64_t number, const struct stat *attr, int to_set);
+
+// Write size bytes of buffer at offset of file inode number
+// Returns amount of bytes written or negative error
+int write_entry(disk d, uint64_t number, const char *buffer, size_t size, off_t offset);
+
+void fatfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *file_info)
 {
-	syslog(LOG_DEBUG, "changing permissions for '%s'", path);
+	syslog(LOG_DEBUG, "creating and opening file '%s' in inode %" PRIu64, name, parent);
 
-	disk d = FATFS_DISK(fuse_get_context());
+	if(FATFS_DEFRAG(parent, name)) {
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
 
-	address addr;
+	// Each step is its own journaled operation so the file exists on disk before kernel learns about it
+	disk d = FATFS_DISK(req);
+	struct fuse_entry_param entry;
+	int err = make_entry(d, parent, name, mode | S_IFREG);
+	if(err == 0) {
+		err = fill_entry(req, parent, name, &entry);
+	}
+
+	if(err == 0 && inode_open(d, entry.ino) != 0) {
+		inode_forget(d, entry.ino, 1);
+		err = -ENOENT;
+	}
+
+	if(err != 0) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+
+	file_info->keep_cache = FATFS_MOUNT(req)->timeout > 0;
+	fuse_reply_create(req, &entry, file_info);
+	syslog(LOG_INFO, "created and opened file '%s' in inode %" PRIu64, name, parent);
+}
+
+void fatfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *file_info)
+{
+	syslog(LOG_DEBUG, "allocating %zd bytes at offset %zd for inode %" PRIu64, length, offset, ino);
+
+	// Only plain allocation that may extend the file is supported
+	if(mode != 0) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	// Offset needs to be positive and length non-zero
+	if(offset < 0 || length <= 0) {
+		syslog(LOG_ERR, "invalid range %zd:%zd", offset, length);
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	// Entry size cannot represent the allocation
+	if(offset + length > UINT32_MAX) {
+		fuse_reply_err(req, EFBIG);
+		return;
+	}
+
+	disk d = FATFS_DISK(req);
+	int err = 0;
+
+	{
+		JOURNAL_SCOPE(d);
+
+		address addr;
+		struct entry ent;
+		if(inode_get(d, ino, &addr, &ent, NULL) != 0) {
+			err = ENOENT;
+		} else if(offset + length > ent.size) {
+			// Allocate missing blocks at once so they are contiguous when possible
+			const uint32_t amount = offset + length - ent.size;
+			const uint32_t allocated = entry_alloc(d, addr, amount, true);
+			inode_update(d, addr);
+			if(allocated != amount) {
+				err = ENOSPC;
+			}
+		}
+	}
+
+	fuse_reply_err(req, err);
+	if(err == 0) {
+		syslog(LOG_INFO, "allocated %zd bytes at offset %zd for inode %" PRIu64, length, offset, ino);
+	}
+}
+
+void fatfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *file_info)
+{
+	syslog(LOG_DEBUG, "flushing inode %" PRIu64, ino);
+
+	// Writes are not buffered so there is nothing to flush yet
+	fuse_reply_err(req, 0);
+	syslog(LOG_INFO, "flushed inode %" PRIu64, ino);
+}
+
+void fatfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t lookups)
+{
+	syslog(LOG_DEBUG, "forgetting %" PRIu64 " lookups of inode %" PRIu64, lookups, ino);
+
+	if(ino != FATFS_DEFRAG_INO) {
+		inode_forget(FATFS_DISK(req), ino, lookups);
+	}
+
+	fuse_reply_none(req);
+}
+
+void fatfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	syslog(LOG_DEBUG, "forgetting %zu inodes", count);
+
+	disk d = FATFS_DISK(req);
+	for(size_t i = 0; i < count; ++i) {
+		if(forgets[i].ino != FATFS_DEFRAG_INO) {
+			inode_forget(d, forgets[i].ino, forgets[i].nlookup);
+		}
+	}
+
+	fuse_reply_none(req);
+}
+
+void fatfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *file_info)
+{
+	syslog(LOG_DEBUG, "synchronizing inode %" PRIu64, ino);
+
+	// Committing waits for every journaled operation so this cannot be one
+	if(disk_sync(FATFS_DISK(req), datasync) != 0) {
+		fuse_reply_err(req, EIO);
+		return;
+	}
+
+	fuse_reply_err(req, 0);
+	syslog(LOG_INFO, "synchronized inode %" PRIu64, ino);
+}
+
+void fatfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *file_info)
+{
+	syslog(LOG_DEBUG, "retreiving attributes for inode %" PRIu64, ino);
+
+	const struct fatfs_mount *mount = FATFS_MOUNT(req);
+	struct stat stats;
+
+	// Control file is not stored on disk
+	if(ino == FATFS_DEFRAG_INO) {
+		fill_defrag_stats(req, &stats);
+		fuse_reply_attr(req, &stats, mount->timeout);
+		return;
+	}
+
+	disk d = mount->d;
+	JOURNAL_SCOPE(d);
+
+	// Need entry data and child directories for links
 	struct entry ent;
-	if(obj_get(d, path, &addr, &ent) != 0) {
-		return -ENOENT;
+	uint32_t subdirs;
+	if(inode_get(d, ino, NULL, &ent, &subdirs) != 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
 	}
 
-	// Update entry mode
-	ent.mode = mode;
-	if(dir_write(d, addr, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
-		return -ENOENT;
+	fill_stats(req, ino, &ent, subdirs, &stats);
+	fuse_reply_attr(req, &stats, mount->timeout);
+	syslog(LOG_INFO, "retreived attributes for inode %" PRIu64, ino);
+}
+
+void fatfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+	const struct fatfs_mount *mount = userdata;
+
+	// Writes are done as few large requests
+	if(conn->max_write > FATFS_MAX_WRITE) {
+		conn->max_write = FATFS_MAX_WRITE;
 	}
 
-	syslog(LOG_INFO, "changed permissions for '%s'", path);
-	return 0;
+	// Mount options such as writeback_cache, splice_read, and max_write come last and take precedence
+	fuse_apply_conn_info_opts(mount->conn_options, conn);
+	syslog(LOG_INFO, "initialized connection with %u byte writes", conn->max_write);
+}
+
+void fatfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	syslog(LOG_DEBUG, "looking up '%s' in inode %" PRIu64, name, parent);
+
+	struct fuse_entry_param entry;
+	const int err = fill_entry(req, parent, name, &entry);
+
+	// Missing entries are cached by kernel as entries with inode number zero
+	if(err == -ENOENT) {
+		entry.ino = 0;
+		fuse_reply_entry(req, &entry);
+		return;
+	}
+
+	if(err != 0) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+
+	fuse_reply_entry(req, &entry);
+	syslog(LOG_INFO, "looked up '%s' in inode %" PRIu64 " as inode %" PRIu64, name, parent, entry.ino);
+}
+
+void fatfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	syslog(LOG_DEBUG, "creating directory '%s' in inode %" PRIu64, name, parent);
+
+	if(FATFS_DEFRAG(parent, name)) {
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
+
+	struct fuse_entry_param entry;
+	int err = make_entry(FATFS_DISK(req), parent, name, mode | S_IFDIR);
+	if(err == 0) {
+		err = fill_entry(req, parent, name, &entry);
+	}
+
+	if(err != 0) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+
+	fuse_reply_entry(req, &entry);
+	syslog(LOG_INFO, "created directory '%s' in inode %" PRIu64, name, parent);
+}
+
+void fatfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t dev)
+{
+	syslog(LOG_DEBUG, "creating file '%s' in inode %" PRIu64, name, parent);
+
+	if(FATFS_DEFRAG(parent, name)) {
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
+
+	struct fuse_entry_param entry;
+	int err = make_entry(FATFS_DISK(req), parent, name, mode | S_IFREG);
+	if(err == 0) {
+		err = fill_entry(req, parent, name, &entry);
+	}
+
+	if(err != 0) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+
+	fuse_reply_entry(req, &entry);
+	syslog(LOG_INFO, "created file '%s' in inode %" PRIu64, name, parent);
+}
+
+void fatfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *file_info)
+{
+	syslog(LOG_DEBUG, "opening inode %" PRIu64, ino);
+
+	// Control file content is generated on every read so it has no size to cache
+	if(ino == FATFS_DEFRAG_INO) {
+		file_info->direct_io = 1;
+		fuse_reply_open(req, file_info);
+		return;
+	}
+
+	disk d = FATFS_DISK(req);
+	JOURNAL_SCOPE(d);
+
+	// Need entry to check if it can be opened
+	struct entry ent;
+	if(inode_get(d, ino, NULL, &ent, NULL) != 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	// Entry is not a file
+	if(!S_ISREG(ent.mode)) {
+		syslog(LOG_ERR, "inode %" PRIu64 " is not a file", ino);
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+
+	// Open handles keep an unlinked file until they are released
+	if(inode_open(d, ino) != 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	// Every change to file data passes through kernel so its cached pages stay valid
+	file_info->keep_cache = FATFS_MOUNT(req)->timeout > 0;
+	fuse_reply_open(req, file_info);
+	syslog(LOG_INFO, "opened inode %" PRIu64, ino);
 }
 
-int fatfs_getattr(const char *path, struct stat *stats)
+void fatfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *file_info)
 {
-	syslog(LOG_DEBUG, "retreiving attributes for '%s'", path);
+	syslog(LOG_DEBUG, "reading %zu bytes at offset %zd from inode %" PRIu64, size, offset, ino);
+
+	// Reading control file reports fragmentation and buffer usage
+	// Measuring takes its own journaled operations
+	// Replies are built in scratch memory reused by the next request of this thread
+	disk d = FATFS_DISK(req);
+	char *buffer = pool_scratch(size);
+	if(!buffer) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
 
-	struct fuse_context *context = fuse_get_context();
-	disk d = FATFS_DISK(fuse_get_context());
+	const int read = ino == FATFS_DEFRAG_INO ? read_defrag(d, buffer, size, offset) : read_entry(d, ino, buffer, size, offset);
+	if(read < 0) {
+		fuse_reply_err(req, -read);
+	} else {
+		fuse_reply_buf(req, buffer, read);
+		syslog(LOG_INFO, "read %d bytes at offset %zd from inode %" PRIu64, read, offset, ino);
+	}
+}
+
+void fatfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *file_info)
+{
+	syslog(LOG_DEBUG, "reading entries for inode %" PRIu64 " from offset %zd", ino, offset);
+
+	char *buffer = pool_scratch(size);
+	if(!buffer) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	const int filled = read_children(req, ino, buffer, size, offset, false);
+	if(filled < 0) {
+		fuse_reply_err(req, -filled);
+	} else {
+		fuse_reply_buf(req, buffer, filled);
+		syslog(LOG_INFO, "read entries for inode %" PRIu64, ino);
+	}
+}
+
+void fatfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *file_info)
+{
+	syslog(LOG_DEBUG, "reading entries with attributes for inode %" PRIu64 " from offset %zd", ino, offset);
+
+	char *buffer = pool_scratch(size);
+	if(!buffer) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	// Kernel caches every child so listing attributes needs no lookup per child
+	const int filled = read_children(req, ino, buffer, size, offset, true);
+	if(filled < 0) {
+		fuse_reply_err(req, -filled);
+	} else {
+		fuse_reply_buf(req, buffer, filled);
+		syslog(LOG_INFO, "read entries with attributes for inode %" PRIu64, ino);
+	}
+}
+
+void fatfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *file_info)
+{
+	syslog(LOG_DEBUG, "releasing inode %" PRIu64, ino);
+
+	disk d = FATFS_DISK(req);
+	uint64_t parent;
+	char name[ENTRY_LONG_NAME_LENGTH + 1];
+
+	// Last handle of a file that was unlinked while open removes it
+	if(ino != FATFS_DEFRAG_INO && inode_release(d, ino, &parent, name) != 0 && remove_entry(d, parent, name, false) != 0) {
+		syslog(LOG_ERR, "failed to remove hidden file '%s' in inode %" PRIu64, name, parent);
+	}
+
+	fuse_reply_err(req, 0);
+	syslog(LOG_INFO, "released inode %" PRIu64, ino);
+}
+
+void fatfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	syslog(LOG_DEBUG, "renaming '%s' in inode %" PRIu64 " to '%s' in inode %" PRIu64, name, parent, newname, newparent);
+
+	if(FATFS_DEFRAG(parent, name) || FATFS_DEFRAG(newparent, newname)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+
+	disk d = FATFS_DISK(req);
+	const int err = rename_entry(d, parent, name, newparent, newname, flags);
+
+	// Cached entries of both parents are unknown after a failed rename
+	if(err != 0) {
+		reload_entry(d, parent);
+		reload_entry(d, newparent);
+		fuse_reply_err(req, -err);
+		return;
+	}
+
+	fuse_reply_err(req, 0);
+	syslog(LOG_INFO, "renamed '%s' in inode %" PRIu64 " to '%s' in inode %" PRIu64, name, parent, newname, newparent);
+}
+
+void fatfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	syslog(LOG_DEBUG, "removing directory '%s' in inode %" PRIu64, name, parent);
+
+	disk d = FATFS_DISK(req);
+	const int err = remove_entry(d, parent, name, true);
+	if(err != 0) {
+		reload_entry(d, parent);
+		fuse_reply_err(req, -err);
+		return;
+	}
+
+	fuse_reply_err(req, 0);
+	syslog(LOG_INFO, "removed directory '%s' in inode %" PRIu64, name, parent);
+}
+
+void fatfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *file_info)
+{
+	syslog(LOG_DEBUG, "changing attributes %#x of inode %" PRIu64, to_set, ino);
+
+	// Control file has no attributes to change
+	if(ino == FATFS_DEFRAG_INO) {
+		fatfs_getattr(req, ino, file_info);
+		return;
+	}
+
+	const int err = set_attributes(FATFS_DISK(req), ino, attr, to_set);
+	if(err != 0) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+
+	// Reply with attributes as they are now
+	fatfs_getattr(req, ino, file_info);
+	syslog(LOG_INFO, "changed attributes %#x of inode %" PRIu64, to_set, ino);
+}
+
+void fatfs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	syslog(LOG_DEBUG, "retreiving filesystem statistics");
+
+	disk d = FATFS_DISK(req);
+	JOURNAL_SCOPE(d);
 	const struct superblock *sb = disk_superblock(d);
 
-	// Need entry data
+	// Initially clear stats
+	struct statvfs stats;
+	memset(&stats, 0, sizeof(stats));
+
+	stats.f_bsize = sb->block_size;
+	stats.f_frsize = sb->block_size;
+	stats.f_blocks = sb->block_count;
+	stats.f_bfree = block_count_free(d);
+	stats.f_bavail = stats.f_bfree;
+	stats.f_namemax = ENTRY_NAME_MAX(sb);
+
+	fuse_reply_statfs(req, &stats);
+	syslog(LOG_INFO, "retreived filesystem statistics");
+}
+
+void fatfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	syslog(LOG_DEBUG, "removing file '%s' in inode %" PRIu64, name, parent);
+
+	if(FATFS_DEFRAG(parent, name)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+
+	disk d = FATFS_DISK(req);
+	const int err = remove_entry(d, parent, name, false);
+	if(err != 0) {
+		reload_entry(d, parent);
+		fuse_reply_err(req, -err);
+		return;
+	}
+
+	fuse_reply_err(req, 0);
+	syslog(LOG_INFO, "removed file '%s' in inode %" PRIu64, name, parent);
+}
+
+void fatfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *file_info)
+{
+	const size_t size = fuse_buf_size(bufv);
+	syslog(LOG_DEBUG, "writing %zu bytes at offset %zd to inode %" PRIu64, size, offset, ino);
+
+	disk d = FATFS_DISK(req);
+
+	// Writing control file defragments disk
+	// Each moved block list commits on its own so defragmenting is not one huge journaled operation
+	if(ino == FATFS_DEFRAG_INO) {
+		struct defrag_report report;
+		if(defrag_disk(d, &report) != 0) {
+			fuse_reply_err(req, EIO);
+			return;
+		}
+
+		fuse_reply_write(req, size);
+		return;
+	}
+
+	// Data already in memory is written as is while spliced data is copied out of its pipe first
+	struct fuse_bufvec data = FUSE_BUFVEC_INIT(size);
+	if(bufv->count == 1 && bufv->off == 0 && !(bufv->buf[0].flags & FUSE_BUF_IS_FD)) {
+		data.buf[0].mem = bufv->buf[0].mem;
+	} else {
+		data.buf[0].mem = pool_scratch(size);
+		if(!data.buf[0].mem) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+
+		const ssize_t copied = fuse_buf_copy(&data, bufv, 0);
+		if(copied < 0) {
+			fuse_reply_err(req, -copied);
+			return;
+		}
+
+		data.buf[0].size = copied;
+	}
+
+	const int wrote = write_entry(d, ino, data.buf[0].mem, data.buf[0].size, offset);
+
+	if(wrote < 0) {
+		fuse_reply_err(req, -wrote);
+		return;
+	}
+
+	fuse_reply_write(req, wrote);
+	syslog(LOG_INFO, "wrote %d bytes at offset %zd to inode %" PRIu64, wrote, offset, ino);
+}
+
+size_t add_entry(fuse_req_t req, char *buffer, size_t size, const char *name, const struct fuse_entry_param *entry, off_t offset, bool plus)
+{
+	return plus ? fuse_add_direntry_plus(req, buffer, size, name, entry, offset)
+		: fuse_add_direntry(req, buffer, size, name, &entry->attr, offset);
+}
+
+int fill_child(fuse_req_t req, uint64_t parent, const char *name, address addr, struct fuse_entry_param *entry)
+{
+	const struct fatfs_mount *mount = FATFS_MOUNT(req);
+	disk d = mount->d;
+
+	memset(entry, 0, sizeof(*entry));
+	entry->attr_timeout = mount->timeout;
+	entry->entry_timeout = mount->timeout;
+
+	if(inode_lookup_at(d, parent, name, addr, &entry->ino, &entry->generation) != 0) {
+		return -EIO;
+	}
+
+	// Need entry data and child directories for links
 	struct entry ent;
-	if(obj_get(d, path, NULL, &ent) != 0) {
+	uint32_t subdirs;
+	if(inode_get(d, entry->ino, NULL, &ent, &subdirs) != 0) {
+		inode_forget(d, entry->ino, 1);
+		return -EIO;
+	}
+
+	fill_stats(req, entry->ino, &ent, subdirs, &entry->attr);
+	return 0;
+}
+
+void fill_defrag_stats(fuse_req_t req, struct stat *stats)
+{
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+
+	memset(stats, 0, sizeof(*stats));
+	stats->st_ino = FATFS_DEFRAG_INO;
+	stats->st_mode = S_IFREG | 0600;
+	stats->st_nlink = 1;
+	stats->st_uid = context->uid;
+	stats->st_gid = context->gid;
+}
+
+int fill_entry(fuse_req_t req, uint64_t parent, const char *name, struct fuse_entry_param *entry)
+{
+	const struct fatfs_mount *mount = FATFS_MOUNT(req);
+
+	memset(entry, 0, sizeof(*entry));
+	entry->attr_timeout = mount->timeout;
+	entry->entry_timeout = mount->timeout;
+
+	if(FATFS_DEFRAG(parent, name)) {
+		entry->ino = FATFS_DEFRAG_INO;
+		fill_defrag_stats(req, &entry->attr);
+		return 0;
+	}
+
+	disk d = mount->d;
+	JOURNAL_SCOPE(d);
+
+	if(inode_lookup(d, parent, name, &entry->ino, &entry->generation) != 0) {
 		return -ENOENT;
 	}
 
+	// Need entry data and child directories for links
+	struct entry ent;
+	uint32_t subdirs;
+	if(inode_get(d, entry->ino, NULL, &ent, &subdirs) != 0) {
+		inode_forget(d, entry->ino, 1);
+		return -EIO;
+	}
+
+	fill_stats(req, entry->ino, &ent, subdirs, &entry->attr);
+	return 0;
+}
+
+void fill_stats(fuse_req_t req, uint64_t number, const struct entry *ent, uint32_t subdirs, struct stat *stats)
+{
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+	const struct superblock *sb = disk_superblock(FATFS_DISK(req));
+
 	// Initially clear stats
 	memset(stats, 0, sizeof(*stats));
 
-	stats->st_mode = ent.mode;
+	stats->st_ino = number;
+	stats->st_mode = ent->mode;
 	stats->st_uid = context->uid;
 	stats->st_gid = context->gid;
 	stats->st_blksize = sb->block_size;
-	stats->st_blocks = ent.size == 0 ? 0 : (ent.size - 1) / sb->block_size + 1;
-	stats->st_atime = ent.access_time;
-	stats->st_mtime = ent.modify_time;
-	stats->st_ctime = ent.modify_time;
+	stats->st_blocks = ent->size == 0 ? 0 : (ent->size - 1) / sb->block_size + 1;
+	stats->st_atime = ent->access_time;
+	stats->st_mtime = ent->modify_time;
+	stats->st_ctime = ent->modify_time;
 
-	if(S_ISDIR(ent.mode)) {
+	if(S_ISDIR(ent->mode)) {
 		// Directory is a directory
-		stats->st_nlink = 2 + ent.size / sizeof(struct entry); // Count all the . and .. links
+		stats->st_nlink = 2 + subdirs; // Count . link and .. links of child directories
 		stats->st_size = stats->st_blksize * stats->st_blocks;
-	} else if(S_ISREG(ent.mode)) {
+	} else if(S_ISREG(ent->mode)) {
 		// Directory is a file
 		stats->st_nlink = 1;
-		stats->st_size = ent.size;
+		stats->st_size = ent->size;
 	}
-
-	syslog(LOG_INFO, "retreived attributes for '%s'", path);
-	return 0;
 }
 
-int fatfs_mkdir(const char *path, mode_t mode)
+int hide_entry(disk d, uint64_t parent, const char *name, uint64_t number)
 {
-	syslog(LOG_DEBUG, "creating directory '%s'", path);
+	char hidden[ENTRY_NAME_LENGTH + 1];
+	snprintf(hidden, sizeof(hidden), FATFS_HIDDEN_FORMAT, number);
 
-	disk d = FATFS_DISK(fuse_get_context());
-	if(obj_make(d, path, mode | S_IFDIR) != 0) {
-		return -ENOENT;
+	const int err = rename_entry(d, parent, name, parent, hidden, 0);
+	if(err != 0) {
+		return err;
 	}
 
-	syslog(LOG_INFO, "created directory '%s'", path);
+	inode_hide(d, number);
+	syslog(LOG_DEBUG, "hid open file '%s' in inode %" PRIu64 " as '%s'", name, parent, hidden);
 	return 0;
 }
 
-int fatfs_mknod(const char *path, mode_t mode, dev_t dev)
+int make_entry(disk d, uint64_t parent, const char *name, uint32_t mode)
 {
-	syslog(LOG_DEBUG, "creating file '%s'", path);
+	JOURNAL_SCOPE(d);
+	const struct superblock *sb = disk_superblock(d);
+
+	// Make sure name is not too long
+	if(strlen(name) > ENTRY_NAME_MAX(sb)) {
+		return -ENAMETOOLONG;
+	}
 
-	disk d = FATFS_DISK(fuse_get_context());
-	if(obj_make(d, path, mode | S_IFREG) != 0) {
+	address addr;
+	struct entry ent;
+	if(inode_get(d, parent, &addr, &ent, NULL) != 0) {
 		return -ENOENT;
 	}
 
-	syslog(LOG_INFO, "created file '%s'", path);
+	if(!S_ISDIR(ent.mode)) {
+		return -ENOTDIR;
+	}
+
+	// Fill entry data
+	time_t t = time(NULL);
+	struct entry child =
+	{
+    	.create_time = t,
+    	.modify_time = t,
+    	.access_time = t,
+    	.size = 0,
+    	.start_block = BLOCK_LAST,
+    	.mode = mode,
+    	.free_slot = 0,
+	};
+
+	// Long names need their own storage
+	if(entry_rename(d, &child, name) != 0) {
+		return -ENOSPC;
+	}
+
+	if(entry_link(d, addr, &child, NULL) != 0) {
+		entry_release(d, &child);
+		inode_update(d, addr);
+		return -ENOSPC;
+	}
+
+	inode_link(d, parent, mode);
 	return 0;
 }
 
-int fatfs_open(const char *path, struct fuse_file_info *file_info)
+int read_children(fuse_req_t req, uint64_t number, char *buffer, size_t size, off_t offset, bool plus)
 {
-	syslog(LOG_DEBUG, "opening directory '%s'", path);
-
-	disk d = FATFS_DISK(fuse_get_context());
+	disk d = FATFS_DISK(req);
+	JOURNAL_SCOPE(d);
+	const struct superblock *sb = disk_superblock(d);
 
-	// Need entry to check if it can be opened
-	struct entry ent;
-	if(obj_get(d, path, NULL, &ent) != 0) {
+	address addr;
+	struct entry parent;
+	if(inode_get(d, number, &addr, &parent, NULL) != 0) {
 		return -ENOENT;
 	}
 
-	// Entry is not a file
-	if(!S_ISREG(ent.mode)) {
-		syslog(LOG_ERR, "'%s' is not a file", path);
-		return -ENOENT;
+	if(!S_ISDIR(parent.mode)) {
+		return -ENOTDIR;
 	}
 
-	syslog(LOG_INFO, "opened directory '%s'", path);
-	return 0;
+	// Generated links have no inode number for kernel to cache
+	struct fuse_entry_param entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.attr.st_ino = number;
+	entry.attr.st_mode = S_IFDIR;
+	size_t filled = 0;
+
+	// Fill generated links
+	// Kernel does not use inode number of parent link so it gets the one of the directory
+	if(offset < 1) {
+		const size_t length = add_entry(req, buffer + filled, size - filled, ".", &entry, 1, plus);
+		if(length > size - filled) {
+			return filled;
+		}
+
+		filled += length;
+	}
+
+	if(offset < 2) {
+		const size_t length = add_entry(req, buffer + filled, size - filled, "..", &entry, 2, plus);
+		if(length > size - filled) {
+			return filled;
+		}
+
+		filled += length;
+	}
+
+	// Children are filled from last to first since entry data is linked backward
+	// Offset after a child is its index so remaining children are the ones before it
+	const uint32_t count = parent.size / sizeof(struct entry);
+	uint32_t remaining = offset < FATFS_READDIR_CHILDREN ? count : offset - FATFS_READDIR_CHILDREN;
+	if(remaining > count) {
+		remaining = count;
+	}
+
+	// Seek to end of last remaining child
+	address current = {parent.start_block, ENTRY_FIRST_CHUNK_SIZE(sb, parent)};
+	if(remaining > 0) {
+		current = dir_seek(d, current, (count - remaining) * sizeof(struct entry));
+	}
+
+	struct entry children[FATFS_READDIR_CHUNK];
+	char name[ENTRY_LONG_NAME_LENGTH + 1];
+
+	// Read children chunk by chunk until done or buffer is full
+	while(remaining > 0) {
+		const uint32_t chunk = remaining < FATFS_READDIR_CHUNK ? remaining : FATFS_READDIR_CHUNK;
+		const uint32_t chunk_size = chunk * sizeof(struct entry);
+		// Children already filled are returned since kernel may hold references to them
+		if(dir_read(d, current, children, chunk_size) != chunk_size) {
+			return filled > 0 ? (int) filled : -EIO;
+		}
+
+		remaining -= chunk;
+
+		for(uint32_t i = chunk; i-- > 0;) {
+			// Unlinked slots are skipped but keep their offset
+			if(ENTRY_TOMBSTONE(children[i])) {
+				continue;
+			}
+
+			if(entry_name(d, &children[i], name) != 0) {
+				return filled > 0 ? (int) filled : -EIO;
+			}
+
+			// Plain listing only uses inode number and mode of child stats
+			const address child = dir_seek(d, current, (chunk - 1 - i) * sizeof(struct entry));
+			if(!plus) {
+				entry.attr.st_ino = inode_number(d, child);
+				entry.attr.st_mode = children[i].mode;
+			} else if(fill_child(req, number, name, child, &entry) != 0) {
+				return filled > 0 ? (int) filled : -EIO;
+			}
+
+			const size_t length = add_entry(req, buffer + filled, size - filled, name, &entry, FATFS_READDIR_CHILDREN + remaining + i, plus);
+			if(length > size - filled) {
+				// Kernel only gains references to children that fit
+				if(plus) {
+					inode_forget(d, entry.ino, 1);
+				}
+
+				syslog(LOG_INFO, "read partial entries for inode %" PRIu64, number);
+				return filled;
+			}
+
+			filled += length;
+		}
+
+		if(remaining > 0) {
+			current = dir_seek(d, current, chunk_size);
+		}
+	}
+
+	return filled;
 }
 
-int fatfs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *file_info)
+int read_defrag(disk d, char *buffer, size_t size, off_t offset)
 {
-	syslog(LOG_DEBUG, "reading %zu bytes at offset %zd from '%s'", size, offset, path);
+	struct defrag_report report;
+	if(defrag_measure(d, &report) != 0) {
+		return -EIO;
+	}
 
-	disk d = FATFS_DISK(fuse_get_context());
+	// Buffer usage is reported along with fragmentation
+	char description[512];
+	int length = defrag_print(&report, description, sizeof(description));
+	if(length < (int) sizeof(description)) {
+		length += pool_print(description + length, sizeof(description) - length);
+	}
+
+	length = length < (int) sizeof(description) ? length : (int) sizeof(description) - 1;
+	if(offset < 0 || offset >= length) {
+		return 0;
+	}
+
+	const size_t amount = (size_t) (length - offset) < size ? (size_t) (length - offset) : size;
+	memcpy(buffer, description + offset, amount);
+	return amount;
+}
+
+int read_entry(disk d, uint64_t number, char *buffer, size_t size, off_t offset)
+{
+	JOURNAL_SCOPE(d);
 
 	address addr;
-	if(obj_get(d, path, &addr, NULL) != 0) {
+	if(inode_get(d, number, &addr, NULL, NULL) != 0) {
 		return -ENOENT;
 	}
 
 	// Offset needs to be positive
 	if(offset < 0) {
 		syslog(LOG_ERR, "invalid offset %zd", offset);
-		return -ENOENT;
+		return -EINVAL;
+	}
+
+	// Nothing is stored past what an entry size can represent
+	if(offset >= UINT32_MAX) {
+		return 0;
+	}
+
+	const uint32_t read = entry_read(d, addr, offset, buffer, size);
+	if(!disk_readonly(d)) {
+		inode_update(d, addr); // Reading updates access time
 	}
 
-	uint32_t read = entry_read(d, addr, offset, buffer, size);
-	memset(buffer + read, 0, size - read); // Zero the untouched part of buffer
-	syslog(LOG_INFO, "read %u bytes at offset %u from '%s'", read, offset, path);
 	return read;
 }
 
-int fatfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *file_info)
+void reload_entry(disk d, uint64_t number)
 {
-	syslog(LOG_DEBUG, "reading entries for '%s'", path);
-
-	disk d = FATFS_DISK(fuse_get_context());
+	address addr;
+	if(inode_get(d, number, &addr, NULL, NULL) == 0) {
+		inode_reload(d, addr);
+	}
+}
 
-	// Fill generated links
-	filler(buffer, ".", NULL, 0);
-	filler(buffer, "..", NULL, 0);
+int remove_entry(disk d, uint64_t parent, const char *name, bool directory)
+{
+	JOURNAL_SCOPE(d);
+	const struct superblock *sb = disk_superblock(d);
 
-	address addr;
-	struct entry parent;
-	if(obj_get(d, path, &addr, &parent) != 0) {
+	address parent_addr;
+	if(inode_get(d, parent, &parent_addr, NULL, NULL) != 0) {
 		return -ENOENT;
 	}
 
-	struct entry *children = malloc(parent.size);
-	if(entry_read(d, addr, 0, children, parent.size) != parent.size) {
-		free(children);
+	uint32_t slot;
+	const address addr = entry_find(d, parent_addr, name, &slot);
+	struct entry ent;
+	if(!DIR_ADDRESS_VALID(sb, addr) || dir_read(d, addr, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
 		return -ENOENT;
 	}
 
-	for(uint32_t i = 0; i < parent.size / sizeof(struct entry); ++i) {
-		filler(buffer, children[i].name, NULL, 0);
+	if(directory) {
+		if(!S_ISDIR(ent.mode)) {
+			return -ENOTDIR;
+		}
+
+		// Directories without children never keep tombstones
+		if(ent.size != 0) {
+			return -ENOTEMPTY;
+		}
+	} else if(S_ISDIR(ent.mode)) {
+		return -EISDIR;
+	}
+
+	// Open files keep their data until their last handle is released
+	uint64_t number;
+	if(inode_opened(d, parent, name, &number)) {
+		return hide_entry(d, parent, name, number);
+	}
+
+	if(entry_unlink(d, parent_addr, addr, slot) != 0) {
+		return -EIO;
+	}
+
+	inode_unlink(d, parent, name, ent.mode);
+
+	// Entry is unreachable so all of its data can be freed at once
+	if(entry_release(d, &ent) != 0) {
+		return -EIO;
 	}
 
-	free(children);
-	syslog(LOG_INFO, "read entries for '%s'", path);
 	return 0;
 }
 
-int fatfs_rename(const char *oldpath, const char *newpath)
+int rename_entry(disk d, uint64_t parent, const char *name, uint64_t newparent, const char *newname, unsigned int flags)
 {
-	syslog(LOG_DEBUG, "renaming '%s' to '%s'", oldpath, newpath);
+	JOURNAL_SCOPE(d);
+	const struct superblock *sb = disk_superblock(d);
+
+	// Entries can only be moved and not exchanged
+	if(flags & ~RENAME_NOREPLACE) {
+		return -EINVAL;
+	}
 
-	disk d = FATFS_DISK(fuse_get_context());
+	// Make sure name is not too long
+	if(strlen(newname) > ENTRY_NAME_MAX(sb)) {
+		return -ENAMETOOLONG;
+	}
 
-	address oldaddr;
+	// Renaming an entry to itself changes nothing
+	const bool same_parent = parent == newparent;
+	if(same_parent && strcmp(name, newname) == 0) {
+		return 0;
+	}
+
+	address oldparent_addr;
+	address newparent_addr;
+	if(inode_get(d, parent, &oldparent_addr, NULL, NULL) != 0 || inode_get(d, newparent, &newparent_addr, NULL, NULL) != 0) {
+		return -ENOENT;
+	}
+
+	uint32_t oldslot;
+	const address oldaddr = entry_find(d, oldparent_addr, name, &oldslot);
 	struct entry oldent;
-	if(obj_get(d, oldpath, &oldaddr, &oldent) != 0) {
+	if(!DIR_ADDRESS_VALID(sb, oldaddr) || dir_read(d, oldaddr, &oldent, sizeof(struct entry)) != sizeof(struct entry)) {
 		return -ENOENT;
 	}
 
-	// Rename old entry
-	const char *name = strrchr(newpath, '/') + 1;
-	strcpy(oldent.name, name);
+	address newaddr = entry_find(d, newparent_addr, newname, NULL);
+	if(DIR_ADDRESS_VALID(sb, newaddr)) {
+		if(flags & RENAME_NOREPLACE) {
+			return -EEXIST;
+		}
+
+		struct entry newent;
+		if(dir_read(d, newaddr, &newent, sizeof(struct entry)) != sizeof(struct entry)) {
+			return -EIO;
+		}
 
-	// Remove entry at new path if it exists
-	struct entry newent;
-	if(obj_get(d, newpath, NULL, &newent) == 0) {
 		if(S_ISDIR(newent.mode)) {
 			if(!S_ISDIR(oldent.mode)) {
 				return -EISDIR;
@@ -206,142 +1069,197 @@ int fatfs_rename(const char *oldpath, const char *newpath)
 			return -ENOTDIR;
 		}
 
-		if(obj_remove(d, newpath) != 0) {
-			return -ENOENT;
+		// Open replaced file is hidden instead so its data stays until it is released
+		// Hiding renames in place so old entry keeps its address
+		uint64_t number;
+		if(inode_opened(d, newparent, newname, &number)) {
+			const int err = hide_entry(d, newparent, newname, number);
+			if(err != 0) {
+				return err;
+			}
+
+			newaddr = DIR_ADDRESS_INVALID;
 		}
 	}
 
-	// Move entry from old path to new path
+	if(DIR_ADDRESS_VALID(sb, newaddr)) {
+		// Replace entry named newname
+		struct entry newent;
+		if(dir_read(d, newaddr, &newent, sizeof(struct entry)) != sizeof(struct entry)) {
+			return -EIO;
+		}
 
-	if(obj_make(d, newpath, 0) != 0) {
-		return -ENOENT;
-	}
+		// Swap names so old entry takes over replaced slot and name
+		char swapped[sizeof(oldent.name)];
+		memcpy(swapped, oldent.name, sizeof(swapped));
+		memcpy(oldent.name, newent.name, sizeof(swapped));
+		memcpy(newent.name, swapped, sizeof(swapped));
 
-	address newaddr;
-	if(obj_get(d, newpath, &newaddr, NULL) != 0) {
-		return -ENOENT;
-	}
+		if(dir_write(d, newaddr, &oldent, sizeof(struct entry)) != sizeof(struct entry)) {
+			return -EIO;
+		}
 
-	if(dir_write(d, newaddr, &oldent, sizeof(struct entry)) != sizeof(struct entry)) {
-		return -ENOENT;
-	}
+		// Release replaced contents along with previous name of old entry
+		if(entry_release(d, &newent) != 0) {
+			return -EIO;
+		}
 
-	if(obj_unlink(d, oldpath) != 0) {
-		return -ENOENT;
-	}
+		// Replaced entry is gone before renamed entry takes its address
+		inode_unlink(d, newparent, newname, newent.mode);
+		inode_rename(d, parent, name, newparent, newname, oldent.mode, newaddr);
 
-	syslog(LOG_INFO, "renamed '%s' to '%s'", oldpath, newpath);
-}
+		if(entry_unlink(d, oldparent_addr, oldaddr, oldslot) != 0) {
+			return -EIO;
+		}
 
-int fatfs_rmdir(const char *path)
-{
-	syslog(LOG_DEBUG, "removing directory '%s'", path);
+		inode_update(d, oldparent_addr);
+	} else {
+		// Rename old entry keeping its previous name until it is replaced
+		struct entry renamed = oldent;
+		if(entry_rename(d, &renamed, newname) != 0) {
+			return -ENOSPC;
+		}
 
-	disk d = FATFS_DISK(fuse_get_context());
+		if(same_parent) {
+			// Rewrite name in place
+			if(dir_write(d, oldaddr, &renamed, sizeof(struct entry)) != sizeof(struct entry)) {
+				entry_release_name(d, &renamed);
+				return -EIO;
+			}
 
-	if(obj_remove(d, path) != 0) {
-		return -ENOENT;
+			inode_rename(d, parent, name, newparent, newname, oldent.mode, oldaddr);
+		} else {
+			// Move entry to new parent
+			if(entry_link(d, newparent_addr, &renamed, &newaddr) != 0) {
+				entry_release_name(d, &renamed);
+				return -ENOSPC;
+			}
+
+			inode_rename(d, parent, name, newparent, newname, oldent.mode, newaddr);
+
+			if(entry_unlink(d, oldparent_addr, oldaddr, oldslot) != 0) {
+				return -EIO;
+			}
+
+			inode_update(d, oldparent_addr);
+		}
+
+		if(entry_release_name(d, &oldent) != 0) {
+			return -EIO;
+		}
 	}
 
-	syslog(LOG_INFO, "removed directory '%s'", path);
 	return 0;
 }
 
-int fatfs_truncate(const char *path, off_t size)
+int set_attributes(disk d, uint64_t number, const struct stat *attr, int to_set)
 {
-	syslog(LOG_DEBUG, "truncating '%s' to %zd bytes", path, size);
-
-	disk d = FATFS_DISK(fuse_get_context());
+	JOURNAL_SCOPE(d);
 
 	address addr;
 	struct entry ent;
-	if(obj_get(d, path, &addr, &ent) != 0) {
+	if(inode_get(d, number, &addr, &ent, NULL) != 0) {
 		return -ENOENT;
 	}
 
-	if(size > ent.size) {
-		const uint32_t amount = size - ent.size;
-		if(entry_alloc(d, addr, amount) != amount) {
-			return -ENOENT;
+	// Owner is always the mounting user
+	if(to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		return -ENOSYS;
+	}
+
+	if(to_set & FUSE_SET_ATTR_SIZE) {
+		if(!S_ISREG(ent.mode)) {
+			return -EISDIR;
 		}
-	} else if(size < ent.size) {
-		const uint32_t amount = ent.size - size;
-		if(entry_free(d, addr, amount) != amount) {
-			return -ENOENT;
+
+		// Entry size cannot represent the new size
+		if(attr->st_size > UINT32_MAX) {
+			return -EFBIG;
 		}
-	}
 
-	syslog(LOG_INFO, "truncated '%s' to %zd bytes", path, size);
-	return 0;
-}
+		uint32_t changed = 0;
+		uint32_t amount = 0;
+		if(attr->st_size > ent.size) {
+			amount = attr->st_size - ent.size;
+			changed = entry_alloc(d, addr, amount, true);
+		} else if(attr->st_size < ent.size) {
+			amount = ent.size - attr->st_size;
+			changed = entry_free(d, addr, amount);
+		}
 
-int fatfs_unlink(const char *path)
-{
-	syslog(LOG_DEBUG, "removing file '%s'", path);
+		// Resizing rewrote entry
+		inode_update(d, addr);
+		if(changed != amount) {
+			return -ENOSPC;
+		}
 
-	disk d = FATFS_DISK(fuse_get_context());
-	if(obj_remove(d, path) != 0) {
-		return -ENOENT;
+		if(dir_read(d, addr, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
+			return -EIO;
+		}
 	}
 
-	syslog(LOG_INFO, "removed file '%s'", path);
-	return 0;
-}
-
-int fatfs_utimens(const char *path, const struct timespec tv[2])
-{
-	syslog(LOG_DEBUG, "updating access and modify times for '%s'", path);
+	if(!(to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+		return 0;
+	}
 
-	disk d = FATFS_DISK(fuse_get_context());
+	// Only permissions change and never the type of entry
+	if(to_set & FUSE_SET_ATTR_MODE) {
+		ent.mode = (ent.mode & S_IFMT) | (attr->st_mode & ~S_IFMT);
+	}
 
-	address addr;
-	struct entry ent;
-	if(obj_get(d, path, &addr, &ent) != 0) {
-		return -ENOENT;
+	const time_t t = time(NULL);
+	if(to_set & FUSE_SET_ATTR_ATIME) {
+		ent.access_time = to_set & FUSE_SET_ATTR_ATIME_NOW ? t : attr->st_atime;
 	}
 
-	// Update access and modify times
-	ent.access_time = tv[0].tv_sec;
-	ent.modify_time = tv[1].tv_sec;
+	if(to_set & FUSE_SET_ATTR_MTIME) {
+		ent.modify_time = to_set & FUSE_SET_ATTR_MTIME_NOW ? t : attr->st_mtime;
+	}
 
 	// Write changes
-	if(dir_write(d, addr, &ent, sizeof(struct entry)) != sizeof(struct entry)) {
-		return -ENOENT;
+	const uint32_t wrote = dir_write(d, addr, &ent, sizeof(struct entry));
+	inode_update(d, addr);
+	if(wrote != sizeof(struct entry)) {
+		return -EIO;
 	}
 
-	syslog(LOG_INFO, "updated access and modify times for '%s'", path);
 	return 0;
 }
 
-int fatfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *file_info)
+int write_entry(disk d, uint64_t number, const char *buffer, size_t size, off_t offset)
 {
-	syslog(LOG_DEBUG, "writing %zu bytes at offset %zd from '%s'", size, offset, path);
-
-	disk d = FATFS_DISK(fuse_get_context());
+	JOURNAL_SCOPE(d);
 
 	address addr;
 	struct entry ent;
-	if(obj_get(d, path, &addr, &ent) != 0) {
+	if(inode_get(d, number, &addr, &ent, NULL) != 0) {
 		return -ENOENT;
 	}
 
 	// Offset needs to be positive
 	if(offset < 0) {
 		syslog(LOG_ERR, "invalid offset %zd", offset);
-		return -ENOENT;
+		return -EINVAL;
+	}
+
+	// Entry size cannot represent the new end
+	if(offset + size > UINT32_MAX) {
+		return -EFBIG;
 	}
 
 	const uint32_t end = offset + size;
 
 	// Need to allocate more space
+	// Skipped over bytes past the old end must read as zero
 	if(end > ent.size) {
 		const uint32_t amount = end - ent.size;
-		if(entry_alloc(d, addr, amount) != amount) {
-			return -ENOENT;
+		if(entry_alloc(d, addr, amount, offset > ent.size) != amount) {
+			inode_update(d, addr);
+			return -ENOSPC;
 		}
 	}
 
-	uint32_t wrote = entry_write(d, addr, offset, buffer, size);
-	syslog(LOG_INFO, "wrote %u bytes at offset %u from '%s'", wrote, offset, path);
+	const uint32_t wrote = entry_write(d, addr, offset, buffer, size);
+	inode_update(d, addr);
 	return wrote;
 }
@@ -1,34 +1,62 @@
 #ifndef OP_H
 #define OP_H
 
-#include <fuse/fuse.h>
+#define FUSE_USE_VERSION 35
+#include "disk.h"
+#include <fuse_lowlevel.h>
 
-// FUSE callback functions
+// Mounted disk along with settings shared by every callback
+struct fatfs_mount {
+	disk d;
+	double timeout; // Seconds kernel may cache entries and attributes
+	struct fuse_conn_info_opts *conn_options; // Connection options given on command line
+};
 
-int fatfs_chmod(const char *path, mode_t mode);
+// FUSE low-level callback functions
+// Inode numbers are the ones of the inode table of the mounted disk
 
-int fatfs_getattr(const char *path, struct stat *stats);
+void fatfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *file_info);
 
-int fatfs_mkdir(const char *path, mode_t mode);
+void fatfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *file_info);
 
-int fatfs_mknod(const char *path, mode_t mode, dev_t dev);
+void fatfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *file_info);
 
-int fatfs_open(const char *path, struct fuse_file_info *file_info);
+void fatfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t lookups);
 
-int fatfs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *file_info);
+void fatfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets);
 
-int fatfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *file_info);
+void fatfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *file_info);
 
-int fatfs_rename(const char *oldpath, const char *newpath);
+void fatfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *file_info);
 
-int fatfs_rmdir(const char *path);
+void fatfs_init(void *userdata, struct fuse_conn_info *conn);
 
-int fatfs_truncate(const char *path, off_t size);
+void fatfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
 
-int fatfs_unlink(const char *path);
+void fatfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
 
-int fatfs_utimens(const char *path, const struct timespec tv[2]);
+void fatfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t dev);
 
-int fatfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *file_info);
+void fatfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *file_info);
+
+void fatfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *file_info);
+
+void fatfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *file_info);
+
+void fatfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *file_info);
+
+void fatfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *file_info);
+
+void fatfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags);
+
+void fatfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
+
+void fatfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *file_info);
+
+void fatfs_statfs(fuse_req_t req, fuse_ino_t ino);
+
+void fatfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+
+void fatfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *file_info);
 
 #endif
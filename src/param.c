@@ -1,8 +1,9 @@
 #include "param.h"
+#include "disk.h"
+#include <inttypes.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/stat.h>
 
 #define FATFS_OPT(t, p, v) {t, offsetof(struct fatfs_params, p), v}
 
@@ -51,6 +52,33 @@ int param_parse(struct fatfs_params *outparams, int argc, char **argv)
 		// Format Options
 		FATFS_OPT("-b %u", block_size, 0),
 		FATFS_OPT("--block_size=%u", block_size, 0),
+		FATFS_OPT("-i %u", inline_size, 0),
+		FATFS_OPT("--inline_size=%u", inline_size, 0),
+		FATFS_OPT("-j %u", journal_blocks, 0),
+		FATFS_OPT("--journal_blocks=%u", journal_blocks, 0),
+		FATFS_OPT("-e", extents, 1),
+		FATFS_OPT("--extents", extents, 1),
+		FATFS_OPT("-d", dedup, 1),
+		FATFS_OPT("--dedup", dedup, 1),
+
+		// Check options
+		FATFS_OPT("-r", repair, 1),
+		FATFS_OPT("--repair", repair, 1),
+
+		// Snapshot options
+		FATFS_OPT("-l", list, 1),
+		FATFS_OPT("--list", list, 1),
+		FATFS_OPT("--delete=%u", delete_id, 0),
+
+		// Mount options
+		FATFS_OPT("async_reclaim", async_reclaim, 1),
+		FATFS_OPT("cache_timeout=%u", cache_timeout, 0),
+		FATFS_OPT("commit=%d", commit_interval, 0),
+		FATFS_OPT("direct", direct, 1),
+		FATFS_OPT("discard", discard, 1),
+		FATFS_OPT("ro", readonly, 1),
+		FUSE_OPT_KEY("ro", FUSE_OPT_KEY_KEEP), // Kernel must refuse writes too
+		FATFS_OPT("snapshot=%u", snapshot, 0),
 
 		// General options
 		FUSE_OPT_KEY("-V", KEY_VERSION),
@@ -63,9 +91,11 @@ int param_parse(struct fatfs_params *outparams, int argc, char **argv)
 
 	struct fatfs_params params = FATFS_PARAMS_INIT(argc, argv);
 
-	struct stat st;
-	stat("/", &st);
-	params.block_size = st.st_blksize; // block size defaults host filesystem block size
+	params.block_size = DISK_BLOCK_SIZE_DEFAULT; // block size of an image does not depend on where it was formatted
+	params.inline_size = 256;
+	params.journal_blocks = UINT32_MAX; // journal size defaults to one full transaction
+	params.commit_interval = -1; // commit interval defaults to journal default
+	params.cache_timeout = 3600; // kernel may cache for long since fatfs is the only writer to its disk
 
 	int err = fuse_opt_parse(&params.args, &params, options, &opt_proc);
 	*outparams = params;
@@ -75,7 +105,19 @@ int param_parse(struct fatfs_params *outparams, int argc, char **argv)
 int parse_nonopt(struct fatfs_params *outparams, const char *arg)
 {
 	if(!outparams->base_cmd) {
-		if(strcmp(arg, "format") == 0) {
+		if(strcmp(arg, "check") == 0) {
+			outparams->base_cmd = CMD_CHECK;
+			outparams->cmd = CMD_CHECK;
+			return 0;
+		} else if(strcmp(arg, "dedup") == 0) {
+			outparams->base_cmd = CMD_DEDUP;
+			outparams->cmd = CMD_DEDUP;
+			return 0;
+		} else if(strcmp(arg, "defrag") == 0) {
+			outparams->base_cmd = CMD_DEFRAG;
+			outparams->cmd = CMD_DEFRAG;
+			return 0;
+		} else if(strcmp(arg, "format") == 0) {
 			outparams->base_cmd = CMD_FORMAT;
 			outparams->cmd = CMD_FORMAT;
 			return 0;
@@ -83,6 +125,10 @@ int parse_nonopt(struct fatfs_params *outparams, const char *arg)
 			outparams->base_cmd = CMD_MOUNT;
 			outparams->cmd = CMD_MOUNT;
 			return 0;
+		} else if(strcmp(arg, "snapshot") == 0) {
+			outparams->base_cmd = CMD_SNAPSHOT;
+			outparams->cmd = CMD_SNAPSHOT;
+			return 0;
 		}
 	} else if(!outparams->disk_path) {
 		outparams->disk_path = arg;
@@ -91,7 +137,7 @@ int parse_nonopt(struct fatfs_params *outparams, const char *arg)
 		switch(outparams->base_cmd) {
 			case CMD_FORMAT:
 				if(!outparams->size) {
-					sscanf(arg, "%u%c", &outparams->size, &outparams->unit);
+					sscanf(arg, "%" SCNu64 "%c", &outparams->size, &outparams->unit);
 					return 0;
 				}
 				break;
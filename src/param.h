@@ -1,16 +1,20 @@
 #ifndef PARAM_H
 #define PARAM_H
 
-#define FUSE_USE_VERSION 26
-#include <fuse.h>
+#include <fuse_opt.h>
+#include <stdint.h>
 
-#define FATFS_PARAMS_INIT(argc, argv) {FUSE_ARGS_INIT(argc, argv), NULL, 0, 0, 0, '\0', 0, NULL}
+#define FATFS_PARAMS_INIT(argc, argv) {FUSE_ARGS_INIT(argc, argv), NULL, 0, 0, 0, '\0', 0, 0, 0, 0, 0, 0, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0}
 
 enum command
 {
-	CMD_FORMAT = 1,
+	CMD_CHECK = 1,
+	CMD_DEDUP,
+	CMD_DEFRAG,
+	CMD_FORMAT,
 	CMD_HELP,
 	CMD_MOUNT,
+	CMD_SNAPSHOT,
 	CMD_VERSION,
 };
 
@@ -23,12 +27,30 @@ struct fatfs_params
 	enum command cmd;
 
 	// Format parameters
-	uint32_t size;
+	uint64_t size;
 	char unit;
 	uint32_t block_size;
+	uint32_t inline_size;
+	uint32_t journal_blocks;
+	int extents;
+	int dedup;
+
+	// Check parameters
+	int repair;
 
 	// Mount parameters
 	const char *mount_path;
+	int discard;
+	int direct;
+	int readonly;
+	int async_reclaim;
+	int commit_interval;
+	unsigned cache_timeout;
+	uint32_t snapshot; // Snapshot to mount read-only, zero for the disk itself
+
+	// Snapshot parameters
+	int list;
+	uint32_t delete_id;
 };
 
 // Parse command-line arguments to setup fatfs parameters
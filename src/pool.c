@@ -0,0 +1,196 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+// An idle buffer waiting in pool of a thread
+struct pool_buffer {
+	struct pool_buffer *next;
+};
+
+// Idle buffers of a single size
+struct pool_class {
+	size_t size; // Zero when class is unused
+	struct pool_buffer *idle;
+	uint32_t idle_count;
+};
+
+// Buffers and scratch memory of a thread
+struct pool_thread {
+	struct pool_class classes[POOL_THREAD_CLASSES];
+	void *scratch;
+	size_t scratch_size;
+};
+
+// Thread pools are freed when their threads exit
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+// Usage shared by all threads
+static uint64_t pool_buffers;
+static uint64_t pool_peak_buffers;
+static uint64_t pool_peak_scratch;
+
+// Find class of buffers of size bytes in pool claiming an unused one when needed
+// Returns NULL when every class holds another size
+struct pool_class *pool_class(struct pool_thread *pool, size_t size);
+
+// Get pool of calling thread creating it when needed
+// Returns NULL on failure
+struct pool_thread *pool_thread(void);
+
+// Free idle buffers and scratch memory of an exiting thread
+void pool_thread_free(void *data);
+
+// Create key of thread pools
+void pool_thread_key(void);
+
+// Raise peak to value unless it is already higher
+void pool_raise(uint64_t *peak, uint64_t value);
+
+void *pool_get(size_t size)
+{
+	struct pool_thread *pool = pool_thread();
+	struct pool_class *class = pool ? pool_class(pool, size) : NULL;
+	void *buffer = NULL;
+
+	// Reuse an idle buffer of the same size
+	if(class && class->idle) {
+		buffer = class->idle;
+		class->idle = class->idle->next;
+		--class->idle_count;
+	} else if(posix_memalign(&buffer, size, size) != 0) {
+		syslog(LOG_ERR, "failed to allocate buffer of %zu bytes", size);
+		return NULL;
+	}
+
+	pool_raise(&pool_peak_buffers, __atomic_add_fetch(&pool_buffers, 1, __ATOMIC_RELAXED));
+	return buffer;
+}
+
+void pool_put(void *buffer, size_t size)
+{
+	if(!buffer) {
+		return;
+	}
+
+	__atomic_sub_fetch(&pool_buffers, 1, __ATOMIC_RELAXED);
+
+	// Keep only a few idle buffers of a few sizes so threads do not hoard memory
+	struct pool_thread *pool = pool_thread();
+	struct pool_class *class = pool ? pool_class(pool, size) : NULL;
+	if(!class || class->idle_count == POOL_THREAD_BUFFERS) {
+		free(buffer);
+		return;
+	}
+
+	struct pool_buffer *idle = buffer;
+	idle->next = class->idle;
+	class->idle = idle;
+	++class->idle_count;
+}
+
+int pool_print(char *buffer, size_t size)
+{
+	struct pool_report report;
+	pool_report(&report);
+	return snprintf(buffer, size, "%lu block buffers in use, %lu at most, %lu bytes of scratch memory at most\n",
+			(unsigned long) report.buffers,
+			(unsigned long) report.peak_buffers,
+			(unsigned long) report.peak_scratch);
+}
+
+void pool_report(struct pool_report *report)
+{
+	report->buffers = __atomic_load_n(&pool_buffers, __ATOMIC_RELAXED);
+	report->peak_buffers = __atomic_load_n(&pool_peak_buffers, __ATOMIC_RELAXED);
+	report->peak_scratch = __atomic_load_n(&pool_peak_scratch, __ATOMIC_RELAXED);
+}
+
+void *pool_scratch(size_t size)
+{
+	struct pool_thread *pool = pool_thread();
+	if(!pool) {
+		return NULL;
+	}
+
+	// Scratch memory only grows so requests of a thread stop allocating
+	if(size > pool->scratch_size) {
+		void *scratch = realloc(pool->scratch, size);
+		if(!scratch) {
+			syslog(LOG_ERR, "failed to allocate %zu bytes of scratch memory", size);
+			return NULL;
+		}
+
+		pool->scratch = scratch;
+		pool->scratch_size = size;
+		pool_raise(&pool_peak_scratch, size);
+	}
+
+	return pool->scratch;
+}
+
+struct pool_class *pool_class(struct pool_thread *pool, size_t size)
+{
+	struct pool_class *unused = NULL;
+	for(uint32_t i = 0; i < POOL_THREAD_CLASSES; ++i) {
+		if(pool->classes[i].size == size) {
+			return &pool->classes[i];
+		}
+
+		if(!unused && pool->classes[i].size == 0) {
+			unused = &pool->classes[i];
+		}
+	}
+
+	if(unused) {
+		unused->size = size;
+	}
+
+	return unused;
+}
+
+struct pool_thread *pool_thread(void)
+{
+	pthread_once(&pool_once, pool_thread_key);
+
+	struct pool_thread *pool = pthread_getspecific(pool_key);
+	if(!pool) {
+		pool = calloc(1, sizeof(struct pool_thread));
+		if(pool && pthread_setspecific(pool_key, pool) != 0) {
+			free(pool);
+			pool = NULL;
+		}
+	}
+
+	return pool;
+}
+
+void pool_thread_free(void *data)
+{
+	struct pool_thread *pool = data;
+	for(uint32_t i = 0; i < POOL_THREAD_CLASSES; ++i) {
+		while(pool->classes[i].idle) {
+			struct pool_buffer *idle = pool->classes[i].idle;
+			pool->classes[i].idle = idle->next;
+			free(idle);
+		}
+	}
+
+	free(pool->scratch);
+	free(pool);
+}
+
+void pool_thread_key(void)
+{
+	pthread_key_create(&pool_key, pool_thread_free);
+}
+
+void pool_raise(uint64_t *peak, uint64_t value)
+{
+	uint64_t current = __atomic_load_n(peak, __ATOMIC_RELAXED);
+	while(value > current && !__atomic_compare_exchange_n(peak, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
@@ -0,0 +1,42 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Maximum amount of idle buffers of each size kept by each thread
+#define POOL_THREAD_BUFFERS	8
+
+// Maximum amount of buffer sizes kept by each thread
+#define POOL_THREAD_CLASSES	4
+
+// Usage of block buffers and scratch memory across threads
+struct pool_report {
+	uint64_t buffers; // Block buffers handed out and not yet returned
+	uint64_t peak_buffers; // Most block buffers handed out at once
+	uint64_t peak_scratch; // Largest scratch memory of a thread in bytes
+};
+
+// Get a buffer of size bytes aligned to size from pool of calling thread
+// Size must be a power of two such as a block size or a chunk of blocks
+// Buffer contents are undefined
+// Returns NULL on failure
+void *pool_get(size_t size);
+
+// Return buffer of size bytes from pool_get to pool of calling thread
+// Buffer can be NULL
+void pool_put(void *buffer, size_t size);
+
+// Describe usage of buffers and scratch memory in buffer of size bytes
+// Returns amount of bytes described had buffer been large enough
+int pool_print(char *buffer, size_t size);
+
+// Get usage of buffers and scratch memory
+void pool_report(struct pool_report *report);
+
+// Get scratch memory of size bytes of calling thread
+// Memory is reused by the next call on the same thread so it only lasts for a single request
+// Returns NULL on failure
+void *pool_scratch(size_t size);
+
+#endif
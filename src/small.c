@@ -0,0 +1,298 @@
+#include "pool.h"
+#include "small.h"
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+// Amount of FAT bytes read at once while scanning for small blocks
+#define SMALL_SCAN_SIZE (1 << 20)
+
+// Find small blocks by scanning FAT once
+// Store must be locked
+// Returns non-zero on failure
+int small_load(disk disk, struct small_store *store);
+
+// Add small block to candidates unless it is already one
+// Store must be locked
+void small_offer(struct small_store *store, block small);
+
+// Stop using small block as a candidate
+// Store must be locked
+void small_unlist(struct small_store *store, block small);
+
+int small_alloc(disk disk, block *small, uint32_t *cell)
+{
+	syslog(LOG_DEBUG, "allocating small cell");
+
+	const struct superblock *sb = disk_superblock(disk);
+	struct small_store *store = disk_small_store(disk);
+	const uint32_t cell_count = SMALL_CELL_COUNT(sb);
+	uint8_t *buffer = pool_get(sb->block_size);
+
+	pthread_mutex_lock(&store->lock);
+
+	if(small_load(disk, store) != 0) {
+		pthread_mutex_unlock(&store->lock);
+		pool_put(buffer, sb->block_size);
+		return -1;
+	}
+
+	// Use a free cell of the most recent candidate dropping full and unlisted ones
+	while(store->count > 0) {
+		const block b = store->candidates[store->count - 1];
+		if(!(store->listed[b / 64] & (1ull << (b % 64)))) {
+			--store->count;
+			continue;
+		}
+
+		if(block_read(disk, b, buffer) != 0) {
+			pthread_mutex_unlock(&store->lock);
+			pool_put(buffer, sb->block_size);
+			return -1;
+		}
+
+		uint32_t c = 0;
+		while(c < cell_count && buffer[c / 8] & (1 << (c % 8))) {
+			++c;
+		}
+
+		if(c == cell_count) {
+			--store->count;
+			small_unlist(store, b);
+			continue;
+		}
+
+		buffer[c / 8] |= 1 << (c % 8);
+		memset(buffer + SMALL_CELL_OFFSET(sb, c), 0, sb->inline_size);
+		if(block_write(disk, b, buffer) != 0) {
+			pthread_mutex_unlock(&store->lock);
+			pool_put(buffer, sb->block_size);
+			return -1;
+		}
+
+		*small = b;
+		*cell = c;
+		pthread_mutex_unlock(&store->lock);
+		pool_put(buffer, sb->block_size);
+		syslog(LOG_DEBUG, "allocated small cell %u:%u", b, c);
+		return 0;
+	}
+
+	// Every small block is full so start a new one
+	const block b = block_alloc(disk, BLOCK_SMALL);
+	if(!BLOCK_VALID(b)) {
+		pthread_mutex_unlock(&store->lock);
+		pool_put(buffer, sb->block_size);
+		return -1;
+	}
+
+	memset(buffer, 0, sb->block_size);
+	buffer[0] = 1;
+	if(block_write(disk, b, buffer) != 0) {
+		block_free(disk, b);
+		pthread_mutex_unlock(&store->lock);
+		pool_put(buffer, sb->block_size);
+		return -1;
+	}
+
+	if(cell_count > 1) {
+		small_offer(store, b);
+	}
+
+	*small = b;
+	*cell = 0;
+	pthread_mutex_unlock(&store->lock);
+	pool_put(buffer, sb->block_size);
+	syslog(LOG_DEBUG, "allocated small cell %u:%u", b, 0);
+	return 0;
+}
+
+uint32_t small_access(disk disk, block small, uint32_t cell, uint32_t offset, void *readdata, const void *writedata, uint32_t size)
+{
+	const struct superblock *sb = disk_superblock(disk);
+	struct small_store *store = disk_small_store(disk);
+
+	// Access cannot go past cell end
+	if(offset >= sb->inline_size) {
+		return 0;
+	}
+
+	if(size > sb->inline_size - offset) {
+		size = sb->inline_size - offset;
+	}
+
+	// Reads only need the cell so large blocks are not read in full
+	if(!writedata) {
+		return block_read_range(disk, small, SMALL_CELL_OFFSET(sb, cell) + offset, size, readdata) == 0 ? size : 0;
+	}
+
+	uint8_t *buffer = pool_get(sb->block_size);
+	uint8_t *data = buffer + SMALL_CELL_OFFSET(sb, cell) + offset;
+
+	// Other cells of the block may be written concurrently
+	pthread_mutex_lock(&store->lock);
+
+	if(block_read(disk, small, buffer) != 0) {
+		size = 0;
+	} else {
+		if(readdata) {
+			memcpy(readdata, data, size);
+		}
+
+		memcpy(data, writedata, size);
+		if(block_write(disk, small, buffer) != 0) {
+			size = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&store->lock);
+	pool_put(buffer, sb->block_size);
+	return size;
+}
+
+void small_destroy(struct small_store *store)
+{
+	pthread_mutex_destroy(&store->lock);
+	free(store->candidates);
+	free(store->listed);
+}
+
+int small_free(disk disk, block small, uint32_t cell)
+{
+	syslog(LOG_DEBUG, "freeing small cell %u:%u", small, cell);
+
+	const struct superblock *sb = disk_superblock(disk);
+	struct small_store *store = disk_small_store(disk);
+	const uint32_t bitmap_size = SMALL_BITMAP_SIZE(sb);
+	uint8_t *buffer = pool_get(sb->block_size);
+
+	pthread_mutex_lock(&store->lock);
+
+	if(small_load(disk, store) != 0 || block_read(disk, small, buffer) != 0) {
+		pthread_mutex_unlock(&store->lock);
+		pool_put(buffer, sb->block_size);
+		return -1;
+	}
+
+	buffer[cell / 8] &= ~(1 << (cell % 8));
+
+	// Check whether any cell is still used
+	uint32_t used = 0;
+	for(uint32_t i = 0; i < bitmap_size && !used; ++i) {
+		used = buffer[i];
+	}
+
+	int err = 0;
+	if(used) {
+		err = block_write(disk, small, buffer);
+		small_offer(store, small);
+	} else {
+		// Stop using block before it can be allocated again
+		small_unlist(store, small);
+		err = block_free(disk, small);
+	}
+
+	pthread_mutex_unlock(&store->lock);
+	pool_put(buffer, sb->block_size);
+
+	if(err != 0) {
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "freed small cell %u:%u", small, cell);
+	return 0;
+}
+
+void small_init(struct small_store *store)
+{
+	pthread_mutex_init(&store->lock, NULL);
+	store->candidates = NULL;
+	store->count = 0;
+	store->capacity = 0;
+	store->listed = NULL;
+	store->listed_count = 0;
+	store->loaded = false;
+}
+
+int small_load(disk disk, struct small_store *store)
+{
+	if(store->loaded) {
+		return 0;
+	}
+
+	syslog(LOG_DEBUG, "loading small blocks");
+
+	const struct superblock *sb = disk_superblock(disk);
+	const uint32_t entry_count = BLOCK_FAT_ENTRY_COUNT(sb);
+	const uint32_t chunk_block_count = sb->block_size < SMALL_SCAN_SIZE ? SMALL_SCAN_SIZE / sb->block_size : 1;
+	block *fat_buffer = malloc((size_t) chunk_block_count * sb->block_size);
+	store->listed = calloc(sb->block_count / 64 + 1, sizeof(uint64_t));
+
+	// Full small blocks are dropped once allocation finds them full
+	for(uint32_t i = 0; i < sb->fat_block_count;) {
+		const uint32_t chunk_count = sb->fat_block_count - i < chunk_block_count ? sb->fat_block_count - i : chunk_block_count;
+		if(block_read_many(disk, BLOCK_FAT + i, chunk_count, fat_buffer) != 0) {
+			free(fat_buffer);
+			return -1;
+		}
+
+		for(uint32_t j = 0; j < chunk_count * entry_count; ++j) {
+			const uint64_t b = (uint64_t) i * entry_count + j;
+			if(b >= sb->block_count || fat_buffer[j] != (block) BLOCK_SMALL) {
+				continue;
+			}
+
+			small_offer(store, b);
+		}
+
+		i += chunk_count;
+	}
+
+	free(fat_buffer);
+	store->loaded = true;
+	syslog(LOG_DEBUG, "loaded %u small blocks", store->count);
+	return 0;
+}
+
+void small_offer(struct small_store *store, block small)
+{
+	if(store->listed[small / 64] & (1ull << (small % 64))) {
+		return;
+	}
+
+	store->listed[small / 64] |= 1ull << (small % 64);
+	++store->listed_count;
+
+	// Unlisted and repeated blocks are dropped before candidates grow when they make up half of them
+	if(store->count == store->capacity && store->count >= store->listed_count * 2) {
+		uint32_t kept = 0;
+		for(uint32_t i = 0; i < store->count; ++i) {
+			const block b = store->candidates[i];
+			if(store->listed[b / 64] & (1ull << (b % 64))) {
+				store->listed[b / 64] &= ~(1ull << (b % 64));
+				store->candidates[kept++] = b;
+			}
+		}
+
+		for(uint32_t i = 0; i < kept; ++i) {
+			store->listed[store->candidates[i] / 64] |= 1ull << (store->candidates[i] % 64);
+		}
+
+		store->count = kept;
+	}
+
+	if(store->count == store->capacity) {
+		store->capacity = store->capacity ? store->capacity * 2 : 64;
+		store->candidates = realloc(store->candidates, store->capacity * sizeof(block));
+	}
+
+	store->candidates[store->count++] = small;
+}
+
+void small_unlist(struct small_store *store, block small)
+{
+	if(store->listed[small / 64] & (1ull << (small % 64))) {
+		store->listed[small / 64] &= ~(1ull << (small % 64));
+		--store->listed_count;
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef SMALL_H
+#define SMALL_H
+
+#include "block.h"
+#include <pthread.h>
+
+// Small blocks start with a bitmap of used cells followed by cells of superblock inline size bytes
+#define SMALL_CELL_COUNT(sb)		(((uint64_t) sb->block_size * 8) / ((uint64_t) sb->inline_size * 8 + 1))
+#define SMALL_BITMAP_SIZE(sb)		((SMALL_CELL_COUNT(sb) + 7) / 8)
+#define SMALL_CELL_OFFSET(sb, cell)	(SMALL_BITMAP_SIZE(sb) + (cell) * sb->inline_size)
+
+// Small blocks of a disk that may have free cells
+// Candidates are a stack where blocks no longer listed are skipped when they come up
+struct small_store {
+	pthread_mutex_t lock;
+	block *candidates;
+	uint32_t count;
+	uint32_t capacity;
+	uint64_t *listed; // Bitmap of blocks that are candidates
+	uint32_t listed_count; // Amount of blocks in bitmap
+	bool loaded; // Candidates were found by scanning FAT
+};
+
+// Allocate a zeroed cell in a small block
+// Returns non-zero on failure
+int small_alloc(disk disk, block *small, uint32_t *cell);
+
+// Access at most size bytes of cell data at offset
+// Stops accessing at cell end
+// Returns amount of bytes accessed
+uint32_t small_access(disk disk, block small, uint32_t cell, uint32_t offset, void *readdata, const void *writedata, uint32_t size);
+
+// Release resources of small block store
+void small_destroy(struct small_store *store);
+
+// Free cell in a small block
+// Small block is freed once all of its cells are free
+// Returns non-zero on failure
+int small_free(disk disk, block small, uint32_t cell);
+
+// Initialize an empty small block store
+void small_init(struct small_store *store);
+
+#endif
@@ -0,0 +1,424 @@
+#include "dedup.h"
+#include "entry.h"
+#include "extent.h"
+#include "journal.h"
+#include "pool.h"
+#include "small.h"
+#include "snapshot.h"
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+// Extent blocks mapped by copied extent maps
+// Blocks appear once for each file block mapping them
+struct snapshot_blocks {
+	block *blocks;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+// Give entry copies of its directory, extent map, long name, or inline data
+// Children of directories are copied first
+// Extent blocks the copy maps are added to blocks and gain their references once the whole tree is copied
+// Returns non-zero on failure
+int snapshot_copy(disk d, struct entry *ent, struct snapshot_blocks *blocks);
+
+// Free entry and everything below it
+// Extent blocks only lose references when referenced is set and are left alone otherwise
+// Returns non-zero on failure
+int snapshot_free(disk d, const struct entry *ent, bool referenced);
+
+// Read root entry held alone by root block
+// Returns non-zero on failure
+int snapshot_read_root(disk d, block root_block, struct entry *root);
+
+// Write count snapshots to a new snapshot table and free previous table
+// Returns non-zero on failure
+int snapshot_store(disk d, const struct snapshot *snapshots, uint32_t count);
+
+int snapshot_create(disk d, uint32_t *id)
+{
+	syslog(LOG_DEBUG, "creating snapshot");
+
+	const struct superblock *sb = disk_superblock(d);
+
+	// Files in block lists would have to be copied whole
+	if(!(sb->features & DISK_FEATURE_EXTENTS)) {
+		syslog(LOG_ERR, "snapshots need a disk formatted with extents");
+		return -1;
+	}
+
+	struct snapshot *snapshots;
+	uint32_t count;
+	if(snapshot_list(d, &snapshots, &count) != 0) {
+		return -1;
+	}
+
+	JOURNAL_SCOPE(d);
+
+	struct entry root;
+	struct snapshot_blocks blocks = {NULL, 0, 0};
+	if(snapshot_read_root(d, sb->root_block, &root) != 0 || snapshot_copy(d, &root, &blocks) != 0) {
+		free(blocks.blocks);
+		free(snapshots);
+		return -1;
+	}
+
+	// Copied root entry is alone in its block like root entry of disk
+	const block root_block = block_alloc(d, BLOCK_LAST);
+	int err = !BLOCK_VALID(root_block);
+	if(err == 0) {
+		uint8_t *buffer = pool_get(sb->block_size);
+		memset(buffer, 0, sb->block_size);
+		memcpy(buffer, &root, sizeof(struct entry));
+		err = block_write(d, root_block, buffer);
+		pool_put(buffer, sb->block_size);
+
+		if(err != 0) {
+			block_free(d, root_block);
+		}
+	}
+
+	// Copies are only freed while their extent blocks have not gained references
+	if(err == 0 && dedup_add(d, blocks.blocks, blocks.count) != 0) {
+		block_free(d, root_block);
+		err = -1;
+	}
+
+	free(blocks.blocks);
+	if(err != 0) {
+		if(snapshot_free(d, &root, false) != 0) {
+			syslog(LOG_ERR, "failed to free copies of failed snapshot");
+		}
+
+		free(snapshots);
+		return -1;
+	}
+
+	// Ids of deleted snapshots may be reused once newer ones are gone
+	uint32_t next = 1;
+	for(uint32_t i = 0; i < count; ++i) {
+		next = snapshots[i].id >= next ? snapshots[i].id + 1 : next;
+	}
+
+	snapshots = realloc(snapshots, (count + 1) * sizeof(struct snapshot));
+	snapshots[count] = (struct snapshot) {next, root_block, time(NULL)};
+
+	// Shared blocks keep their added references so a failed table write is left for checking to repair
+	err = snapshot_store(d, snapshots, count + 1);
+	free(snapshots);
+	if(err != 0) {
+		syslog(LOG_CRIT, "failed to record snapshot at %u", root_block);
+		return -1;
+	}
+
+	*id = next;
+	syslog(LOG_INFO, "created snapshot %u at %u", next, root_block);
+	return 0;
+}
+
+int snapshot_delete(disk d, uint32_t id)
+{
+	syslog(LOG_DEBUG, "deleting snapshot %u", id);
+
+	struct snapshot *snapshots;
+	uint32_t count;
+	if(snapshot_list(d, &snapshots, &count) != 0) {
+		return -1;
+	}
+
+	uint32_t index = 0;
+	while(index < count && snapshots[index].id != id) {
+		++index;
+	}
+
+	if(index == count) {
+		free(snapshots);
+		syslog(LOG_ERR, "no snapshot %u", id);
+		return -1;
+	}
+
+	JOURNAL_SCOPE(d);
+
+	// Snapshot leaves table first so a failed free only leaks blocks
+	const block root_block = snapshots[index].root_block;
+	memmove(snapshots + index, snapshots + index + 1, (count - index - 1) * sizeof(struct snapshot));
+	struct entry root;
+	if(snapshot_read_root(d, root_block, &root) != 0 || snapshot_store(d, snapshots, count - 1) != 0) {
+		free(snapshots);
+		return -1;
+	}
+
+	free(snapshots);
+	if(snapshot_free(d, &root, true) != 0 || block_free(d, root_block) != 0) {
+		syslog(LOG_CRIT, "failed to free snapshot %u", id);
+		return -1;
+	}
+
+	syslog(LOG_INFO, "deleted snapshot %u", id);
+	return 0;
+}
+
+int snapshot_list(disk d, struct snapshot **snapshots, uint32_t *count)
+{
+	const struct superblock *sb = disk_superblock(d);
+	const uint32_t per_block = SNAPSHOT_BLOCK_COUNT(sb);
+	*snapshots = NULL;
+	*count = 0;
+
+	// Disks without the feature have no table
+	if(!(sb->features & DISK_FEATURE_SNAPSHOT)) {
+		return 0;
+	}
+
+	uint8_t *buffer = pool_get(sb->block_size);
+	uint32_t block_count = 0;
+	for(block current = sb->snapshot_block; current != BLOCK_LAST; current = block_next(d, current)) {
+		// Lists can never be longer than the disk
+		uint32_t stored = 0;
+		const bool valid = BLOCK_VALID(current) && block_count++ < sb->block_count && block_read(d, current, buffer) == 0;
+		if(valid) {
+			memcpy(&stored, buffer, sizeof(uint32_t));
+		}
+
+		if(!valid || stored > per_block) {
+			pool_put(buffer, sb->block_size);
+			free(*snapshots);
+			*snapshots = NULL;
+			*count = 0;
+			syslog(LOG_ERR, "invalid snapshot table at %u", sb->snapshot_block);
+			return -1;
+		}
+
+		if(stored > 0) {
+			*snapshots = realloc(*snapshots, (*count + stored) * sizeof(struct snapshot));
+			memcpy(*snapshots + *count, buffer + sizeof(uint32_t), stored * sizeof(struct snapshot));
+			*count += stored;
+		}
+	}
+
+	pool_put(buffer, sb->block_size);
+	return 0;
+}
+
+block snapshot_root(disk d, uint32_t id)
+{
+	struct snapshot *snapshots;
+	uint32_t count;
+	if(snapshot_list(d, &snapshots, &count) != 0) {
+		return BLOCK_INVALID;
+	}
+
+	block root_block = BLOCK_INVALID;
+	for(uint32_t i = 0; i < count && root_block == BLOCK_INVALID; ++i) {
+		if(snapshots[i].id == id) {
+			root_block = snapshots[i].root_block;
+		}
+	}
+
+	free(snapshots);
+	return root_block;
+}
+
+int snapshot_copy(disk d, struct entry *ent, struct snapshot_blocks *blocks)
+{
+	const struct superblock *sb = disk_superblock(d);
+
+	// Tombstones reference nothing
+	if(ENTRY_TOMBSTONE(*ent)) {
+		return 0;
+	}
+
+	struct entry copy = *ent;
+	if(ENTRY_INLINE(*ent)) {
+		block small;
+		uint32_t cell;
+		if(small_alloc(d, &small, &cell) != 0) {
+			return -1;
+		}
+
+		uint8_t *data = malloc(ent->size + 1);
+		if(small_access(d, ent->start_block, ent->inline_cell - 1, 0, data, NULL, ent->size) != ent->size
+				|| small_access(d, small, cell, 0, NULL, data, ent->size) != ent->size) {
+			free(data);
+			small_free(d, small, cell);
+			return -1;
+		}
+
+		free(data);
+		copy.start_block = small;
+		copy.inline_cell = cell + 1;
+	} else if(ENTRY_EXTENTS(sb, *ent)) {
+		struct extent_map map;
+		if(extent_load(d, ent->start_block, &map) != 0) {
+			return -1;
+		}
+
+		for(uint32_t i = 0; i < map.count; ++i) {
+			if(blocks->count + map.extents[i].length > blocks->capacity) {
+				while(blocks->count + map.extents[i].length > blocks->capacity) {
+					blocks->capacity = blocks->capacity ? blocks->capacity * 2 : 64;
+				}
+
+				blocks->blocks = realloc(blocks->blocks, blocks->capacity * sizeof(block));
+			}
+
+			for(uint32_t k = 0; k < map.extents[i].length; ++k) {
+				blocks->blocks[blocks->count++] = map.extents[i].physical + k;
+			}
+		}
+
+		// Blocks added for a failed copy are dropped along with the whole snapshot
+		block head = BLOCK_LAST;
+		const int err = extent_store(d, &head, &map);
+		extent_destroy(&map);
+		if(err != 0) {
+			return -1;
+		}
+
+		copy.start_block = head;
+	} else if(BLOCK_VALID(ent->start_block) && ent->size > 0) {
+		// Directories and other block lists are copied whole
+		const address end = {ent->start_block, ENTRY_FIRST_CHUNK_SIZE(sb, (*ent))};
+		uint8_t *data = malloc(ent->size);
+		if(dir_read(d, end, data, ent->size) != ent->size) {
+			free(data);
+			return -1;
+		}
+
+		struct entry *children = (struct entry *) data;
+		const uint32_t child_count = S_ISDIR(ent->mode) ? ent->size / sizeof(struct entry) : 0;
+		uint32_t copied = 0;
+		while(copied < child_count && snapshot_copy(d, &children[copied], blocks) == 0) {
+			++copied;
+		}
+
+		const block head = copied == child_count ? block_alloc_many(d, BLOCK_LAST, (ent->size - 1) / sb->block_size + 1, 0) : BLOCK_INVALID;
+		const address copy_end = {head, end.end_offset};
+		if(!BLOCK_VALID(head) || dir_write(d, copy_end, data, ent->size) != ent->size) {
+			if(BLOCK_VALID(head)) {
+				block_free_many(d, head, UINT32_MAX);
+			}
+
+			for(uint32_t i = 0; i < copied; ++i) {
+				snapshot_free(d, &children[i], false);
+			}
+
+			free(data);
+			return -1;
+		}
+
+		free(data);
+		copy.start_block = head;
+	} else {
+		copy.start_block = BLOCK_LAST;
+	}
+
+	// Long names are copied last so nothing above has to release them
+	if(ENTRY_LONG_NAME(*ent)) {
+		char name[ENTRY_LONG_NAME_LENGTH + 1];
+		if(entry_name(d, ent, name) != 0 || entry_rename(d, &copy, name) != 0) {
+			struct entry unnamed = copy;
+			memset(unnamed.name, 0, sizeof(unnamed.name));
+			snapshot_free(d, &unnamed, false);
+			return -1;
+		}
+	}
+
+	*ent = copy;
+	return 0;
+}
+
+int snapshot_free(disk d, const struct entry *ent, bool referenced)
+{
+	const struct superblock *sb = disk_superblock(d);
+
+	// Tombstones reference nothing
+	if(ENTRY_TOMBSTONE(*ent)) {
+		return 0;
+	}
+
+	// Children are freed before the directory holding them
+	if(S_ISDIR(ent->mode) && BLOCK_VALID(ent->start_block) && ent->size > 0) {
+		const address end = {ent->start_block, ENTRY_FIRST_CHUNK_SIZE(sb, (*ent))};
+		struct entry *children = malloc(ent->size);
+		if(dir_read(d, end, children, ent->size) != ent->size) {
+			free(children);
+			return -1;
+		}
+
+		int err = 0;
+		for(uint32_t i = 0; i < ent->size / sizeof(struct entry); ++i) {
+			err |= snapshot_free(d, &children[i], referenced);
+		}
+
+		free(children);
+		if(err != 0) {
+			return -1;
+		}
+	}
+
+	// Extent blocks that never gained a reference for the copy belong to the disk
+	if(!referenced && ENTRY_EXTENTS(sb, *ent)) {
+		if(entry_release_name(d, ent) != 0) {
+			return -1;
+		}
+
+		return BLOCK_VALID(ent->start_block) && block_free_many(d, ent->start_block, UINT32_MAX) == BLOCK_INVALID ? -1 : 0;
+	}
+
+	return entry_release(d, ent);
+}
+
+int snapshot_read_root(disk d, block root_block, struct entry *root)
+{
+	const address addr = {root_block, sizeof(struct entry)};
+	if(dir_read(d, addr, root, sizeof(struct entry)) != sizeof(struct entry) || !S_ISDIR(root->mode)) {
+		syslog(LOG_ERR, "invalid root directory at %u", root_block);
+		return -1;
+	}
+
+	return 0;
+}
+
+int snapshot_store(disk d, const struct snapshot *snapshots, uint32_t count)
+{
+	const struct superblock *sb = disk_superblock(d);
+	const uint32_t per_block = SNAPSHOT_BLOCK_COUNT(sb);
+	const uint32_t block_count = (count + per_block - 1) / per_block;
+	const block old = sb->features & DISK_FEATURE_SNAPSHOT ? sb->snapshot_block : BLOCK_LAST;
+
+	// Table is rewritten whole since it only changes when snapshots are created or deleted
+	const block head = block_count > 0 ? block_alloc_many(d, BLOCK_LAST, block_count, 0) : BLOCK_LAST;
+	if(head == BLOCK_INVALID) {
+		return -1;
+	}
+
+	uint8_t *buffer = pool_get(sb->block_size);
+	int err = 0;
+	uint32_t first = 0;
+	for(block current = head; current != BLOCK_LAST && err == 0; current = block_next(d, current)) {
+		const uint32_t stored = count - first < per_block ? count - first : per_block;
+		memset(buffer, 0, sb->block_size);
+		memcpy(buffer, &stored, sizeof(uint32_t));
+		memcpy(buffer + sizeof(uint32_t), snapshots + first, stored * sizeof(struct snapshot));
+		err = block_write(d, current, buffer);
+		first += stored;
+	}
+
+	pool_put(buffer, sb->block_size);
+	if(err != 0 || disk_set_snapshots(d, head) != 0) {
+		if(head != BLOCK_LAST) {
+			block_free_many(d, head, UINT32_MAX);
+		}
+
+		return -1;
+	}
+
+	if(old != BLOCK_LAST && old != BLOCK_FREE && block_free_many(d, old, UINT32_MAX) == BLOCK_INVALID) {
+		syslog(LOG_ERR, "failed to free previous snapshot table at %u", old);
+	}
+
+	return 0;
+}
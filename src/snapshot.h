@@ -0,0 +1,39 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "block.h"
+
+// Amount of snapshots held by a block of the snapshot table
+#define SNAPSHOT_BLOCK_COUNT(sb)	((sb->block_size - sizeof(uint32_t)) / sizeof(struct snapshot))
+
+// A frozen root directory of a disk
+// Snapshot table is a block list where each block starts with its amount of snapshots
+// Root block holds the root entry of the snapshot alone like the root block of a disk
+// Directories, extent maps, long names, and inline files below it belong to the snapshot alone
+// Extent blocks are shared with the disk through reference counts until either side writes them
+struct __attribute__((__packed__)) snapshot {
+	uint32_t id;
+	block root_block;
+	uint64_t create_time;
+};
+
+// Snapshot root directory of disk as one journaled operation
+// Disk must have extents feature so file blocks can be shared
+// Id is set to id of new snapshot
+// Returns non-zero on failure
+int snapshot_create(disk d, uint32_t *id);
+
+// Free everything snapshot id holds and drop its references to shared extent blocks as one journaled operation
+// Returns non-zero on failure
+int snapshot_delete(disk d, uint32_t id);
+
+// Read snapshot table in creation order
+// Snapshots must be freed by caller
+// Returns non-zero on failure
+int snapshot_list(disk d, struct snapshot **snapshots, uint32_t *count);
+
+// Find root block of snapshot id
+// Returns BLOCK_INVALID when there is no such snapshot
+block snapshot_root(disk d, uint32_t id);
+
+#endif